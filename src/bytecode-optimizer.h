@@ -0,0 +1,1053 @@
+#pragma once
+
+#include "bytefile.h"
+#include "control-flow.h"
+#include "executing-visitor.h"
+#include "lama-enums.h"
+#include "predecoding-visitor.h"
+#include "superinstructions.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+// Rewrites a bytefile into a smaller equivalent one. The code is decoded into
+// the predecoded form with jump, call and closure targets turned into
+// instruction indices, instructions are spliced in, deleted or replaced, and
+// the survivors are encoded back with all targets remapped to code offsets.
+// Jump targets are never merged into a preceding instruction, so every
+// pattern below only spans non-target instructions. With a profile, the
+// blocks of every function are finally laid out by their counts.
+class BytecodeOptimizer {
+public:
+  struct Stats {
+    i32 propagated = 0; // argument loads replaced with constants
+    i32 specialized = 0;
+    i32 inlined = 0;
+    i32 folded = 0;
+    i32 reduced = 0;
+    i32 threaded = 0;
+    i32 dropped = 0; // LINE and DUP;DROP
+    i32 dead_functions = 0;
+    i32 dead_insns = 0;
+    i32 moved = 0; // blocks laid out away from their original place
+    i32 cold = 0;  // blocks the profile never reached
+    size_t old_size = 0;
+    size_t new_size = 0;
+  };
+
+  // depth_at is the stack depth before every instruction, from check_depth;
+  // callees larger than inline_budget instructions are not inlined, and
+  // specialized copies add at most specialize_budget instructions in total;
+  // profile, collected on the same bytefile, enables the block layout
+  BytecodeOptimizer(bytefile const *bf, ControlFlowGraph const &cfg,
+                    std::vector<i32> const &depth_at, i32 inline_budget,
+                    i32 specialize_budget,
+                    SequenceProfile const *profile = nullptr)
+      : bf(bf), cfg(cfg), depth_at(depth_at), inline_budget(inline_budget),
+        specialize_budget(specialize_budget), profile(profile) {}
+
+  Stats optimize() {
+    decode();
+    remove_unreachable();
+    specialize_calls();
+    inline_calls();
+    for (size_t i = 0; i < code.size(); i++) {
+      if (code[i].op == Op::LINE && !deleted[i]) {
+        erase(i);
+        stats.dropped++;
+      }
+    }
+    while (peephole()) {
+    }
+    thread_jumps();
+    if (profile != nullptr) {
+      layout_blocks();
+    }
+    encode();
+    stats.old_size = bf->code_end - bf->code_ptr;
+    stats.new_size = out.size();
+    return stats;
+  }
+
+  // Writes the optimized program with the original string table, globals
+  // and public symbols.
+  bool write(char const *fname) const {
+    FILE *f = fopen(fname, "wb");
+    if (f == nullptr) {
+      return false;
+    }
+    i32 header[] = {bf->stringtab_size, bf->global_area_size,
+                    bf->public_symbols_number};
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+    for (i32 i = 0; i < bf->public_symbols_number && ok; i++) {
+      i32 entry[] = {bf->public_ptr[2 * i], new_offset(publics[i])};
+      ok = fwrite(entry, sizeof(entry), 1, f) == 1;
+    }
+    ok = ok && fwrite(bf->stringtab_ptr, 1, bf->stringtab_size, f) ==
+                   (size_t)bf->stringtab_size;
+    ok = ok && fwrite(out.data(), 1, out.size(), f) == out.size();
+    return fclose(f) == 0 && ok;
+  }
+
+private:
+  bytefile const *bf;
+  ControlFlowGraph const &cfg;
+  std::vector<i32> const &depth_at;
+  i32 inline_budget;
+  i32 specialize_budget;
+  SequenceProfile const *profile;
+  std::vector<Insn> code;
+  // original code offset, the one of the original instruction for
+  // specialized copies and -1 for inlined copies
+  std::vector<i32> offsets;
+  std::vector<Capture> captures;
+  std::vector<bool> deleted;
+  std::vector<bool> is_target; // by instruction index
+  std::vector<i32> publics;    // instruction index of every public symbol
+  std::vector<i32> new_offsets;
+  std::vector<u8> out;
+  Stats stats;
+
+  void decode() {
+    auto const code_size = bf->code_end - bf->code_ptr;
+    std::vector<i32> index_at(code_size + 1, -1);
+    auto visitor = PredecodingVisitor{bf, captures};
+    u8 *ip = bf->code_ptr;
+    while (ip < bf->code_end) {
+      auto const [next_ip, insn] =
+          visit_instruction<Insn, true>(bf, ip, visitor);
+      index_at[ip - bf->code_ptr] = (i32)code.size();
+      code.push_back(insn);
+      offsets.push_back((i32)(ip - bf->code_ptr));
+      ip = next_ip;
+    }
+    auto index_of = [&](i32 offset) {
+      if (offset < 0 || offset >= code_size || index_at[offset] < 0) {
+        error("0x%.8x does not point at an instruction", offset);
+      }
+      return index_at[offset];
+    };
+    for (auto &insn : code) {
+      if (has_target(insn.op)) {
+        target_of(insn) = index_of(target_of(insn));
+      }
+    }
+    for (i32 i = 0; i < bf->public_symbols_number; i++) {
+      publics.push_back(index_of(bf->public_ptr[2 * i + 1]));
+    }
+    deleted.assign(code.size(), false);
+    mark_targets();
+  }
+
+  void mark_targets() {
+    is_target.assign(code.size(), false);
+    for (size_t i = 0; i < code.size(); i++) {
+      if (!deleted[i] && has_target(code[i].op)) {
+        is_target[target_of(code[i])] = true;
+      }
+    }
+    for (i32 p : publics) {
+      is_target[p] = true;
+    }
+  }
+
+  static bool has_target(Op op) {
+    return has_jump_target(op) || op == Op::CLOSURE;
+  }
+  static i32 &target_of(Insn &insn) {
+    return insn.op == Op::CLOSURE ? insn.a : insn.c.value;
+  }
+
+  // jumps to a deleted instruction land on the next one
+  void erase(size_t i) {
+    deleted[i] = true;
+    size_t next = next_alive(i);
+    if (is_target[i] && next < code.size()) {
+      is_target[next] = true;
+    }
+  }
+
+  // the next instruction that is still there, or code.size()
+  size_t next_alive(size_t i) const {
+    while (i < code.size() && deleted[i]) {
+      i++;
+    }
+    return i;
+  }
+
+  // Deletes the code the control-flow graph does not reach: functions that
+  // are neither public nor referenced by a live CALL or CLOSURE, and the
+  // unreachable tails inside live ones.
+  void remove_unreachable() {
+    for (size_t i = 0; i < code.size(); i++) {
+      if (cfg.is_reachable(offsets[i])) {
+        continue;
+      }
+      stats.dead_functions +=
+          code[i].op == Op::BEGIN || code[i].op == Op::CBEGIN;
+      stats.dead_insns += code[i].op != Op::LINE;
+      deleted[i] = true;
+    }
+  }
+
+  // constant propagation lattice of an argument: no call seen yet, the same
+  // constant at every call, or anything
+  struct ArgValue {
+    enum Kind : u8 { UNSEEN, KNOWN, VARYING } kind = UNSEEN;
+    i32 value = 0;
+  };
+
+  static bool meet(ArgValue &into, ArgValue v) {
+    if (v.kind == ArgValue::UNSEEN || into.kind == ArgValue::VARYING ||
+        (into.kind == ArgValue::KNOWN && v.kind == ArgValue::KNOWN &&
+         into.value == v.value)) {
+      return false;
+    }
+    into = into.kind == ArgValue::UNSEEN ? v : ArgValue{ArgValue::VARYING};
+    return true;
+  }
+
+  // the instruction right after the function starting at `begin`
+  size_t function_end(size_t begin) const {
+    size_t i = begin + 1;
+    while (i < code.size() && code[i].op != Op::BEGIN &&
+           code[i].op != Op::CBEGIN) {
+      i++;
+    }
+    return i;
+  }
+
+  static bool is_arg(Insn const &insn, Op op) {
+    return insn.op == op && insn.a == (i32)ARG;
+  }
+
+  // Propagates constant arguments through the CALL graph and gives call
+  // sites with constant arguments a copy of the callee with the constants
+  // folded in. An argument is constant at a call site if it is pushed by
+  // CONST, or by LD of a constant argument of the caller, in the straight
+  // line of code before the CALL. Arguments the callee stores into or takes
+  // the address of are never replaced. Arguments that are the same at every
+  // call site are replaced in the callee itself; the others get a copy per
+  // set of constants, but only if some constant feeds a branch or arithmetic
+  // there and the copies stay within the budget.
+  void specialize_calls() {
+    std::vector<i32> owner(code.size(), -1); // BEGIN of every instruction
+    std::vector<i32> functions;
+    for (size_t i = 0; i < code.size(); i++) {
+      if (code[i].op == Op::BEGIN || code[i].op == Op::CBEGIN) {
+        functions.push_back((i32)i);
+      }
+      owner[i] = functions.empty() ? -1 : functions.back();
+    }
+    std::vector<std::vector<ArgValue>> args(code.size());
+    std::vector<std::vector<bool>> written(code.size());
+    auto vary = [&args](i32 f) {
+      args[f].assign(args[f].size(), ArgValue{ArgValue::VARYING});
+    };
+    for (i32 f : functions) {
+      args[f].resize(code[f].a);
+      written[f].assign(code[f].a, false);
+      if (code[f].op == Op::CBEGIN) {
+        vary(f);
+      }
+    }
+    for (size_t i = 0; i < code.size(); i++) {
+      Insn const &insn = code[i];
+      if (deleted[i]) {
+        continue;
+      }
+      if ((is_arg(insn, Op::ST) || is_arg(insn, Op::LDA)) && owner[i] >= 0 &&
+          insn.b >= 0 && insn.b < (i32)written[owner[i]].size()) {
+        written[owner[i]][insn.b] = true;
+      } else if (insn.op == Op::CLOSURE) {
+        vary(insn.a);
+      }
+    }
+    for (i32 p : publics) {
+      vary(p);
+    }
+
+    // the arguments of a CALL as far as they are known
+    auto site_args = [&](size_t call) {
+      i32 n = code[call].a;
+      i32 caller = owner[call];
+      std::vector<ArgValue> site(n, ArgValue{ArgValue::VARYING});
+      size_t after = call; // the instruction after the producer
+      for (i32 k = n - 1; k >= 0 && !is_target[after];) {
+        size_t p = prev_alive(after);
+        if (p >= code.size() || (i32)p <= caller) {
+          break;
+        }
+        after = p;
+        Insn const &producer = code[p];
+        if (producer.op == Op::LINE) {
+          continue;
+        }
+        if (producer.op == Op::CONST) {
+          site[k] = ArgValue{ArgValue::KNOWN, producer.a};
+        } else if (is_arg(producer, Op::LD) && producer.b >= 0 &&
+                   producer.b < (i32)args[caller].size() &&
+                   !written[caller][producer.b]) {
+          site[k] = args[caller][producer.b];
+        } else if (producer.op != Op::LD && producer.op != Op::STRING &&
+                   producer.op != Op::LREAD) {
+          break; // pops or pushes more than one value
+        }
+        k--;
+      }
+      return site;
+    };
+    auto is_direct_call = [&](size_t i) {
+      return !deleted[i] && code[i].op == Op::CALL && owner[i] >= 0 &&
+             code[code[i].c.value].op == Op::BEGIN &&
+             code[code[i].c.value].a == code[i].a;
+    };
+
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t i = 0; i < code.size(); i++) {
+        if (!deleted[i] && code[i].op == Op::CALL && !is_direct_call(i)) {
+          vary(code[i].c.value);
+        } else if (is_direct_call(i)) {
+          auto site = site_args(i);
+          auto &callee = args[code[i].c.value];
+          for (size_t k = 0; k < site.size(); k++) {
+            changed = meet(callee[k], site[k]) || changed;
+          }
+        }
+      }
+    }
+
+    for (i32 f : functions) {
+      replace_args(f, args[f], written[f]);
+    }
+    std::map<std::vector<i32>, i32> copies; // callee and constants -> copy
+    i32 budget = specialize_budget;
+    size_t original_size = code.size();
+    for (size_t i = 0; i < original_size; i++) {
+      if (!is_direct_call(i)) {
+        continue;
+      }
+      i32 callee = code[i].c.value;
+      auto site = site_args(i);
+      std::vector<i32> key{callee};
+      std::vector<ArgValue> known(site.size());
+      for (size_t k = 0; k < site.size(); k++) {
+        if (site[k].kind == ArgValue::KNOWN &&
+            args[callee][k].kind == ArgValue::VARYING &&
+            !written[callee][k]) {
+          known[k] = site[k];
+          key.insert(key.end(), {(i32)k, site[k].value});
+        }
+      }
+      if (key.size() == 1) {
+        continue;
+      }
+      auto found = copies.find(key);
+      if (found != copies.end()) {
+        code[i].c.value = found->second;
+        continue;
+      }
+      i32 size = body_size(callee);
+      if (size > budget || foldable_uses(callee, known) == 0) {
+        continue;
+      }
+      budget -= size;
+      i32 copy = copy_function(callee);
+      replace_args(copy, known, written[callee]);
+      copies.emplace(key, copy);
+      code[i].c.value = copy;
+      stats.specialized++;
+    }
+    mark_targets();
+  }
+
+  // live instructions of the function, its BEGIN excluded
+  i32 body_size(i32 begin) const {
+    i32 size = 0;
+    for (size_t i = begin + 1; i < function_end(begin); i++) {
+      size += !deleted[i] && code[i].op != Op::LINE;
+    }
+    return size;
+  }
+
+  // uses of the known arguments that fold once they are constants
+  i32 foldable_uses(i32 begin, std::vector<ArgValue> const &known) const {
+    i32 uses = 0;
+    size_t end = function_end(begin);
+    for (size_t i = begin + 1; i < end; i++) {
+      Insn const &insn = code[i];
+      if (deleted[i] || !is_arg(insn, Op::LD) || insn.b < 0 ||
+          insn.b >= (i32)known.size() ||
+          known[insn.b].kind != ArgValue::KNOWN) {
+        continue;
+      }
+      size_t next = next_alive(i + 1);
+      if (next >= end) {
+        continue;
+      }
+      Op op = code[next].op;
+      size_t after = next_alive(next + 1);
+      uses += op == Op::BINOP || op == Op::CJMPZ || op == Op::CJMPNZ ||
+              (op == Op::CONST && after < end && code[after].op == Op::BINOP);
+    }
+    return uses;
+  }
+
+  // replaces the loads of the known arguments with their constants
+  void replace_args(i32 begin, std::vector<ArgValue> const &known,
+                    std::vector<bool> const &written) {
+    size_t end = function_end(begin);
+    for (size_t i = begin + 1; i < end; i++) {
+      Insn &insn = code[i];
+      if (deleted[i] || !is_arg(insn, Op::LD) || insn.b < 0 ||
+          insn.b >= (i32)known.size() ||
+          known[insn.b].kind != ArgValue::KNOWN || written[insn.b]) {
+        continue;
+      }
+      insn = PredecodingVisitor::make(Op::CONST, known[insn.b].value);
+      stats.propagated++;
+    }
+  }
+
+  // Appends a copy of the live instructions of the function starting at
+  // `begin` and returns the index of its BEGIN. Jumps inside the function
+  // are redirected into the copy, calls keep their callees.
+  i32 copy_function(i32 begin) {
+    size_t end = function_end(begin);
+    i32 copy_begin = (i32)code.size();
+    std::vector<i32> copy_index(end - begin, -1);
+    for (size_t i = begin; i < end; i++) {
+      if (deleted[i]) {
+        continue;
+      }
+      copy_index[i - begin] = (i32)code.size();
+      Insn copy = code[i];
+      code.push_back(copy);
+      offsets.push_back(offsets[i]);
+      deleted.push_back(false);
+      is_target.push_back(false);
+    }
+    for (size_t i = copy_begin; i < code.size(); i++) {
+      Insn &copy = code[i];
+      if (!has_jump_target(copy.op) || copy.op == Op::CALL) {
+        continue;
+      }
+      // a jump to a deleted instruction lands on the next copy
+      size_t t = copy.c.value;
+      while (t < end && copy_index[t - begin] < 0) {
+        t++;
+      }
+      if (t < end) {
+        copy.c.value = copy_index[t - begin];
+      }
+    }
+    return copy_begin;
+  }
+
+  // Returns the live instructions of the function starting at `begin` (its
+  // BEGIN excluded) if it can be inlined, an empty vector otherwise. Inlined
+  // functions are plain BEGIN functions within the budget that do not call
+  // themselves, take no addresses of their slots and build no closures (those
+  // would capture slots of the wrong frame); every END must leave exactly the
+  // result on the stack.
+  std::vector<i32> inlinable_body(i32 begin) const {
+    std::vector<i32> body;
+    if (code[begin].op != Op::BEGIN) {
+      return {};
+    }
+    for (size_t i = begin + 1;
+         i < code.size() && code[i].op != Op::BEGIN && code[i].op != Op::CBEGIN;
+         i++) {
+      if (deleted[i] || code[i].op == Op::LINE) {
+        continue;
+      }
+      Op op = code[i].op;
+      if (op == Op::LDA || op == Op::CLOSURE ||
+          (op == Op::CALL && code[i].c.value == begin) ||
+          ((op == Op::LD || op == Op::ST) && code[i].a == (i32)CAPTURED) ||
+          (op == Op::END && depth_at[offsets[i]] != 1) ||
+          (i32)body.size() >= inline_budget) {
+        return {};
+      }
+      body.push_back((i32)i);
+    }
+    return body;
+  }
+
+  // Replaces every CALL of an inlinable function with a copy of its body.
+  // The arguments are popped into fresh locals of the caller, A(i) and L(i)
+  // of the callee become those locals, and END becomes a jump past the copy
+  // (or nothing, at the end of the body). The locals of the callee are not
+  // zeroed: Lama code stores into a local before loading it. All inlined
+  // copies of a caller share one scratch area appended to its locals.
+  void inline_calls() {
+    std::vector<Insn> new_code;
+    std::vector<i32> new_offsets_of; // offsets of the new instructions
+    std::vector<bool> new_deleted;
+    std::vector<bool> remap; // targets still refer to old indices
+    std::vector<i32> new_index(code.size() + 1, 0);
+    i32 caller = -1; // new index of the BEGIN of the current function
+    i32 scratch = 0; // locals needed by the copies in the current function
+    auto close_function = [&]() {
+      if (caller >= 0) {
+        new_code[caller].b += scratch;
+      }
+      scratch = 0;
+    };
+    auto emit = [&](Insn insn, i32 offset, bool old_targets) {
+      new_code.push_back(insn);
+      new_offsets_of.push_back(offset);
+      new_deleted.push_back(false);
+      remap.push_back(old_targets);
+    };
+    for (size_t i = 0; i < code.size(); i++) {
+      new_index[i] = (i32)new_code.size();
+      Insn const &insn = code[i];
+      if (!deleted[i] && (insn.op == Op::BEGIN || insn.op == Op::CBEGIN)) {
+        close_function();
+        caller = (i32)new_code.size();
+      }
+      std::vector<i32> body;
+      if (!deleted[i] && insn.op == Op::CALL && caller >= 0) {
+        body = inlinable_body(insn.c.value);
+      }
+      if (body.empty()) {
+        emit(insn, offsets[i], true);
+        new_deleted.back() = deleted[i];
+        continue;
+      }
+      Insn const &callee = code[insn.c.value];
+      i32 n_args = callee.a;
+      i32 base = code[caller_begin(i)].b;
+      scratch = std::max(scratch, n_args + callee.b);
+      for (i32 k = n_args - 1; k >= 0; k--) {
+        emit(PredecodingVisitor::make(Op::ST, LOCAL, base + k), -1, false);
+        emit(PredecodingVisitor::make(Op::DROP), -1, false);
+      }
+      i32 copy_begin = (i32)new_code.size();
+      i32 copy_end = copy_begin + (i32)body.size();
+      std::vector<i32> copy_index(code.size(), -1);
+      for (size_t k = 0; k < body.size(); k++) {
+        copy_index[body[k]] = copy_begin + (i32)k;
+      }
+      for (size_t k = 0; k < body.size(); k++) {
+        Insn copy = code[body[k]];
+        bool last = k + 1 == body.size();
+        if ((copy.op == Op::LD || copy.op == Op::ST) && copy.a == (i32)ARG) {
+          copy.a = LOCAL;
+          copy.b = base + copy.b;
+        } else if ((copy.op == Op::LD || copy.op == Op::ST) &&
+                   copy.a == (i32)LOCAL) {
+          copy.b = base + n_args + copy.b;
+        } else if (copy.op == Op::END) {
+          // the last END just falls through, LINE is a placeholder that
+          // goes away with the other LINEs
+          copy = PredecodingVisitor::make(last ? Op::LINE : Op::JMP, 0, 0,
+                                          copy_end);
+        } else if (has_jump_target(copy.op) && copy.op != Op::CALL) {
+          // a jump to a deleted or LINE instruction lands on the next copy
+          i32 t = copy.c.value;
+          while (t < (i32)code.size() && copy_index[t] < 0) {
+            t++;
+          }
+          copy.c.value = t < (i32)code.size() ? copy_index[t] : copy_end;
+        }
+        emit(copy, -1, copy.op == Op::CALL);
+      }
+      stats.inlined++;
+    }
+    close_function();
+    new_index[code.size()] = (i32)new_code.size();
+
+    for (size_t i = 0; i < new_code.size(); i++) {
+      if (remap[i] && has_target(new_code[i].op)) {
+        target_of(new_code[i]) = new_index[target_of(new_code[i])];
+      }
+    }
+    for (auto &p : publics) {
+      p = new_index[p];
+    }
+    code = std::move(new_code);
+    offsets = std::move(new_offsets_of);
+    deleted = std::move(new_deleted);
+    mark_targets();
+  }
+
+  // the BEGIN of the function containing instruction i, in the old code
+  size_t caller_begin(size_t i) const {
+    while (i > 0 && (deleted[i] || (code[i].op != Op::BEGIN &&
+                                    code[i].op != Op::CBEGIN))) {
+      i--;
+    }
+    return i;
+  }
+
+  static bool foldable(i32 r, BinopLabel label) {
+    return !((label == BinopLabel::DIV || label == BinopLabel::MOD) && r == 0);
+  }
+
+  // One pass of the peephole rules, returns whether anything changed.
+  bool peephole() {
+    bool changed = false;
+    for (size_t i = next_alive(0); i < code.size(); i = next_alive(i + 1)) {
+      size_t j = next_alive(i + 1);
+      if (j >= code.size() || is_target[j]) {
+        continue;
+      }
+      Insn &first = code[i], &second = code[j];
+      // DUP; DROP
+      if (first.op == Op::DUP && second.op == Op::DROP) {
+        erase(i);
+        erase(j);
+        stats.dropped += 2;
+        changed = true;
+        continue;
+      }
+      // CONST k; CJMPz
+      if (first.op == Op::CONST &&
+          (second.op == Op::CJMPZ || second.op == Op::CJMPNZ)) {
+        if ((first.a == 0) == (second.op == Op::CJMPZ)) {
+          first = PredecodingVisitor::make(Op::JMP, 0, 0, second.c.value);
+        } else {
+          erase(i);
+        }
+        erase(j);
+        stats.folded++;
+        changed = true;
+        continue;
+      }
+      if (first.op != Op::CONST || second.op != Op::BINOP) {
+        continue;
+      }
+      auto label = (BinopLabel)second.a;
+      i32 k = first.a;
+      // CONST a; CONST k; BINOP
+      size_t p = i > 0 ? prev_alive(i) : code.size();
+      if (p < code.size() && code[p].op == Op::CONST && !is_target[i] &&
+          foldable(k, label)) {
+        code[p].a = UNBOX(BOX(arithm_op(code[p].a, k, label)));
+        erase(i);
+        erase(j);
+        stats.folded++;
+        changed = true;
+        continue;
+      }
+      // x + 0, x - 0, x * 1, x / 1
+      if ((k == 0 && (label == BinopLabel::ADD || label == BinopLabel::SUB)) ||
+          (k == 1 && (label == BinopLabel::MUL || label == BinopLabel::DIV))) {
+        erase(i);
+        erase(j);
+        stats.reduced++;
+        changed = true;
+        continue;
+      }
+      // x * 2 -> x + x
+      if (k == 2 && label == BinopLabel::MUL) {
+        first = PredecodingVisitor::make(Op::DUP);
+        second.a = (i32)BinopLabel::ADD;
+        stats.reduced++;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  size_t prev_alive(size_t i) const {
+    while (i > 0) {
+      i--;
+      if (!deleted[i]) {
+        return i;
+      }
+    }
+    return code.size();
+  }
+
+  // retargets jumps whose target is an unconditional jump
+  void thread_jumps() {
+    for (size_t i = 0; i < code.size(); i++) {
+      Op op = code[i].op;
+      if (deleted[i] ||
+          (op != Op::JMP && op != Op::CJMPZ && op != Op::CJMPNZ)) {
+        continue;
+      }
+      // bounded, so that jump cycles terminate
+      for (size_t hops = 0; hops < code.size(); hops++) {
+        size_t t = next_alive(code[i].c.value);
+        if (t >= code.size() || code[t].op != Op::JMP ||
+            code[t].c.value == code[i].c.value) {
+          break;
+        }
+        code[i].c.value = code[t].c.value;
+        stats.threaded++;
+      }
+    }
+  }
+
+  // a block of the layout: its live instructions, the blocks control falls
+  // into and jumps to (-1 if none), and its counts
+  struct Block {
+    std::vector<i32> insns;
+    i32 fall = -1;
+    i32 target = -1;
+    u64 count = 0;
+    bool has_branch_count = false;
+    BranchCount branch; // of the conditional jump at the end
+  };
+
+  static bool ends_block(Op op) {
+    return op == Op::JMP || op == Op::CJMPZ || op == Op::CJMPNZ ||
+           op == Op::END || op == Op::FAILURE || op == Op::STOP;
+  }
+
+  // Splits the live instructions of the function starting at `begin` into
+  // blocks in their original order and weighs them with the profile.
+  // Blocks of inlined copies, which have no original offsets, and blocks
+  // the profile saw entered only by falling through get the count of the
+  // block before them.
+  std::vector<Block> split_blocks(i32 begin, std::vector<i32> &block_of) {
+    std::vector<Block> blocks;
+    size_t end = function_end(begin);
+    for (size_t i = begin; i < end; i++) {
+      if (deleted[i]) {
+        continue;
+      }
+      bool after_end =
+          !blocks.empty() && ends_block(code[blocks.back().insns.back()].op);
+      if (blocks.empty() || is_target[i] || after_end) {
+        if (!blocks.empty() && !after_end) {
+          blocks.back().fall = (i32)blocks.size();
+        }
+        blocks.push_back(Block{});
+        Block &b = blocks.back();
+        auto found = profile->blocks.find(offsets[i]);
+        if (found != profile->blocks.end()) {
+          b.count = found->second;
+        } else if (blocks.size() > 1 && (offsets[i] < 0 || !after_end)) {
+          b.count = blocks[blocks.size() - 2].count;
+        }
+      }
+      blocks.back().insns.push_back((i32)i);
+      block_of[i] = (i32)blocks.size() - 1;
+    }
+    for (size_t b = 0; b < blocks.size(); b++) {
+      Insn const &last = code[blocks[b].insns.back()];
+      if (last.op == Op::CJMPZ || last.op == Op::CJMPNZ) {
+        blocks[b].fall = b + 1 < blocks.size() ? (i32)b + 1 : -1;
+        auto found = profile->branches.find(offsets[blocks[b].insns.back()]);
+        if (found != profile->branches.end()) {
+          blocks[b].has_branch_count = true;
+          blocks[b].branch = found->second;
+        }
+      }
+      if (last.op == Op::JMP || last.op == Op::CJMPZ || last.op == Op::CJMPNZ) {
+        blocks[b].target = block_of[last.c.value];
+      }
+    }
+    return blocks;
+  }
+
+  // Lays out the blocks of every function that ran in the profile: starting
+  // from the entry, the hottest successor of the last placed block goes
+  // next, so the likely edge of a conditional jump falls through; when the
+  // chain ends the next hot block in the original order starts a new one.
+  // Blocks that never ran are moved to the end of the function, which keeps
+  // every function contiguous for the passes that expect it. Jumps are
+  // inverted or added where the fall-through changed and dropped where the
+  // target now follows.
+  void layout_blocks() {
+    // targets of deleted instructions land on the next live one
+    for (size_t i = 0; i < code.size(); i++) {
+      if (!deleted[i] && has_target(code[i].op)) {
+        target_of(code[i]) = (i32)next_alive(target_of(code[i]));
+      }
+    }
+    for (auto &p : publics) {
+      p = (i32)next_alive(p);
+    }
+    mark_targets();
+
+    std::vector<Insn> new_code;
+    std::vector<i32> new_offsets_of;
+    std::vector<i32> new_index(code.size(), -1);
+    std::vector<i32> block_of(code.size(), -1);
+    auto emit = [&](Insn const &insn, i32 offset) {
+      new_code.push_back(insn);
+      new_offsets_of.push_back(offset);
+    };
+    for (size_t i = 0; i < code.size();) {
+      if (deleted[i] ||
+          (code[i].op != Op::BEGIN && code[i].op != Op::CBEGIN)) {
+        if (!deleted[i]) {
+          new_index[i] = (i32)new_code.size();
+          emit(code[i], offsets[i]);
+        }
+        i++;
+        continue;
+      }
+      auto blocks = split_blocks((i32)i, block_of);
+      auto order = block_order(blocks);
+      for (size_t k = 0; k < order.size(); k++) {
+        Block const &b = blocks[order[k]];
+        i32 next = k + 1 < order.size() ? order[k + 1] : -1;
+        stats.moved += order[k] != (i32)k;
+        stats.cold += b.count == 0;
+        for (i32 insn : b.insns) {
+          new_index[insn] = (i32)new_code.size();
+          emit(code[insn], offsets[insn]);
+        }
+        Insn &last = new_code.back();
+        auto jump_to = [&](i32 block) {
+          emit(PredecodingVisitor::make(Op::JMP, 0, 0,
+                                        blocks[block].insns.front()),
+               -1);
+        };
+        if (last.op == Op::JMP && b.target == next) {
+          new_code.pop_back();
+          new_offsets_of.pop_back();
+        } else if (last.op == Op::CJMPZ || last.op == Op::CJMPNZ) {
+          if (b.target == next && b.fall != next && b.fall >= 0) {
+            last.op = last.op == Op::CJMPZ ? Op::CJMPNZ : Op::CJMPZ;
+            last.c.value = blocks[b.fall].insns.front();
+          } else if (b.fall != next && b.fall >= 0) {
+            jump_to(b.fall);
+          }
+        } else if (!ends_block(last.op) && b.fall >= 0 && b.fall != next) {
+          jump_to(b.fall);
+        }
+      }
+      i = function_end(i);
+    }
+
+    for (auto &insn : new_code) {
+      if (has_target(insn.op)) {
+        target_of(insn) = new_index[target_of(insn)];
+      }
+    }
+    for (auto &p : publics) {
+      p = new_index[p];
+    }
+    code = std::move(new_code);
+    offsets = std::move(new_offsets_of);
+    deleted.assign(code.size(), false);
+    mark_targets();
+  }
+
+  std::vector<i32> block_order(std::vector<Block> const &blocks) const {
+    std::vector<i32> order;
+    std::vector<bool> placed(blocks.size(), false);
+    auto place = [&](i32 b) {
+      order.push_back(b);
+      placed[b] = true;
+    };
+    // a function that never ran keeps its layout
+    if (blocks[0].count == 0) {
+      for (size_t b = 0; b < blocks.size(); b++) {
+        order.push_back((i32)b);
+      }
+      return order;
+    }
+    place(0);
+    for (size_t next_hot = 1;;) {
+      Block const &last = blocks[order.back()];
+      // the weights of the edges to the fall-through block and the target
+      u64 fall_weight = last.fall >= 0 ? blocks[last.fall].count : 0;
+      u64 target_weight = last.target >= 0 ? blocks[last.target].count : 0;
+      if (last.has_branch_count) {
+        target_weight = last.branch.taken;
+        fall_weight = last.branch.executed - last.branch.taken;
+      }
+      i32 best = -1;
+      if (last.fall >= 0 && !placed[last.fall] && fall_weight > 0) {
+        best = last.fall;
+      }
+      if (last.target >= 0 && !placed[last.target] && target_weight > 0 &&
+          (best < 0 || target_weight > fall_weight)) {
+        best = last.target;
+      }
+      while (best < 0 && next_hot < blocks.size()) {
+        if (!placed[next_hot] && blocks[next_hot].count > 0) {
+          best = (i32)next_hot;
+        }
+        next_hot++;
+      }
+      if (best < 0) {
+        break;
+      }
+      place(best);
+    }
+    for (size_t b = 0; b < blocks.size(); b++) {
+      if (!placed[b]) {
+        place((i32)b);
+      }
+    }
+    return order;
+  }
+
+  void put_byte(u8 byte) { out.push_back(byte); }
+  void put_int(i32 value) {
+    u8 bytes[sizeof(i32)];
+    memcpy(bytes, &value, sizeof(value));
+    out.insert(out.end(), bytes, bytes + sizeof(bytes));
+  }
+  void put_op(u8 h, u8 l) { put_byte((h << 4) | l); }
+  i32 string_offset(char const *str) const {
+    return (i32)((u8 const *)str - bf->stringtab_ptr);
+  }
+
+  // a deleted instruction is replaced by the next surviving one
+  i32 new_offset(i32 index) const { return new_offsets[next_alive(index)]; }
+
+  void encode() {
+    new_offsets.assign(code.size() + 1, 0);
+    // instruction lengths do not change, only their positions
+    std::vector<size_t> fixups; // positions of code offsets in `out`
+    std::vector<i32> fixup_targets;
+    for (size_t i = 0; i < code.size(); i++) {
+      new_offsets[i] = (i32)out.size();
+      if (deleted[i]) {
+        continue;
+      }
+      auto const &insn = code[i];
+      auto const h = [](auto code) { return (u8)code; };
+      switch (insn.op) {
+      case Op::BINOP:
+        put_op(h(HCode::BINOP), insn.a + 1);
+        break;
+      case Op::CONST:
+        put_op(h(HCode::MISC1), h(Misc1LCode::CONST));
+        put_int(insn.a);
+        break;
+      case Op::STRING:
+        put_op(h(HCode::MISC1), h(Misc1LCode::STR));
+        put_int(string_offset(insn.c.str));
+        break;
+      case Op::SEXP:
+        put_op(h(HCode::MISC1), h(Misc1LCode::SEXP));
+        put_int(string_offset(insn.c.str));
+        put_int(insn.a);
+        break;
+      case Op::STI:
+        put_op(h(HCode::MISC1), h(Misc1LCode::STI));
+        break;
+      case Op::STA:
+        put_op(h(HCode::MISC1), h(Misc1LCode::STA));
+        break;
+      case Op::JMP:
+        put_op(h(HCode::MISC1), h(Misc1LCode::JMP));
+        fixups.push_back(out.size());
+        fixup_targets.push_back(insn.c.value);
+        put_int(0);
+        break;
+      case Op::END:
+        put_op(h(HCode::MISC1), h(Misc1LCode::END));
+        break;
+      case Op::DROP:
+        put_op(h(HCode::MISC1), h(Misc1LCode::DROP));
+        break;
+      case Op::DUP:
+        put_op(h(HCode::MISC1), h(Misc1LCode::DUP));
+        break;
+      case Op::SWAP:
+        put_op(h(HCode::MISC1), h(Misc1LCode::SWAP));
+        break;
+      case Op::ELEM:
+        put_op(h(HCode::MISC1), h(Misc1LCode::ELEM));
+        break;
+      case Op::LD:
+      case Op::LDA:
+      case Op::ST:
+        put_op(insn.op == Op::LD    ? h(HCode::LD)
+               : insn.op == Op::LDA ? h(HCode::LDA)
+                                    : h(HCode::ST),
+               insn.a - 1);
+        put_int(insn.b);
+        break;
+      case Op::CJMPZ:
+      case Op::CJMPNZ:
+        put_op(h(HCode::MISC2), insn.op == Op::CJMPZ ? h(Misc2LCode::CJMPZ)
+                                                     : h(Misc2LCode::CJMPNZ));
+        fixups.push_back(out.size());
+        fixup_targets.push_back(insn.c.value);
+        put_int(0);
+        break;
+      case Op::BEGIN:
+      case Op::CBEGIN:
+        put_op(h(HCode::MISC2), insn.op == Op::BEGIN ? h(Misc2LCode::BEGIN)
+                                                     : h(Misc2LCode::CBEGIN));
+        // the stack size patched in by check_depth is not kept, it changes
+        put_int(insn.a);
+        put_int(insn.b);
+        break;
+      case Op::CLOSURE:
+        put_op(h(HCode::MISC2), h(Misc2LCode::CLOSURE));
+        fixups.push_back(out.size());
+        fixup_targets.push_back(insn.a);
+        put_int(0);
+        put_int(insn.b);
+        for (i32 k = 0; k < insn.b; k++) {
+          auto const &capture = captures[insn.c.value + k];
+          put_byte(capture.kind - 1);
+          put_int(capture.index);
+        }
+        break;
+      case Op::CALLC:
+        put_op(h(HCode::MISC2), h(Misc2LCode::CALLC));
+        put_int(insn.a);
+        break;
+      case Op::CALL:
+        put_op(h(HCode::MISC2), h(Misc2LCode::CALL));
+        fixups.push_back(out.size());
+        fixup_targets.push_back(insn.c.value);
+        put_int(0);
+        put_int(insn.a);
+        break;
+      case Op::TAG:
+        put_op(h(HCode::MISC2), h(Misc2LCode::TAG));
+        put_int(string_offset(insn.c.str));
+        put_int(insn.a);
+        break;
+      case Op::ARRAY:
+        put_op(h(HCode::MISC2), h(Misc2LCode::ARRAY));
+        put_int(insn.a);
+        break;
+      case Op::FAILURE:
+        put_op(h(HCode::MISC2), h(Misc2LCode::FAILURE));
+        put_int(insn.a);
+        put_int(insn.b);
+        break;
+      case Op::PATT:
+        put_op(h(HCode::PATT), insn.a);
+        break;
+      case Op::LREAD:
+        put_op(h(HCode::CALL), h(Call::READ));
+        break;
+      case Op::LWRITE:
+        put_op(h(HCode::CALL), h(Call::WRITE));
+        break;
+      case Op::LLENGTH:
+        put_op(h(HCode::CALL), h(Call::LLENGTH));
+        break;
+      case Op::LSTRING:
+        put_op(h(HCode::CALL), h(Call::LSTRING));
+        break;
+      case Op::BARRAY:
+        put_op(h(HCode::CALL), h(Call::BARRAY));
+        put_int(insn.a);
+        break;
+      case Op::STOP:
+        put_op(h(HCode::STOP), 0xF);
+        break;
+      default:
+        error("optimizer: cannot encode %s", op_names[(u8)insn.op]);
+      }
+    }
+    new_offsets[code.size()] = (i32)out.size();
+    for (size_t k = 0; k < fixups.size(); k++) {
+      i32 target = new_offset(fixup_targets[k]);
+      memcpy(&out[fixups[k]], &target, sizeof(target));
+    }
+  }
+};
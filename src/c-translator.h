@@ -0,0 +1,468 @@
+#pragma once
+
+#include "control-flow.h"
+#include "executing-visitor.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Ahead-of-time translation of a bytefile into C, see `make aot`. Every
+// function becomes a C function; the result links against runtime.o and
+// gc.o like the interpreter itself.
+//
+// Values the GC must see live in a shadow stack, scanned conservatively by
+// the runtime between __gc_stack_top and __gc_stack_bottom, with the frames
+// laid out as in the interpreters: the arguments above the base pointer, the
+// locals from it downwards, and the operand stack below the locals. Operand
+// stack slot k (its depth is static, see check_depth) is the C local s<k>,
+// and it is only stored into its shadow slot right before a call or an
+// allocation, that is when the GC may run, and reloaded after it. Functions
+// take no C arguments: a callee finds its arguments right above the base
+// pointer it takes from __gc_stack_top, and the closure above them. Closures
+// keep the address of the C function in place of the code offset.
+class CTranslator {
+public:
+  CTranslator(ControlFlowGraph const &cfg, PredecodedProgram const &program,
+              std::vector<i32> const &depth_at, FILE *out)
+      : cfg(cfg), program(program), depth_at(depth_at), out(out) {}
+
+  // Returns the number of translated functions.
+  i32 translate() {
+    if (cfg.function_at[0] == ControlFlowGraph::NONE) {
+      error("c translation: no main function at 0x00000000");
+    }
+    fputs(prelude, out);
+    fprintf(out, "#define STACK_SIZE %d\n", STACK_SIZE);
+    fprintf(out, "#define N_GLOBAL %d\n\n", N_GLOBAL);
+    fputs(stack_prelude, out);
+    for (auto const &function : cfg.functions) {
+      fprintf(out, "static word lama_%d(void);\n", function.begin);
+    }
+    for (size_t f = 0; f < cfg.functions.size(); f++) {
+      translate_function(f);
+    }
+    fprintf(out,
+            "\nint main(void) {\n"
+            "  __init();\n"
+            "  __gc_stack_bottom = stack_area + STACK_SIZE;\n"
+            "  __gc_stack_top = globals - 3; /* two arguments of main */\n"
+            "  lama_0();\n"
+            "  return 0;\n"
+            "}\n");
+    return (i32)cfg.functions.size();
+  }
+
+private:
+  static constexpr char const *prelude =
+      "/* translated from Lama bytecode */\n"
+      "#include <stdio.h>\n"
+      "#include <stdlib.h>\n"
+      "#include <string.h>\n"
+      "#include \"runtime_common.h\"\n"
+      "\n"
+      "typedef unsigned int word;\n"
+      "typedef word (*lama_fn)(void);\n"
+      "\n"
+      "extern word *__gc_stack_top, *__gc_stack_bottom;\n"
+      "extern void __init(void);\n"
+      "extern void *alloc_array(int);\n"
+      "extern void *alloc_sexp(int);\n"
+      "extern void *alloc_closure(int);\n"
+      "extern void *Belem(void *, int);\n"
+      "extern void *Bsta(void *, int, void *);\n"
+      "extern void *Bstring(void *);\n"
+      "extern int Btag(void *, int, int);\n"
+      "extern int Barray_patt(void *, int);\n"
+      "extern int Bstring_patt(void *, void *);\n"
+      "extern int Bstring_tag_patt(void *);\n"
+      "extern int Barray_tag_patt(void *);\n"
+      "extern int Bsexp_tag_patt(void *);\n"
+      "extern int Bboxed_patt(void *);\n"
+      "extern int Bunboxed_patt(void *);\n"
+      "extern int Bclosure_tag_patt(void *);\n"
+      "extern int Llength(void *);\n"
+      "extern int Lread(void);\n"
+      "extern void *Lstring(void *);\n"
+      "\n";
+  // after the definitions of STACK_SIZE and N_GLOBAL
+  static constexpr char const *stack_prelude =
+      "/* the last word is the (inclusive) bottom of the GC scan */\n"
+      "static word stack_area[STACK_SIZE + 1];\n"
+      "static word *const globals = stack_area + STACK_SIZE - N_GLOBAL;\n"
+      "\n"
+      "static void lama_overflow(void) {\n"
+      "  fprintf(stderr, \"stack overflow\\n\");\n"
+      "  exit(1);\n"
+      "}\n"
+      "\n";
+
+  ControlFlowGraph const &cfg;
+  PredecodedProgram const &program;
+  std::vector<i32> const &depth_at;
+  FILE *out;
+
+  // the function being translated
+  std::string body;
+  i32 n_args = 0;
+  i32 n_locals = 0;
+  i32 max_depth = 0;
+
+  void line(char const *fmt, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    body += "  ";
+    body += buffer;
+    body += '\n';
+  }
+
+  i32 offset_of(Insn const *insn) const {
+    return program.offsets[insn - program.code.data()];
+  }
+
+  // The label of a jump target is the begin of its block: a jump to a LINE
+  // is predecoded to the instruction after it, but the block starts at the
+  // LINE.
+  i32 label_of(Insn const *target) const {
+    return cfg.blocks[cfg.block_at[offset_of(target)]].begin;
+  }
+
+  // the C lvalue of a variable
+  std::string ref(u32 kind, i32 index) const {
+    char buffer[64];
+    switch (kind) {
+    case GLOBAL:
+      snprintf(buffer, sizeof(buffer), "globals[%d]", index);
+      break;
+    case LOCAL:
+      snprintf(buffer, sizeof(buffer), "bp[%d]", -index);
+      break;
+    case ARG:
+      snprintf(buffer, sizeof(buffer), "bp[%d]", n_args - index);
+      break;
+    case CAPTURED:
+      snprintf(buffer, sizeof(buffer), "((word *)bp[%d])[%d]", n_args + 1,
+               1 + index);
+      break;
+    default:
+      error("c translation: bad reference kind %d", kind);
+    }
+    return buffer;
+  }
+
+  // operand stack slot k in the shadow frame
+  i32 shadow(i32 k) const { return -(n_locals + k); }
+
+  // stores the slots below `depth` for the GC and lets it scan them
+  void spill(i32 depth) {
+    for (i32 k = 0; k < depth; k++) {
+      line("bp[%d] = s%d;", shadow(k), k);
+    }
+    line("__gc_stack_top = bp + %d;", shadow(depth));
+  }
+  void reload(i32 depth) {
+    for (i32 k = 0; k < depth; k++) {
+      line("s%d = bp[%d];", k, shadow(k));
+    }
+  }
+
+  static std::string c_string(char const *s) {
+    std::string result = "\"";
+    for (; *s != '\0'; s++) {
+      unsigned char c = *s;
+      if (c >= ' ' && c < 0x7F && c != '"' && c != '\\' && c != '?') {
+        result += (char)c;
+      } else {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\%03o", c);
+        result += buffer;
+      }
+    }
+    return result + "\"";
+  }
+
+  static char const *patt_function(Patt patt) {
+    switch (patt) {
+    case Patt::STR_TAG:
+      return "Bstring_tag_patt";
+    case Patt::ARR_TAG:
+      return "Barray_tag_patt";
+    case Patt::SEXPR_TAG:
+      return "Bsexp_tag_patt";
+    case Patt::BOXED:
+      return "Bboxed_patt";
+    case Patt::UNBOXED:
+      return "Bunboxed_patt";
+    case Patt::CLOS_TAG:
+      return "Bclosure_tag_patt";
+    default:
+      error("bad patt specializer: %d\n", (i32)patt);
+      return nullptr;
+    }
+  }
+
+  void translate_function(size_t f) {
+    auto const &function = cfg.functions[f];
+    Insn const *begin = program.insn_at[function.begin];
+    n_args = begin->a;
+    n_locals = begin->b;
+    max_depth = 0;
+    body.clear();
+
+    std::vector<i32> layout = function.order;
+    std::sort(layout.begin(), layout.end(), [&](i32 a, i32 b) {
+      return cfg.blocks[a].begin < cfg.blocks[b].begin;
+    });
+    // blocks entered other than by falling through from the previous one
+    std::vector<bool> is_label(cfg.blocks.size(), false);
+    for (size_t i = 0; i < layout.size(); i++) {
+      auto const &block = cfg.blocks[layout[i]];
+      i32 next = i + 1 < layout.size() ? layout[i + 1] : -1;
+      Insn const *last = program.insn_starting_at(block.last);
+      bool jumps = last != nullptr && last->op == Op::JMP;
+      for (i32 k = 0; k < 2; k++) {
+        i32 s = block.succs[k];
+        if (s != ControlFlowGraph::NONE && (k == 1 || jumps || s != next)) {
+          is_label[s] = true;
+        }
+      }
+    }
+    for (size_t i = 0; i < layout.size(); i++) {
+      i32 b = layout[i];
+      auto const &block = cfg.blocks[b];
+      if (is_label[b]) {
+        body += "L" + std::to_string(block.begin) + ":\n";
+      }
+      i32 depth = depth_at[block.begin];
+      bool falls_through = true;
+      cfg.for_each_insn(b, [&](i32 offset) {
+        if (Insn const *insn = program.insn_starting_at(offset)) {
+          falls_through = translate_insn(*insn, depth);
+        }
+      });
+      i32 s = block.succs[0];
+      i32 next = i + 1 < layout.size() ? layout[i + 1] : -1;
+      if (falls_through) {
+        if (s == ControlFlowGraph::NONE) {
+          line("exit(0);"); // falls off the end of the code
+        } else if (s != next) {
+          line("goto L%d;", cfg.blocks[s].begin);
+        }
+      }
+    }
+
+    i32 frame = n_locals + max_depth + 1;
+    fprintf(out, "\nstatic word lama_%d(void) {\n", function.begin);
+    fprintf(out, "  word *const bp = __gc_stack_top;\n");
+    fprintf(out, "  if (bp - %d < stack_area) {\n    lama_overflow();\n  }\n",
+            frame);
+    if (n_locals > 0) {
+      fprintf(out, "  memset(bp - %d, 0, %d * sizeof(word));\n",
+              n_locals - 1, n_locals);
+    }
+    for (i32 k = 0; k < max_depth; k++) {
+      fprintf(out, "  word s%d = 0;\n", k);
+    }
+    fputs(body.c_str(), out);
+    fprintf(out, "}\n");
+  }
+
+  // Translates one instruction at the given depth and updates it. Returns
+  // false if the instruction does not fall through.
+  bool translate_insn(Insn const &insn, i32 &depth) {
+    i32 const d = depth;
+    auto set_depth = [&](i32 n) {
+      depth = n;
+      max_depth = std::max(max_depth, depth);
+    };
+    // the slot of a new top
+    auto push = [&]() {
+      set_depth(depth + 1);
+      return depth - 1;
+    };
+    switch (insn.op) {
+    case Op::BEGIN:
+    case Op::CBEGIN:
+      break;
+    case Op::CONST:
+      line("s%d = (word)%d;", push(), BOX(insn.a));
+      break;
+    case Op::STRING:
+      spill(d);
+      line("s%d = (word)Bstring(%s);", push(), c_string(insn.c.str).c_str());
+      reload(d);
+      break;
+    case Op::SEXP: {
+      i32 n = insn.a;
+      spill(d);
+      line("{");
+      line("  data *r = (data *)alloc_sexp(%d);", n);
+      line("  ((sexp *)r)->tag = 0;");
+      for (i32 i = 1; i <= n; i++) {
+        line("  ((word *)r->contents)[%d] = bp[%d];", i, shadow(d - n + i - 1));
+      }
+      line("  ((sexp *)r)->tag = %d;", UNBOX(insn.b));
+      line("  s%d = (word)r->contents;", d - n);
+      line("}");
+      reload(d - n);
+      set_depth(d - n + 1);
+      break;
+    }
+    case Op::STI:
+      line("*(word *)s%d = s%d;", d - 2, d - 1);
+      line("s%d = s%d;", d - 2, d - 1);
+      set_depth(d - 1);
+      break;
+    case Op::STA:
+      line("s%d = (word)Bsta((void *)s%d, (int)s%d, (void *)s%d);", d - 3,
+           d - 1, d - 2, d - 3);
+      set_depth(d - 2);
+      break;
+    case Op::JMP:
+      line("goto L%d;", label_of(insn.c.target));
+      return false;
+    case Op::END:
+      line("return s%d;", d - 1);
+      return false;
+    case Op::DROP:
+      set_depth(d - 1);
+      break;
+    case Op::DUP:
+      line("s%d = s%d;", push(), d - 1);
+      break;
+    case Op::SWAP:
+      line("{ word t = s%d; s%d = s%d; s%d = t; }", d - 1, d - 1, d - 2, d - 2);
+      break;
+    case Op::ELEM:
+      line("s%d = (word)Belem((void *)s%d, (int)s%d);", d - 2, d - 2, d - 1);
+      set_depth(d - 1);
+      break;
+    case Op::LD:
+      line("s%d = %s;", push(), ref(insn.a, insn.b).c_str());
+      break;
+    case Op::LDA:
+      line("s%d = s%d = (word)&%s;", d, d + 1, ref(insn.a, insn.b).c_str());
+      set_depth(d + 2);
+      break;
+    case Op::ST:
+      line("%s = s%d;", ref(insn.a, insn.b).c_str(), d - 1);
+      break;
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+      line("if (UNBOX(s%d) %s 0) {", d - 1, insn.op == Op::CJMPZ ? "==" : "!=");
+      line("  goto L%d;", label_of(insn.c.target));
+      line("}");
+      set_depth(d - 1);
+      break;
+    case Op::CLOSURE: {
+      i32 n = insn.b;
+      spill(d);
+      line("{");
+      line("  data *r = (data *)alloc_closure(%d);", n + 1);
+      line("  ((void **)r->contents)[0] = (void *)lama_%d;", insn.a);
+      for (i32 i = 0; i < n; i++) {
+        auto const &capture = insn.c.captures[i];
+        line("  ((word *)r->contents)[%d] = %s;", 1 + i,
+             ref(capture.kind, capture.index).c_str());
+      }
+      line("  s%d = (word)r->contents;", push());
+      line("}");
+      reload(d);
+      break;
+    }
+    case Op::CALLC:
+    case Op::TAILCALLC: {
+      i32 closure = d - insn.a - 1;
+      spill(d);
+      line("s%d = ((lama_fn)((void **)s%d)[0])();", closure, closure);
+      reload(closure);
+      set_depth(closure + 1);
+      break;
+    }
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL: {
+      i32 first = d - insn.a;
+      spill(d);
+      line("s%d = lama_%d();", first, offset_of(insn.c.target));
+      reload(first);
+      set_depth(first + 1);
+      break;
+    }
+    case Op::TAG:
+      line("s%d = (word)Btag((void *)s%d, %d, %d);", d - 1, d - 1, insn.b,
+           BOX(insn.a));
+      break;
+    case Op::ARRAY:
+      line("s%d = (word)Barray_patt((void *)s%d, %d);", d - 1, d - 1,
+           BOX(insn.a));
+      break;
+    case Op::PATT:
+      if (insn.a == (i32)Patt::STR_EQ_TAG) {
+        line("s%d = (word)Bstring_patt((void *)s%d, (void *)s%d);", d - 2,
+             d - 1, d - 2);
+        set_depth(d - 1);
+      } else {
+        line("s%d = (word)%s((void *)s%d);", d - 1,
+             patt_function((Patt)insn.a), d - 1);
+      }
+      break;
+    case Op::FAILURE:
+    case Op::STOP:
+      line("exit(0);");
+      return false;
+    case Op::LREAD:
+      spill(d);
+      line("s%d = (word)Lread();", push());
+      reload(d);
+      break;
+    case Op::LWRITE:
+      line("printf(\"%%d\\n\", UNBOX(s%d));", d - 1);
+      line("s%d = (word)%d;", d - 1, BOX(0));
+      break;
+    case Op::LLENGTH:
+      line("s%d = (word)Llength((void *)s%d);", d - 1, d - 1);
+      break;
+    case Op::LSTRING:
+      spill(d);
+      line("s%d = (word)Lstring((void *)s%d);", d - 1, d - 1);
+      reload(d - 1);
+      break;
+    case Op::BARRAY: {
+      i32 n = insn.a;
+      spill(d);
+      line("{");
+      line("  data *r = (data *)alloc_array(%d);", n);
+      for (i32 i = 0; i < n; i++) {
+        line("  ((word *)r->contents)[%d] = bp[%d];", i, shadow(d - n + i));
+      }
+      line("  s%d = (word)r->contents;", d - n);
+      line("}");
+      reload(d - n);
+      set_depth(d - n + 1);
+      break;
+    }
+    case Op::BINOP: {
+      static char const *const c_ops[] = {
+          "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&",
+          "||"};
+      if (insn.a < 0 || insn.a >= (i32)BinopLabel::BINOP_LAST) {
+        error("unsupported op label: %d", insn.a);
+      }
+      line("s%d = BOX(UNBOX(s%d) %s UNBOX(s%d));", d - 2, d - 2,
+           c_ops[insn.a], d - 1);
+      set_depth(d - 1);
+      break;
+    }
+    default:
+      error("c translation: unexpected %s", op_names[(u8)insn.op]);
+    }
+    return true;
+  }
+};
@@ -0,0 +1,378 @@
+#pragma once
+
+#include "control-flow.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <vector>
+
+// Whole-program closure flow analysis (0-CFA): every stack slot, local,
+// argument, captured variable, global and function result gets the set of
+// functions whose closures it may hold. A set is kept exactly only while it
+// has at most one element, which is all devirtualization needs: a CALLC whose
+// closure can only be a closure of one function becomes CALLC_DIRECT, which
+// enters that function without the inline cache and the indirect jump. The
+// closure stays on the stack, so captured variables are read from it as
+// before.
+//
+// Locals are tracked per program point, the rest per function or per global
+// and joined over all the stores. Values loaded from objects, arguments of
+// public functions and slots whose address is taken by LDA may hold any
+// closure; a CALLC on such a value may enter any function a closure was
+// built for, so all of them get unknown arguments. Runs on the predecoded
+// program before the other passes.
+class ClosureFlow {
+public:
+  ClosureFlow(ControlFlowGraph const &cfg, PredecodedProgram &program)
+      : cfg(cfg), program(program) {}
+
+  // Returns the number of devirtualized call sites.
+  i32 devirtualize() {
+    init_summaries();
+    callee_at.assign(program.code.size(), NO_CLOSURE);
+    states.assign(cfg.blocks.size(), State{});
+    for (changed = true; changed;) {
+      changed = false;
+      for (size_t f = 0; f < cfg.functions.size(); f++) {
+        analyze(f);
+      }
+    }
+
+    i32 devirtualized = 0;
+    for (size_t i = 0; i < program.code.size(); i++) {
+      auto &insn = program.code[i];
+      if ((insn.op != Op::CALLC && insn.op != Op::TAILCALLC) ||
+          callee_at[i] < 0) {
+        continue;
+      }
+      insn.op = insn.op == Op::CALLC ? Op::CALLC_DIRECT : Op::TAILCALLC_DIRECT;
+      insn.c.target = program.insn_at[callee_at[i]];
+      devirtualized++;
+    }
+    return devirtualized;
+  }
+
+private:
+  // a value is the code offset of the only function it may be a closure of,
+  // or one of these
+  static i32 constexpr NO_CLOSURE = -1;
+  static i32 constexpr ANY_CLOSURE = -2;
+
+  struct State {
+    bool reached = false;
+    std::vector<i32> stack; // the top is at the back
+    std::vector<i32> locals;
+  };
+
+  ControlFlowGraph const &cfg;
+  PredecodedProgram &program;
+  // per function, indexed like cfg.functions
+  std::vector<std::vector<i32>> args;
+  std::vector<std::vector<i32>> captured;
+  std::vector<i32> results;
+  std::vector<bool> is_closure_body;
+  std::vector<i32> globals;
+  bool unknown_calls = false;
+  bool changed = false;            // a summary grew during this iteration
+  std::vector<i32> callee_at;      // closure of every CALLC of program.code
+  std::vector<State> states;       // at block entries
+  std::vector<bool> address_taken; // locals of the current function
+
+  static i32 join(i32 a, i32 b) {
+    if (a == b || b == NO_CLOSURE) {
+      return a;
+    }
+    return a == NO_CLOSURE ? b : ANY_CLOSURE;
+  }
+
+  void raise(i32 &slot, i32 value) {
+    i32 joined = join(slot, value);
+    changed = changed || joined != slot;
+    slot = joined;
+  }
+
+  void init_summaries() {
+    size_t n = cfg.functions.size();
+    args.assign(n, {});
+    captured.assign(n, {});
+    results.assign(n, NO_CLOSURE);
+    is_closure_body.assign(n, false);
+    globals.assign(cfg.bf->global_area_size, NO_CLOSURE);
+    for (size_t f = 0; f < n; f++) {
+      args[f].assign(program.insn_at[cfg.functions[f].begin]->a, NO_CLOSURE);
+    }
+    for (i32 i = 0; i < cfg.bf->public_symbols_number; i++) {
+      i32 f = cfg.function_at[cfg.bf->public_ptr[2 * i + 1]];
+      args[f].assign(args[f].size(), ANY_CLOSURE);
+    }
+    for (auto const &insn : program.code) {
+      if (insn.op != Op::CLOSURE ||
+          cfg.function_at[insn.a] == ControlFlowGraph::NONE) {
+        continue; // unreachable
+      }
+      i32 f = cfg.function_at[insn.a];
+      is_closure_body[f] = true;
+      if ((i32)captured[f].size() < insn.b) {
+        captured[f].resize(insn.b, NO_CLOSURE);
+      }
+    }
+  }
+
+  // Runs the function to a fixed point with the current summaries.
+  void analyze(size_t f) {
+    auto const &function = cfg.functions[f];
+    find_address_taken(cfg, program, function, address_taken);
+    for (i32 b : function.order) {
+      states[b] = State{};
+    }
+    states[function.order[0]].reached = true;
+    for (bool local_changed = true; local_changed;) {
+      local_changed = false;
+      for (i32 b : function.order) {
+        if (!states[b].reached) {
+          continue;
+        }
+        State state = states[b];
+        cfg.for_each_insn(b, [&](i32 offset) {
+          if (Insn const *insn = program.insn_starting_at(offset)) {
+            transfer(f, *insn, state);
+          }
+        });
+        for (i32 s : cfg.blocks[b].succs) {
+          if (s != ControlFlowGraph::NONE) {
+            local_changed = merge(states[s], state) || local_changed;
+          }
+        }
+      }
+    }
+  }
+
+  static bool merge(State &into, State const &from) {
+    if (!into.reached) {
+      into = from;
+      return true;
+    }
+    bool merged = false;
+    auto merge_all = [&merged](std::vector<i32> &a, std::vector<i32> const &b) {
+      if (a.size() != b.size()) {
+        error("closure flow: stack depth mismatch");
+      }
+      for (size_t i = 0; i < a.size(); i++) {
+        i32 joined = join(a[i], b[i]);
+        merged = merged || joined != a[i];
+        a[i] = joined;
+      }
+    };
+    merge_all(into.stack, from.stack);
+    merge_all(into.locals, from.locals);
+    return merged;
+  }
+
+  static i32 pop(State &state) {
+    if (state.stack.empty()) {
+      return ANY_CLOSURE;
+    }
+    i32 v = state.stack.back();
+    state.stack.pop_back();
+    return v;
+  }
+  static void pop(State &state, i32 n) {
+    for (i32 i = 0; i < n; i++) {
+      pop(state);
+    }
+  }
+  static void push(State &state, i32 v) { state.stack.push_back(v); }
+
+  // the summary slot behind a variable, nullptr for tracked locals and for
+  // out of range indices
+  i32 *slot(size_t f, u32 kind, i32 index) {
+    auto at = [index](std::vector<i32> &values) {
+      return index >= 0 && index < (i32)values.size() ? &values[index]
+                                                      : nullptr;
+    };
+    switch (kind) {
+    case GLOBAL:
+      return at(globals);
+    case ARG:
+      return at(args[f]);
+    case CAPTURED:
+      return at(captured[f]);
+    default:
+      return nullptr;
+    }
+  }
+
+  bool is_tracked_local(State const &state, i32 index) const {
+    return index >= 0 && index < (i32)state.locals.size() &&
+           !(index < (i32)address_taken.size() && address_taken[index]);
+  }
+
+  i32 read(size_t f, State const &state, u32 kind, i32 index) {
+    if (kind == LOCAL) {
+      return is_tracked_local(state, index) ? state.locals[index]
+                                            : ANY_CLOSURE;
+    }
+    i32 *s = slot(f, kind, index);
+    return s != nullptr ? *s : ANY_CLOSURE;
+  }
+
+  void write(size_t f, State &state, u32 kind, i32 index, i32 value) {
+    if (kind == LOCAL) {
+      if (is_tracked_local(state, index)) {
+        state.locals[index] = value;
+      }
+    } else if (i32 *s = slot(f, kind, index)) {
+      raise(*s, value);
+    }
+  }
+
+  // passes the n topmost values to function g and pushes its result
+  void call(State &state, i32 g, i32 n) {
+    for (i32 i = n - 1; i >= 0; i--) {
+      i32 v = pop(state);
+      if (i < (i32)args[g].size()) {
+        raise(args[g][i], v);
+      }
+    }
+    push(state, results[g]);
+  }
+
+  void call_unknown(State &state, i32 n) {
+    pop(state, n);
+    if (!unknown_calls) {
+      unknown_calls = changed = true;
+      for (size_t g = 0; g < args.size(); g++) {
+        if (is_closure_body[g]) {
+          args[g].assign(args[g].size(), ANY_CLOSURE);
+        }
+      }
+    }
+    push(state, ANY_CLOSURE);
+  }
+
+  void transfer(size_t f, Insn const &insn, State &state) {
+    switch (insn.op) {
+    case Op::BEGIN:
+    case Op::CBEGIN:
+      state.stack.clear();
+      state.locals.assign(insn.b, NO_CLOSURE);
+      break;
+    case Op::CONST:
+    case Op::STRING:
+    case Op::LREAD:
+      push(state, NO_CLOSURE);
+      break;
+    case Op::BINOP:
+      pop(state, 2);
+      push(state, NO_CLOSURE);
+      break;
+    case Op::ELEM:
+      pop(state, 2);
+      push(state, ANY_CLOSURE);
+      break;
+    case Op::SEXP:
+    case Op::BARRAY:
+      pop(state, insn.a);
+      push(state, NO_CLOSURE);
+      break;
+    case Op::STI: {
+      // every slot a reference may point to is already ANY_CLOSURE
+      i32 value = pop(state);
+      pop(state);
+      push(state, value);
+      break;
+    }
+    case Op::STA: {
+      i32 value = pop(state);
+      pop(state, 2);
+      push(state, value);
+      break;
+    }
+    case Op::DROP:
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+      pop(state);
+      break;
+    case Op::DUP: {
+      i32 v = pop(state);
+      push(state, v);
+      push(state, v);
+      break;
+    }
+    case Op::SWAP: {
+      i32 top = pop(state);
+      i32 second = pop(state);
+      push(state, top);
+      push(state, second);
+      break;
+    }
+    case Op::LD:
+      push(state, read(f, state, insn.a, insn.b));
+      break;
+    case Op::LDA:
+      if (i32 *s = slot(f, insn.a, insn.b)) {
+        raise(*s, ANY_CLOSURE);
+      }
+      push(state, ANY_CLOSURE);
+      push(state, ANY_CLOSURE);
+      break;
+    case Op::ST:
+      write(f, state, insn.a, insn.b,
+            state.stack.empty() ? ANY_CLOSURE : state.stack.back());
+      break;
+    case Op::CLOSURE: {
+      i32 g = cfg.function_at[insn.a];
+      for (i32 k = 0; k < insn.b; k++) {
+        auto const &capture = insn.c.captures[k];
+        raise(captured[g][k], read(f, state, capture.kind, capture.index));
+      }
+      push(state, insn.a);
+      break;
+    }
+    case Op::CALLC:
+    case Op::TAILCALLC: {
+      size_t depth = state.stack.size();
+      i32 callee = depth > (size_t)insn.a ? state.stack[depth - 1 - insn.a]
+                                          : ANY_CLOSURE;
+      callee_at[&insn - program.code.data()] = callee;
+      if (callee == ANY_CLOSURE) {
+        call_unknown(state, insn.a + 1);
+      } else if (callee == NO_CLOSURE) {
+        pop(state, insn.a + 1); // fails at run time, or not reached yet
+        push(state, NO_CLOSURE);
+      } else {
+        call(state, cfg.function_at[callee], insn.a);
+        i32 result = pop(state);
+        pop(state);
+        push(state, result);
+      }
+      break;
+    }
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+      call(state, function_of(cfg, program, insn.c.target), insn.a);
+      break;
+    case Op::TAG:
+    case Op::ARRAY:
+    case Op::LWRITE:
+    case Op::LLENGTH:
+    case Op::LSTRING:
+      pop(state);
+      push(state, NO_CLOSURE);
+      break;
+    case Op::PATT:
+      pop(state, insn.a == (i32)Patt::STR_EQ_TAG ? 2 : 1);
+      push(state, NO_CLOSURE);
+      break;
+    case Op::END:
+      raise(results[f], pop(state));
+      break;
+    case Op::JMP:
+    case Op::FAILURE:
+    case Op::STOP:
+      break;
+    default:
+      error("closure flow: unexpected %s", op_names[(u8)insn.op]);
+    }
+  }
+};
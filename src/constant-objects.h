@@ -0,0 +1,104 @@
+#pragma once
+
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <cstring>
+#include <unordered_map>
+
+// Instructions that build the same immutable object on every execution are
+// replaced with OBJECT, which pushes a copy allocated once in the constant
+// area of the runtime (outside of the GC heap, never moved or collected):
+//   - SEXP with no fields, one object per tag;
+//   - CLOSURE without captured variables, one object per function;
+//   - STRING, one object per literal, but only if the program has no STA.
+// Strings are the only objects STA can modify, and the constant area cannot
+// copy them on write because it does not know their referrers; Bsta rejects
+// writes into constant objects. Shared objects are identical under ==.
+class ConstantObjects {
+public:
+  ConstantObjects(PredecodedProgram &program) : program(program) {}
+
+  // Returns the number of replaced instructions.
+  i32 preallocate() {
+    bool share_strings = true;
+    for (auto const &insn : program.code) {
+      share_strings = share_strings && insn.op != Op::STA;
+    }
+    size_t bytes = 0;
+    for (auto const &insn : program.code) {
+      if (is_constant(insn, share_strings)) {
+        bytes += BYTES_TO_WORDS(size_of(insn)) * sizeof(size_t);
+      }
+    }
+    init_constant_area(BYTES_TO_WORDS(bytes ? bytes : 1));
+
+    i32 replaced = 0;
+    for (auto &insn : program.code) {
+      if (!is_constant(insn, share_strings)) {
+        continue;
+      }
+      void *object = object_for(insn);
+      insn = PredecodingVisitor::make(Op::OBJECT);
+      insn.c.object = object;
+      replaced++;
+    }
+    return replaced;
+  }
+
+private:
+  PredecodedProgram &program;
+  std::unordered_map<char const *, void *> strings;
+  std::unordered_map<i32, void *> sexps;    // by tag hash
+  std::unordered_map<i32, void *> closures; // by code offset
+
+  static bool is_constant(Insn const &insn, bool share_strings) {
+    return (insn.op == Op::STRING && share_strings) ||
+           (insn.op == Op::SEXP && insn.a == 0) ||
+           (insn.op == Op::CLOSURE && insn.b == 0);
+  }
+
+  // an upper bound, the same literal or tag may be shared by several sites
+  static size_t size_of(Insn const &insn) {
+    switch (insn.op) {
+    case Op::STRING:
+      return string_size(strlen(insn.c.str));
+    case Op::SEXP:
+      return sexp_size(0);
+    default:
+      return closure_size(1);
+    }
+  }
+
+  void *object_for(Insn const &insn) {
+    switch (insn.op) {
+    case Op::STRING: {
+      auto &object = strings[insn.c.str];
+      if (object == nullptr) {
+        auto len = strlen(insn.c.str);
+        data *r = (data *)alloc_constant_string(len);
+        memcpy(r->contents, insn.c.str, len + 1);
+        object = r->contents;
+      }
+      return object;
+    }
+    case Op::SEXP: {
+      auto &object = sexps[insn.b];
+      if (object == nullptr) {
+        data *r = (data *)alloc_constant_sexp(0);
+        ((sexp *)r)->tag = UNBOX(insn.b);
+        object = r->contents;
+      }
+      return object;
+    }
+    default: {
+      auto &object = closures[insn.a];
+      if (object == nullptr) {
+        data *r = (data *)alloc_constant_closure(1);
+        ((void **)r->contents)[0] = (void *)insn.a;
+        object = r->contents;
+      }
+      return object;
+    }
+    }
+  }
+};
@@ -0,0 +1,386 @@
+#pragma once
+
+#include "bytefile.h"
+#include "diagnostic-visitor.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include "visitor.h"
+#include <algorithm>
+#include <vector>
+
+// Intraprocedural control flow of a whole bytefile, built once and shared by
+// the verifier and the optimizers. Functions are discovered from the public
+// symbols through CALL and CLOSURE targets; only the code reachable from them
+// is part of the graph. Per-instruction data is kept in dense arrays indexed
+// by code offset, per-block data in arrays indexed by block number.
+
+struct BasicBlock {
+  i32 begin;    // offset of the first instruction
+  i32 last;     // offset of the last instruction
+  i32 end;      // offset right after the last instruction
+  i32 function; // index into ControlFlowGraph::functions
+  i32 succs[2] = {-1, -1}; // fallthrough first, -1 if absent
+  i32 idom = -1;           // immediate dominator, -1 for the entry block
+  i32 rpo = -1;            // position in the reverse postorder of the function
+  i32 loop_header = -1;    // header of the innermost enclosing loop, or -1
+  i32 loop_depth = 0;
+};
+
+struct CfgFunction {
+  i32 begin;              // offset of BEGIN/CBEGIN
+  std::vector<i32> order; // blocks in reverse postorder, the entry first
+};
+
+// a natural loop, back edges sharing a header are merged
+struct Loop {
+  i32 header;
+  std::vector<i32> blocks; // the header included
+};
+
+class ControlFlowGraph {
+public:
+  static i32 constexpr NONE = -1;
+
+  bytefile const *bf;
+  std::vector<i32> next_at;     // offset of the next instruction, or NONE
+  std::vector<i32> block_at;    // block of the instruction, or NONE
+  std::vector<i32> function_at; // function starting at the offset, or NONE
+  std::vector<BasicBlock> blocks;
+  std::vector<i32> pred_begin; // preds of b are preds[pred_begin[b]...[b+1]]
+  std::vector<i32> preds;
+  std::vector<CfgFunction> functions;
+  std::vector<Loop> loops;
+
+  ControlFlowGraph(bytefile const *bf) : bf(bf) {
+    auto const code_size = bf->code_end - bf->code_ptr;
+    next_at.assign(code_size, NONE);
+    block_at.assign(code_size, NONE);
+    function_at.assign(code_size, NONE);
+    is_leader.assign(code_size, false);
+    discover();
+    build_blocks();
+    for (size_t f = 0; f < functions.size(); f++) {
+      order_blocks(f);
+      compute_dominators(f);
+    }
+    find_loops();
+  }
+
+  bool is_reachable(i32 offset) const { return block_at[offset] != NONE; }
+  bool is_block_begin(i32 offset) const {
+    return is_reachable(offset) && blocks[block_at[offset]].begin == offset;
+  }
+
+  bool dominates(i32 a, i32 b) const {
+    if (blocks[a].function != blocks[b].function) {
+      return false;
+    }
+    for (; b != NONE; b = blocks[b].idom) {
+      if (a == b) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Calls f(offset) for every instruction of the block in order.
+  template <typename F> void for_each_insn(i32 block, F &&f) const {
+    for (i32 o = blocks[block].begin; o != NONE; o = next_at[o]) {
+      f(o);
+      if (o == blocks[block].last) {
+        break;
+      }
+    }
+  }
+
+private:
+  std::vector<bool> is_leader;
+  // per instruction, only while building
+  std::vector<InstructionKind> kind_at;
+  std::vector<i32> target_at;
+
+  static bool ends_block(InstructionKind kind) {
+    return kind == InstructionKind::JMP || kind == InstructionKind::CJMP ||
+           kind == InstructionKind::END || kind == InstructionKind::FAIL_KIND;
+  }
+
+  // Walks every function from its BEGIN, marking instructions and leaders.
+  void discover() {
+    auto const code_size = bf->code_end - bf->code_ptr;
+    kind_at.assign(code_size, InstructionKind::OTHER);
+    target_at.assign(code_size, NONE);
+    std::vector<i32> worklist;
+    std::vector<i32> insn_stack;
+    auto add_function = [&](i32 offset) {
+      if (offset < 0 || offset >= code_size ||
+          !check_is_begin(bf, bf->code_ptr + offset)) {
+        error("0x%.8x is not a function", offset);
+      }
+      if (function_at[offset] == NONE) {
+        function_at[offset] = (i32)functions.size();
+        functions.push_back(CfgFunction{offset, {}});
+        worklist.push_back(offset);
+      }
+    };
+    auto add_insn = [&](i32 offset, bool leader) {
+      if (offset < 0 || offset >= code_size) {
+        error("control flow leaves the code area at 0x%.8x", offset);
+      }
+      is_leader[offset] = is_leader[offset] || leader;
+      if (next_at[offset] == NONE) {
+        insn_stack.push_back(offset);
+        next_at[offset] = (i32)code_size; // visited, fixed below
+      }
+    };
+    for (i32 i = 0; i < bf->public_symbols_number; i++) {
+      add_function(bf->public_ptr[2 * i + 1]);
+    }
+
+    auto visitor = DiagnosticVisitor{bf};
+    while (!worklist.empty()) {
+      i32 entry = worklist.back();
+      worklist.pop_back();
+      add_insn(entry, true);
+      while (!insn_stack.empty()) {
+        i32 offset = insn_stack.back();
+        insn_stack.pop_back();
+        u8 *ip = bf->code_ptr + offset;
+        auto const [next_ip, info] =
+            visit_instruction<DiagnosticInformation, true>(bf, ip, visitor);
+        if (info.error.has_value()) {
+          error("%s at 0x%.8x", info.error->c_str(), offset);
+        }
+        i32 next = (i32)(next_ip - bf->code_ptr);
+        next_at[offset] = next;
+        kind_at[offset] = *ip == 0xFF ? InstructionKind::END : info.kind;
+        switch (kind_at[offset]) {
+        case InstructionKind::CALL:
+        case InstructionKind::CLOSURE:
+          add_function(info.jump_address.value());
+          add_insn(next, false);
+          break;
+        case InstructionKind::JMP:
+          target_at[offset] = info.jump_address.value();
+          add_insn(target_at[offset], true);
+          break;
+        case InstructionKind::CJMP:
+          target_at[offset] = info.jump_address.value();
+          add_insn(target_at[offset], true);
+          add_insn(next, true);
+          break;
+        case InstructionKind::OTHER:
+          add_insn(next, false);
+          break;
+        default:
+          break;
+        }
+      }
+    }
+    for (size_t f = 0; f < functions.size(); f++) {
+      is_leader[functions[f].begin] = true;
+    }
+  }
+
+  // Splits the marked instructions into blocks in layout order. An
+  // instruction that is not a leader is only reached by falling through, so
+  // it always continues the block of the instruction right before it.
+  void build_blocks() {
+    auto const code_size = (i32)(bf->code_end - bf->code_ptr);
+    i32 function = NONE;
+    i32 current = NONE;
+    for (i32 o = 0; o < code_size; o++) {
+      if (next_at[o] == NONE) {
+        continue;
+      }
+      if (function_at[o] != NONE) {
+        function = function_at[o];
+      }
+      if (current == NONE || is_leader[o]) {
+        current = (i32)blocks.size();
+        blocks.push_back(BasicBlock{o, o, next_at[o], function});
+      }
+      block_at[o] = current;
+      blocks[current].last = o;
+      blocks[current].end = next_at[o];
+      if (ends_block(kind_at[o])) {
+        current = NONE;
+      }
+    }
+
+    std::vector<i32> n_preds(blocks.size() + 1, 0);
+    for (auto &block : blocks) {
+      i32 last = block.last;
+      switch (kind_at[last]) {
+      case InstructionKind::JMP:
+        block.succs[0] = block_at[target_at[last]];
+        break;
+      case InstructionKind::CJMP:
+        block.succs[0] = block_at[block.end];
+        block.succs[1] = block_at[target_at[last]];
+        break;
+      case InstructionKind::END:
+      case InstructionKind::FAIL_KIND:
+        break;
+      default:
+        block.succs[0] = block_at[block.end];
+        break;
+      }
+      for (i32 s : block.succs) {
+        if (s != NONE) {
+          n_preds[s + 1]++;
+        }
+      }
+    }
+    pred_begin.assign(blocks.size() + 1, 0);
+    for (size_t b = 0; b < blocks.size(); b++) {
+      pred_begin[b + 1] = pred_begin[b] + n_preds[b + 1];
+    }
+    preds.assign(pred_begin.back(), NONE);
+    std::vector<i32> filled(pred_begin.begin(), pred_begin.end() - 1);
+    for (size_t b = 0; b < blocks.size(); b++) {
+      for (i32 s : blocks[b].succs) {
+        if (s != NONE) {
+          preds[filled[s]++] = (i32)b;
+        }
+      }
+    }
+    kind_at = {};
+    target_at = {};
+  }
+
+  void order_blocks(size_t f) {
+    std::vector<i32> postorder;
+    std::vector<std::pair<i32, i32>> stack; // block, next successor to visit
+    std::vector<bool> seen(blocks.size(), false);
+    i32 entry = block_at[functions[f].begin];
+    stack.push_back({entry, 0});
+    seen[entry] = true;
+    while (!stack.empty()) {
+      auto &[block, succ] = stack.back();
+      if (succ < 2) {
+        i32 s = blocks[block].succs[succ++];
+        if (s != NONE && !seen[s]) {
+          seen[s] = true;
+          stack.push_back({s, 0});
+        }
+        continue;
+      }
+      postorder.push_back(block);
+      stack.pop_back();
+    }
+    auto &order = functions[f].order;
+    order.assign(postorder.rbegin(), postorder.rend());
+    for (size_t i = 0; i < order.size(); i++) {
+      blocks[order[i]].rpo = (i32)i;
+    }
+  }
+
+  // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+  void compute_dominators(size_t f) {
+    auto const &order = functions[f].order;
+    i32 entry = order[0];
+    auto intersect = [&](i32 a, i32 b) {
+      while (a != b) {
+        while (blocks[a].rpo > blocks[b].rpo) {
+          a = blocks[a].idom;
+        }
+        while (blocks[b].rpo > blocks[a].rpo) {
+          b = blocks[b].idom;
+        }
+      }
+      return a;
+    };
+    blocks[entry].idom = entry;
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t i = 1; i < order.size(); i++) {
+        i32 b = order[i];
+        i32 idom = NONE;
+        for (i32 p = pred_begin[b]; p < pred_begin[b + 1]; p++) {
+          if (blocks[preds[p]].idom == NONE) {
+            continue;
+          }
+          idom = idom == NONE ? preds[p] : intersect(preds[p], idom);
+        }
+        if (blocks[b].idom != idom) {
+          blocks[b].idom = idom;
+          changed = true;
+        }
+      }
+    }
+    blocks[entry].idom = NONE;
+  }
+
+  void find_loops() {
+    std::vector<i32> loop_of(blocks.size(), NONE); // last loop a block joined
+    for (size_t h = 0; h < blocks.size(); h++) {
+      for (i32 p = pred_begin[h]; p < pred_begin[h + 1]; p++) {
+        if (!dominates((i32)h, preds[p])) {
+          continue;
+        }
+        if (loop_of[h] == NONE || loops[loop_of[h]].header != (i32)h) {
+          loop_of[h] = (i32)loops.size();
+          loops.push_back(Loop{(i32)h, {(i32)h}});
+        }
+        // the blocks that reach the back edge without passing the header
+        i32 l = loop_of[h];
+        std::vector<i32> worklist{preds[p]};
+        while (!worklist.empty()) {
+          i32 b = worklist.back();
+          worklist.pop_back();
+          if (loop_of[b] == l) {
+            continue;
+          }
+          loop_of[b] = l;
+          loops[l].blocks.push_back(b);
+          for (i32 q = pred_begin[b]; q < pred_begin[b + 1]; q++) {
+            worklist.push_back(preds[q]);
+          }
+        }
+      }
+    }
+    // inner loops are smaller, so they are assigned last
+    std::vector<i32> by_size(loops.size());
+    for (size_t i = 0; i < loops.size(); i++) {
+      by_size[i] = (i32)i;
+    }
+    std::sort(by_size.begin(), by_size.end(), [&](i32 a, i32 b) {
+      return loops[a].blocks.size() > loops[b].blocks.size();
+    });
+    for (i32 l : by_size) {
+      for (i32 b : loops[l].blocks) {
+        blocks[b].loop_header = loops[l].header;
+        blocks[b].loop_depth++;
+      }
+    }
+  }
+};
+
+// Helpers of the passes over the predecoded program.
+
+// the function starting at `begin`, e.g. the target of a CALL
+static inline i32 function_of(ControlFlowGraph const &cfg,
+                              PredecodedProgram const &program,
+                              Insn const *begin) {
+  return cfg.function_at[program.offsets[begin - program.code.data()]];
+}
+
+// Marks the locals of the function whose address is taken by LDA; `taken`
+// only reaches up to the last of them.
+static inline void find_address_taken(ControlFlowGraph const &cfg,
+                                      PredecodedProgram const &program,
+                                      CfgFunction const &function,
+                                      std::vector<bool> &taken) {
+  taken.clear();
+  for (i32 b : function.order) {
+    cfg.for_each_insn(b, [&](i32 offset) {
+      Insn const *insn = program.insn_starting_at(offset);
+      if (insn != nullptr && insn->op == Op::LDA && insn->a == (i32)LOCAL) {
+        if (insn->b >= (i32)taken.size()) {
+          taken.resize(insn->b + 1, false);
+        }
+        taken[insn->b] = true;
+      }
+    });
+  }
+}
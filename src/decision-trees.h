@@ -0,0 +1,90 @@
+#pragma once
+
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <vector>
+
+// A `case` over constructors compiles to a chain of tests on the scrutinee,
+// each failing test jumping to the next one:
+//
+//   L1: DUP; TAG t1 n1; CJMPz L2; <branch 1>
+//   L2: DUP; TAG t2 n2; CJMPz L3; <branch 2>
+//   L3: DUP; ARRAY n3;  CJMPz L4; <branch 3>
+//   L4: ...
+//
+// Every test compares the whole (kind, tag, arity) of the value with a
+// constant, so at most one distinct test matches and the chain is a lookup:
+// DECISION reads the header of the value once and jumps to the branch of the
+// first test with its key, or to the failure target of the last test. The
+// branches start with the value still on the stack, as after a passed test.
+// The tests themselves stay in place for other jumps into the chain.
+
+static inline u64 decision_key(u32 kind, i32 tag, i32 arity) {
+  return ((u64)(u32)tag << 32) | ((u64)(u32)arity << 3) | kind;
+}
+
+// the key of the value, 0 if no test can match it
+static inline u64 decision_key_of(size_t value) {
+  if (UNBOXED(value)) {
+    return 0;
+  }
+  data *d = TO_DATA(value);
+  u32 kind = TAG(d->data_header);
+  i32 arity = LEN(d->data_header);
+  if (kind == SEXP_TAG) {
+    return decision_key(kind, TO_SEXP(value)->tag, arity);
+  }
+  return kind == ARRAY_TAG ? decision_key(kind, 0, arity) : 0;
+}
+
+// the key checked by a DUP;TAG|ARRAY;CJMPz test starting at i, or 0
+static inline u64 test_key(std::vector<Insn> const &code, size_t i) {
+  if (i + 2 >= code.size() || code[i].op != Op::DUP ||
+      code[i + 2].op != Op::CJMPZ) {
+    return 0;
+  }
+  Insn const &test = code[i + 1];
+  if (test.op == Op::TAG) {
+    return decision_key(SEXP_TAG, UNBOX(test.b), test.a);
+  }
+  if (test.op == Op::ARRAY) {
+    return decision_key(ARRAY_TAG, 0, test.a);
+  }
+  return 0;
+}
+
+// Replaces the first DUP of every chain of at least two tests with DECISION.
+// Runs before fusion. Returns the number of decision nodes.
+static inline i32 build_decision_trees(PredecodedProgram &program) {
+  auto &code = program.code;
+  std::vector<std::pair<size_t, DecisionNode>> found;
+  for (size_t i = 0; i < code.size(); i++) {
+    if (test_key(code, i) == 0) {
+      continue;
+    }
+    DecisionNode node;
+    size_t tests = 0;
+    size_t t = i;
+    // bounded, a chain could jump back to its start
+    for (u64 key; tests < code.size() && (key = test_key(code, t)) != 0;
+         tests++) {
+      node.targets.emplace(key, &code[t + 3]); // the first test wins
+      node.fail = code[t + 2].c.target;
+      t = node.fail - code.data();
+    }
+    if (tests >= 2) {
+      found.emplace_back(i, std::move(node));
+    }
+  }
+  for (auto &[i, node] : found) {
+    code[i].op = Op::DECISION;
+    code[i].b = (i32)program.decisions.size();
+    program.decisions.push_back(std::move(node));
+  }
+  return (i32)found.size();
+}
+
+static inline Insn *decide(DecisionNode const &node, size_t value) {
+  auto it = node.targets.find(decision_key_of(value));
+  return it == node.targets.end() ? node.fail : it->second;
+}
@@ -7,7 +7,15 @@
 #include <optional>
 #include <string>
 
-enum class InstructionKind : u8 { CALL, JMP, CJMP, END, FAIL_KIND, OTHER };
+enum class InstructionKind : u8 {
+  CALL,
+  CLOSURE,
+  JMP,
+  CJMP,
+  END,
+  FAIL_KIND,
+  OTHER
+};
 
 using i8 = std::int8_t;
 
@@ -122,7 +130,8 @@ public:
     if (!check_is_begin(bf, bf->code_ptr + addr)) {
       error = "closure does not point at begin\n";
     }
-    return DiagnosticInformation{1, (i8)n, error};
+    // captured values are read from variables, not from the stack
+    return DiagnosticInformation{1, 0, error, addr, InstructionKind::CLOSURE};
   }
 
   DiagnosticInformation visit_call_closure(u8 *decode_next_ip, i32 n_arg) {
@@ -134,7 +143,8 @@ public:
     if (!check_is_begin(bf, bf->code_ptr + loc)) {
       error = "CALL does not call a function\n";
     }
-    return DiagnosticInformation{(i8)(-n_arg + 1), (i8)n_arg};
+    return DiagnosticInformation{(i8)(-n_arg + 1), (i8)n_arg, error, loc,
+                                 InstructionKind::CALL};
   }
   DiagnosticInformation visit_tag(u8 *decode_next_ip, char const *name,
                                   i32 n_arg) {
@@ -0,0 +1,304 @@
+#pragma once
+
+#include "control-flow.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <vector>
+
+// Finds arrays built by BARRAY and closures built by CLOSURE that never
+// outlive the frame that builds them and places them into the frame instead
+// of the heap (BARRAY_FRAME, CLOSURE_FRAME). The storage is appended to the
+// locals of the function, so it is zeroed by BEGIN, scanned by the GC like any
+// other stack word and released with the frame; the GC ignores pointers
+// outside of the heap, so such an object is never moved or collected.
+//
+// An object escapes when it is returned, passed to a call, stored into a
+// global, an argument, a captured variable, a reference or another object,
+// or captured by a closure. Reading it (ELEM, ARRAY, PATT, Llength, ==, ...)
+// does not make it escape, and neither does calling a closure with CALLC:
+// the callee reads its captured variables but cannot get hold of the closure
+// itself. Closures without captured variables are left to ConstantObjects.
+// Sites inside loops are left alone, so every site runs at most once per
+// activation of the frame and its storage is never reused while the previous
+// object is alive. S-expressions are not handled: their tag word may look
+// like a heap pointer to the conservative stack scan.
+//
+// Values are sets of allocation sites (bit i is the i-th candidate site of the
+// function), joined at block entries until nothing changes.
+class EscapeAnalysis {
+public:
+  EscapeAnalysis(ControlFlowGraph const &cfg, PredecodedProgram &program)
+      : cfg(cfg), program(program) {}
+
+  // Returns the number of objects moved into frames.
+  i32 run() {
+    i32 moved = 0;
+    states.assign(cfg.blocks.size(), State{});
+    for (auto const &function : cfg.functions) {
+      find_sites(function);
+      if (sites.empty()) {
+        continue;
+      }
+      escaped = 0;
+      states[function.order[0]].reached = true;
+      for (bool changed = true; changed;) {
+        changed = false;
+        for (i32 b : function.order) {
+          if (!states[b].reached) {
+            continue;
+          }
+          State state = states[b];
+          cfg.for_each_insn(b, [&](i32 offset) {
+            if (Insn const *insn = program.insn_starting_at(offset)) {
+              transfer(*insn, state);
+            }
+          });
+          for (i32 s : cfg.blocks[b].succs) {
+            if (s != ControlFlowGraph::NONE) {
+              changed = merge(states[s], state) || changed;
+            }
+          }
+        }
+      }
+      moved += place_in_frame(function);
+    }
+    return moved;
+  }
+
+private:
+  struct State {
+    bool reached = false;
+    std::vector<u64> stack; // the top is at the back
+    std::vector<u64> locals;
+  };
+
+  ControlFlowGraph const &cfg;
+  PredecodedProgram &program;
+  std::vector<State> states; // at block entries
+  std::vector<Insn *> sites; // candidate BARRAYs of the current function
+  std::vector<bool> address_taken; // locals of the current function
+  u64 escaped = 0;
+
+  void find_sites(CfgFunction const &function) {
+    find_address_taken(cfg, program, function, address_taken);
+    sites.clear();
+    for (i32 b : function.order) {
+      cfg.for_each_insn(b, [&](i32 offset) {
+        Insn *insn = program.insn_starting_at(offset);
+        if (insn == nullptr) {
+          return;
+        }
+        bool is_site = insn->op == Op::BARRAY ||
+                       (insn->op == Op::CLOSURE && insn->b > 0);
+        if (is_site && cfg.blocks[b].loop_depth == 0 && sites.size() < 64) {
+          sites.push_back(insn);
+        }
+      });
+    }
+  }
+
+  u64 site_bit(Insn const &insn) const {
+    for (size_t i = 0; i < sites.size(); i++) {
+      if (sites[i] == &insn) {
+        return u64(1) << i;
+      }
+    }
+    return 0;
+  }
+
+  bool is_private_local(State const &state, i32 index) const {
+    return index >= 0 && index < (i32)state.locals.size() &&
+           !(index < (i32)address_taken.size() && address_taken[index]);
+  }
+
+  static bool merge(State &into, State const &from) {
+    if (!into.reached) {
+      into = from;
+      return true;
+    }
+    bool changed = false;
+    auto merge_all = [&changed](std::vector<u64> &a,
+                                std::vector<u64> const &b) {
+      if (a.size() != b.size()) {
+        error("escape analysis: stack depth mismatch");
+      }
+      for (size_t i = 0; i < a.size(); i++) {
+        changed = changed || (a[i] | b[i]) != a[i];
+        a[i] |= b[i];
+      }
+    };
+    merge_all(into.stack, from.stack);
+    merge_all(into.locals, from.locals);
+    return changed;
+  }
+
+  static u64 pop(State &state) {
+    if (state.stack.empty()) {
+      return 0;
+    }
+    u64 v = state.stack.back();
+    state.stack.pop_back();
+    return v;
+  }
+  static void pop(State &state, i32 n) {
+    for (i32 i = 0; i < n; i++) {
+      pop(state);
+    }
+  }
+  void escape(State &state, i32 n) {
+    for (i32 i = 0; i < n; i++) {
+      escaped |= pop(state);
+    }
+  }
+  static void push(State &state, u64 v) { state.stack.push_back(v); }
+
+  void transfer(Insn const &insn, State &state) {
+    switch (insn.op) {
+    case Op::BEGIN:
+    case Op::CBEGIN:
+      state.stack.clear();
+      state.locals.assign(insn.b, 0);
+      break;
+    case Op::CONST:
+    case Op::STRING:
+    case Op::OBJECT:
+    case Op::LREAD:
+      push(state, 0);
+      break;
+    case Op::BINOP:
+    case Op::ELEM:
+      pop(state, 2);
+      push(state, 0);
+      break;
+    case Op::SEXP:
+      escape(state, insn.a);
+      push(state, 0);
+      break;
+    case Op::STI:
+    case Op::STA: {
+      u64 value = pop(state);
+      pop(state, insn.op == Op::STI ? 1 : 2);
+      escaped |= value;
+      push(state, value);
+      break;
+    }
+    case Op::DROP:
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+      pop(state);
+      break;
+    case Op::DUP: {
+      u64 v = pop(state);
+      push(state, v);
+      push(state, v);
+      break;
+    }
+    case Op::SWAP: {
+      u64 top = pop(state);
+      u64 second = pop(state);
+      push(state, top);
+      push(state, second);
+      break;
+    }
+    case Op::LD:
+      push(state, insn.a == (i32)LOCAL && is_private_local(state, insn.b)
+                      ? state.locals[insn.b]
+                      : 0);
+      break;
+    case Op::LDA:
+      push(state, 0);
+      push(state, 0);
+      break;
+    case Op::ST: {
+      u64 v = state.stack.empty() ? 0 : state.stack.back();
+      if (insn.a == (i32)LOCAL && is_private_local(state, insn.b)) {
+        state.locals[insn.b] = v;
+      } else {
+        escaped |= v;
+      }
+      break;
+    }
+    case Op::CLOSURE:
+      for (i32 k = 0; k < insn.b; k++) {
+        auto const &capture = insn.c.captures[k];
+        if (capture.kind == LOCAL && capture.index >= 0 &&
+            capture.index < (i32)state.locals.size()) {
+          escaped |= state.locals[capture.index];
+        }
+      }
+      push(state, site_bit(insn));
+      break;
+    case Op::CALLC:
+    case Op::CALLC_DIRECT:
+      escape(state, insn.a);
+      pop(state);
+      push(state, 0);
+      break;
+    case Op::TAILCALLC:
+    case Op::TAILCALLC_DIRECT:
+      // the frame is gone before the callee runs
+      escape(state, insn.a + 1);
+      push(state, 0);
+      break;
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+      escape(state, insn.a);
+      push(state, 0);
+      break;
+    case Op::TAG:
+    case Op::ARRAY:
+    case Op::LWRITE:
+    case Op::LLENGTH:
+    case Op::LSTRING:
+      pop(state);
+      push(state, 0);
+      break;
+    case Op::PATT:
+      pop(state, insn.a == (i32)Patt::STR_EQ_TAG ? 2 : 1);
+      push(state, 0);
+      break;
+    case Op::BARRAY:
+      escape(state, insn.a);
+      push(state, site_bit(insn));
+      break;
+    case Op::END:
+      escape(state, 1);
+      break;
+    case Op::JMP:
+    case Op::FAILURE:
+    case Op::STOP:
+      break;
+    default:
+      error("escape analysis: unexpected %s", op_names[(u8)insn.op]);
+    }
+  }
+
+  // Gives every non-escaping site its own storage below the locals.
+  i32 place_in_frame(CfgFunction const &function) {
+    Insn *begin = program.insn_at[function.begin];
+    i32 moved = 0;
+    for (size_t i = 0; i < sites.size(); i++) {
+      if (escaped & (u64(1) << i)) {
+        continue;
+      }
+      Insn &site = *sites[i];
+      i32 header = (i32)(sizeof(data) / sizeof(size_t));
+      if (site.op == Op::BARRAY) {
+        begin->b += header + site.a;
+        site.op = Op::BARRAY_FRAME;
+        site.b = begin->b; // the array header is at bp - b
+      } else {
+        // the offset shares b with the number of captured variables
+        if (begin->b + header + 1 + site.b > 0xFFFF) {
+          continue;
+        }
+        begin->b += header + 1 + site.b;
+        site.op = Op::CLOSURE_FRAME;
+        site.b |= begin->b << 16;
+      }
+      moved++;
+    }
+    return moved;
+  }
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "bytefile.h"
 #include "runtime-decl.h"
 #include "visitor.h"
@@ -63,17 +65,20 @@ struct ExecResult {
   u8 *exec_next_ip;
 };
 
-template <bool BytecodeChecks>
+// Policy is an InterpreterPolicy, see interpreter-policy.h; only its checks
+// are used here.
+template <typename Policy>
 class CheckingExecutingVisitor final : public Visitor<ExecResult> {
 public:
   CheckingExecutingVisitor(bytefile const *bf) : bf(bf) { __init(); }
   bytefile const *bf;
-  bool in_closure = false;
-  stack<u32, BytecodeChecks> operands_stack = stack<u32, BytecodeChecks>{};
+  bool in_closure = false; // the next BEGIN is entered through CALLC
+  stack<u32, Policy::stack_checks> operands_stack =
+      stack<u32, Policy::stack_checks>{};
   u32 create_reference(u32 index, u32 kind) {
     switch (kind) {
     case GLOBAL: {
-      if constexpr (BytecodeChecks) {
+      if constexpr (Policy::bounds_checks) {
         if (index > N_GLOBAL) {
           error("querying out of bounds global");
         }
@@ -105,6 +110,34 @@ public:
     *((u32 *)reference) = value;
   };
 
+  // a call is in a tail position if END follows it, and the main function
+  // has no caller frame to reuse
+  bool is_tail_position(u8 *next_ip) {
+    u8 const end = ((u8)HCode::MISC1 << 4) | (u8)Misc1LCode::END;
+    return next_ip < bf->code_end && *next_ip == end &&
+           operands_stack.base_pointer != operands_stack.stack_begin - 1;
+  }
+
+  // Calls `target` reusing the current frame: the n_words topmost values (the
+  // arguments, and the closure for CALLC) replace the arguments of the current
+  // function, the frame is popped as by END, and the callee returns straight
+  // to our caller.
+  u8 *tail_call(i32 n_words, bool closure, u8 *target) {
+    size_t *bp = operands_stack.base_pointer;
+    u32 saved = UNBOX(bp[1]);
+    u32 ret_ip = bp[2];
+    size_t *bottom =
+        bp + 2 + operands_stack.n_args + (saved >> CLOSURE_FRAME_SHIFT);
+    memmove((void *)(bottom - n_words + 1), (void *)(__gc_stack_top + 1),
+            n_words * sizeof(size_t));
+    __gc_stack_top = bottom - n_words;
+    operands_stack.base_pointer = (size_t *)bp[0];
+    operands_stack.n_args = saved & 0xFFFF;
+    operands_stack.push(ret_ip);
+    in_closure = closure;
+    return target;
+  }
+
   inline ExecResult visit_binop(u8 *next_ip, u8 index) override {
     debug(stderr, "BINOP\t%s\n", ops[index]);
     u32 t2 = UNBOX(operands_stack.pop());
@@ -155,7 +188,7 @@ public:
   inline ExecResult visit_jmp(u8 *decode_next_ip, i32 jump_location) override {
     debug(stderr, "JMP\t0x%.8x\n", jump_location);
     u8 *exec_next_ip = bf->code_ptr + jump_location;
-    if (BytecodeChecks) {
+    if constexpr (Policy::bounds_checks) {
       if (!check_address(bf, exec_next_ip)) {
         error("trying to jump out of the code area");
       }
@@ -170,12 +203,10 @@ public:
       u32 top_n_args = operands_stack.n_args;
       __gc_stack_top = operands_stack.base_pointer - 1;
       operands_stack.base_pointer = (size_t *)operands_stack.pop();
-      operands_stack.n_args = UNBOX(operands_stack.pop());
+      u32 saved = UNBOX(operands_stack.pop());
+      operands_stack.n_args = saved & 0xFFFF;
       u32 ret_ip = operands_stack.pop();
-      __gc_stack_top += top_n_args;
-      if (in_closure) {
-        operands_stack.pop();
-      }
+      __gc_stack_top += top_n_args + (saved >> CLOSURE_FRAME_SHIFT);
       operands_stack.push(ret_value);
       in_closure = false;
       return ExecResult{(u8 *)ret_ip};
@@ -244,7 +275,7 @@ public:
     auto top = UNBOX(operands_stack.pop());
     if (((top == 0) && !is_negated) || ((top != 0) && is_negated)) {
       u8 *ip = bf->code_ptr + jump_location;
-      if constexpr (BytecodeChecks) {
+      if constexpr (Policy::bounds_checks) {
         if (!check_address(bf, ip)) {
           error("trying to jump out of the code area");
         }
@@ -266,12 +297,14 @@ public:
     }
     debug(stderr, "BEGIN\t%d ", real_args);
     debug(stderr, "%d\n", n_locals);
-    operands_stack.push(BOX(operands_stack.n_args));
+    operands_stack.push(BOX(operands_stack.n_args |
+                            ((u32)in_closure << CLOSURE_FRAME_SHIFT)));
     operands_stack.push((u32)operands_stack.base_pointer);
+    in_closure = false;
     operands_stack.n_args = real_args;
     operands_stack.base_pointer = __gc_stack_top + 1;
-    __gc_stack_top -= (n_locals + 1);
-    memset((void *)__gc_stack_top, 0, (n_locals + 1) * sizeof(size_t));
+    __gc_stack_top -= n_locals;
+    memset((void *)(__gc_stack_top + 1), 0, n_locals * sizeof(size_t));
     return ExecResult{decode_next_ip};
   };
   inline ExecResult visit_closure(u8 *decode_next_ip, i32 addr, i32 n,
@@ -284,7 +317,7 @@ public:
     auto read_byte = [&args_begin]() { return *args_begin++; };
 
     debug(stderr, "CLOSURE\t0x%.8x", addr);
-    if constexpr (BytecodeChecks) {
+    if constexpr (Policy::bounds_checks) {
       if (addr < 0 || addr > (bf->code_end - bf->code_ptr)) {
         error("closure points outside of the code area");
       }
@@ -331,21 +364,27 @@ public:
     debug(stderr, "CALLC\t%d", n_arg);
     u32 closure = *(__gc_stack_top + 1 + n_arg);
     u32 addr = (u32)(((i32 *)closure)[0]);
-    operands_stack.push(u32(decode_next_ip));
     u8 *exec_next_ip = bf->code_ptr + addr;
+    if (is_tail_position(decode_next_ip)) {
+      return ExecResult{tail_call(n_arg + 1, true, exec_next_ip)};
+    }
+    operands_stack.push(u32(decode_next_ip));
     in_closure = true;
     return ExecResult{exec_next_ip};
   };
 
   inline ExecResult visit_call(u8 *decode_next_ip, i32 loc,
                                i32 n_arg) override {
-    if constexpr (BytecodeChecks) {
+    if constexpr (Policy::bounds_checks) {
       if (!check_is_begin(bf, bf->code_ptr + loc)) {
         error("CALL does not call a function\n");
       }
     }
-    operands_stack.push(u32(decode_next_ip));
     u8 *ip = bf->code_ptr + loc;
+    if (is_tail_position(decode_next_ip)) {
+      return ExecResult{tail_call(n_arg, false, ip)};
+    }
+    operands_stack.push(u32(decode_next_ip));
     return ExecResult{ip};
   };
   inline ExecResult visit_tag(u8 *decode_next_ip, char const *name,
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "bytefile.h"
+#include "lama-enums.h"
+#include "runtime-decl.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+// Features of the visitor interpreter (myInterpret in main.cpp). Each one is
+// a bit of the template argument of InterpreterPolicy and is compiled in or
+// out with `if constexpr`, so a build without a feature pays nothing for it.
+// main.cpp picks the instantiation for the features asked for at startup.
+enum Feature : u32 {
+  BOUNDS_CHECKS = 1,       // code addresses, globals and operand reads
+  STACK_CHECKS = 2,        // overflow and underflow on every push and pop
+  COUNT_OPCODES = 4,       // executions of every opcode, printed at the end
+  TRACE = 8,               // every executed instruction, to stderr
+  SAMPLE_ALLOCATIONS = 16, // allocation sites, one in ALLOCATION_PERIOD
+  GC_STRESS = 32,          // a collection before every allocation
+  ALL_FEATURES = 63,
+};
+
+static u32 constexpr RUNTIME_CHECKS = BOUNDS_CHECKS | STACK_CHECKS;
+
+template <u32 Features> struct InterpreterPolicy {
+  static bool constexpr bounds_checks = Features & BOUNDS_CHECKS;
+  static bool constexpr stack_checks = Features & STACK_CHECKS;
+  static bool constexpr count_opcodes = Features & COUNT_OPCODES;
+  static bool constexpr trace = Features & TRACE;
+  static bool constexpr sample_allocations = Features & SAMPLE_ALLOCATIONS;
+  static bool constexpr gc_stress = Features & GC_STRESS;
+};
+
+// Parses a comma-separated list of feature names, e.g. "count,trace".
+static inline u32 parse_features(char const *list) {
+  static struct {
+    char const *name;
+    Feature feature;
+  } const names[] = {
+      {"bounds", BOUNDS_CHECKS}, {"stack", STACK_CHECKS},
+      {"count", COUNT_OPCODES},  {"trace", TRACE},
+      {"alloc", SAMPLE_ALLOCATIONS}, {"gc-stress", GC_STRESS},
+  };
+  u32 features = 0;
+  while (*list != '\0') {
+    size_t length = strcspn(list, ",");
+    bool found = false;
+    for (auto const &n : names) {
+      if (strlen(n.name) == length && strncmp(n.name, list, length) == 0) {
+        features |= n.feature;
+        found = true;
+      }
+    }
+    if (!found) {
+      error("unknown interpreter feature %.*s", (int)length, list);
+    }
+    list += length + (list[length] == ',');
+  }
+  return features;
+}
+
+// Calls f with the InterpreterPolicy of `features`; every combination is
+// instantiated.
+template <u32 Features = 0, typename F>
+static inline void with_policy(u32 features, F &&f) {
+  if (features == Features) {
+    f(InterpreterPolicy<Features>{});
+  } else if constexpr (Features < ALL_FEATURES) {
+    with_policy<Features + 1>(features, f);
+  } else {
+    error("unsupported interpreter features %u", features);
+  }
+}
+
+// The instrumentation features of a policy, run by the interpreter loop
+// before every instruction so that the handlers stay free of them.
+template <typename Policy> class Instrumentation {
+public:
+  // one allocation in this many is sampled
+  static u64 constexpr ALLOCATION_PERIOD = 64;
+
+  explicit Instrumentation(bytefile const *bf) : bf(bf) {}
+
+  void before(u8 const *ip) {
+    u8 opcode = *ip;
+    if constexpr (Policy::count_opcodes) {
+      counts[opcode]++;
+    }
+    if constexpr (Policy::trace) {
+      fprintf(stderr, "0x%.8x\t%s\n", offset(ip), name(opcode));
+    }
+    if constexpr (Policy::sample_allocations || Policy::gc_stress) {
+      if (!allocates(opcode)) {
+        return;
+      }
+      // every value is on the operand stack between instructions
+      if constexpr (Policy::gc_stress) {
+        gc_alloc(0);
+      }
+      if constexpr (Policy::sample_allocations) {
+        if (++allocations % ALLOCATION_PERIOD == 0) {
+          samples[offset(ip)]++;
+        }
+      }
+    }
+  }
+
+  void report() const {
+    if constexpr (Policy::count_opcodes) {
+      std::vector<std::pair<u64, u8>> sorted;
+      u64 total = 0;
+      for (size_t op = 0; op < counts.size(); op++) {
+        if (counts[op] != 0) {
+          sorted.push_back({counts[op], (u8)op});
+          total += counts[op];
+        }
+      }
+      std::sort(sorted.rbegin(), sorted.rend());
+      fprintf(stderr, "%llu instructions executed\n",
+              (unsigned long long)total);
+      for (auto [count, op] : sorted) {
+        fprintf(stderr, "%12llu %6.2f%% %s\n", (unsigned long long)count,
+                count * 100.0 / total, name(op));
+      }
+    }
+    if constexpr (Policy::sample_allocations) {
+      std::vector<std::pair<u64, i32>> sorted;
+      for (auto [at, count] : samples) {
+        sorted.push_back({count, at});
+      }
+      std::sort(sorted.rbegin(), sorted.rend());
+      fprintf(stderr, "%llu allocations, sampled one in %llu\n",
+              (unsigned long long)allocations,
+              (unsigned long long)ALLOCATION_PERIOD);
+      for (auto [count, at] : sorted) {
+        fprintf(stderr, "%12llu 0x%.8x %s\n", (unsigned long long)count, at,
+                name(bf->code_ptr[at]));
+      }
+    }
+  }
+
+private:
+  bytefile const *bf;
+  std::array<u64, 256> counts{}; // by opcode byte
+  u64 allocations = 0;
+  std::map<i32, u64> samples; // by code offset
+
+  i32 offset(u8 const *ip) const { return (i32)(ip - bf->code_ptr); }
+
+  static bool allocates(u8 opcode) {
+    auto h = (HCode)(opcode >> 4);
+    u8 l = opcode & 0x0F;
+    return (h == HCode::MISC1 && (l == (u8)Misc1LCode::STR ||
+                                  l == (u8)Misc1LCode::SEXP)) ||
+           (h == HCode::MISC2 && l == (u8)Misc2LCode::CLOSURE) ||
+           (h == HCode::CALL &&
+            (l == (u8)Call::LSTRING || l == (u8)Call::BARRAY));
+  }
+
+  static char const *name(u8 opcode) {
+    static char const *const binops[] = {"BINOP +",  "BINOP -",  "BINOP *",
+                                         "BINOP /",  "BINOP %",  "BINOP <",
+                                         "BINOP <=", "BINOP >",  "BINOP >=",
+                                         "BINOP ==", "BINOP !=", "BINOP &&",
+                                         "BINOP !!"};
+    static char const *const misc1[] = {"CONST", "STRING", "SEXP", "STI",
+                                        "STA",   "JMP",    "END",  "RET",
+                                        "DROP",  "DUP",    "SWAP", "ELEM"};
+    static char const *const misc2[] = {
+        "CJMPz", "CJMPnz", "BEGIN", "CBEGIN", "CLOSURE", "CALLC",
+        "CALL",  "TAG",    "ARRAY", "FAIL",   "LINE",    "ELEM"};
+    static char const *const kinds[][4] = {{"LD G", "LD L", "LD A", "LD C"},
+                                           {"LDA G", "LDA L", "LDA A", "LDA C"},
+                                           {"ST G", "ST L", "ST A", "ST C"}};
+    static char const *const patts[] = {"PATT =str",  "PATT #string",
+                                        "PATT #array", "PATT #sexp",
+                                        "PATT #ref",  "PATT #val",
+                                        "PATT #fun"};
+    static char const *const calls[] = {"CALL Lread", "CALL Lwrite",
+                                        "CALL Llength", "CALL Lstring",
+                                        "CALL Barray"};
+    auto h = (HCode)(opcode >> 4);
+    u8 l = opcode & 0x0F;
+    switch (h) {
+    case HCode::BINOP:
+      return l >= 1 && l <= 13 ? binops[l - 1] : "?";
+    case HCode::MISC1:
+      return l < 12 ? misc1[l] : "?";
+    case HCode::LD:
+    case HCode::LDA:
+    case HCode::ST:
+      return l < 4 ? kinds[(u8)h - (u8)HCode::LD][l] : "?";
+    case HCode::MISC2:
+      return l < 12 ? misc2[l] : "?";
+    case HCode::PATT:
+      return l < 7 ? patts[l] : "?";
+    case HCode::CALL:
+      return l < 5 ? calls[l] : "?";
+    case HCode::STOP:
+      return "STOP";
+    default:
+      return "?";
+    }
+  }
+};
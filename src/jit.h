@@ -0,0 +1,475 @@
+#pragma once
+
+#include "lama-enums.h"
+#include "register-ir.h"
+#include "runtime-decl.h"
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Baseline JIT of the register IR into x86-32 machine code, see the `jit`
+// mode. Entries into a function (ENTER) and back edges are counted per IR
+// instruction; once a count reaches THRESHOLD the function around it is
+// compiled from a template per instruction, and the handlers of the compiled
+// instructions are redirected to native code.
+//
+// Native code keeps bp in esi and works on the frame slots directly, so the
+// interpreter and the native code share all state. Instructions without a
+// template (ENTER, RET, calls, and everything that allocates or pushes onto
+// the memory stack) stay interpreted: native code returns the instruction to
+// continue from, and the interpreter enters native code again as soon as it
+// reaches a compiled instruction. None of the templates reaches the GC.
+//
+// Every compiled function is added to /tmp/perf-<pid>.map, so perf can
+// attribute samples in the code region.
+class Jit {
+public:
+  static u32 constexpr THRESHOLD = 1000;
+  static size_t constexpr CODE_SIZE = 16 << 20;
+
+  i32 compiled = 0;
+  size_t *globals = nullptr; // set by the interpreter
+
+  explicit Jit(RegisterProgram &program)
+      : program(program), counters(program.code.size(), 0),
+        native_at(program.code.size(), nullptr) {
+    void *region = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+      error("jit: cannot map the code region");
+    }
+    code_begin = cursor = (u8 *)region;
+    emit_trampoline();
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf_map = fopen(path, "w");
+  }
+  ~Jit() {
+    munmap(code_begin, CODE_SIZE);
+    if (perf_map != nullptr) {
+      fclose(perf_map);
+    }
+  }
+
+  // Counts an entry into the function at `index` or a back edge to it and
+  // compiles the function when it gets hot, pointing the handlers of its
+  // compiled instructions at `jit_handler`.
+  void tick(RInsn const *insn, void const *jit_handler) {
+    size_t index = insn - program.code.data();
+    if (++counters[index] == THRESHOLD) {
+      compile(function_start(index), jit_handler);
+    }
+  }
+
+  // runs native code from `ip` up to the next interpreted instruction
+  RInsn *run(RInsn const *ip, size_t *bp) {
+    return trampoline(native_at[ip - program.code.data()], bp);
+  }
+
+private:
+  enum Reg : u8 { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+  RegisterProgram &program;
+  std::vector<u32> counters;      // per IR instruction
+  std::vector<u8 *> native_at;    // per IR instruction, nullptr if interpreted
+  std::vector<size_t> is_started; // function starts already compiled
+  u8 *code_begin = nullptr;
+  u8 *cursor = nullptr;
+  u8 *epilogue = nullptr;
+  RInsn *(*trampoline)(u8 const *, size_t *) = nullptr;
+  FILE *perf_map = nullptr;
+
+  // the function around an instruction starts at its ENTER
+  size_t function_start(size_t index) const {
+    while (index > 0 && program.code[index].op != ROp::ENTER) {
+      index--;
+    }
+    return index;
+  }
+
+  void byte(u8 b) { *cursor++ = b; }
+  void bytes(std::initializer_list<u8> bs) {
+    for (u8 b : bs) {
+      byte(b);
+    }
+  }
+  void word(u32 w) {
+    for (i32 i = 0; i < 4; i++) {
+      byte((u8)(w >> (8 * i)));
+    }
+  }
+  template <typename T> static u32 address(T *p) { return (u32)(size_t)p; }
+
+  // mov reg, [esi + 4 * slot]
+  void load(Reg reg, i32 slot) {
+    bytes({0x8B, (u8)(0x86 | reg << 3)});
+    word(4 * slot);
+  }
+  // mov [esi + 4 * slot], reg
+  void store(i32 slot, Reg reg) {
+    bytes({0x89, (u8)(0x86 | reg << 3)});
+    word(4 * slot);
+  }
+  // mov reg, imm32
+  void move_imm(Reg reg, u32 imm) {
+    byte(0xB8 + reg);
+    word(imm);
+  }
+  // mov [esp + 4 * k], eax, the k-th argument of a call
+  void set_arg(i32 k) { bytes({0x89, 0x44, 0x24, (u8)(4 * k)}); }
+  void set_arg_imm(i32 k, u32 imm) {
+    bytes({0xC7, 0x44, 0x24, (u8)(4 * k)});
+    word(imm);
+  }
+  // mov eax, function; call eax
+  void call(u32 function) {
+    move_imm(EAX, function);
+    bytes({0xFF, 0xD0});
+  }
+  void unbox_eax() { bytes({0xD1, 0xF8}); }
+  void unbox_ecx() { bytes({0xD1, 0xF9}); }
+  void box_eax() { bytes({0x8D, 0x44, 0x00, 0x01}); } // lea eax, [2eax+1]
+  // the position of a rel32 to patch
+  u8 *rel32() {
+    u8 *at = cursor;
+    word(0);
+    return at;
+  }
+  static void patch(u8 *at, u8 const *target) {
+    u32 rel = (u32)(target - (at + 4));
+    for (i32 i = 0; i < 4; i++) {
+      at[i] = (u8)(rel >> (8 * i));
+    }
+  }
+
+  // Calls from C come in through the trampoline, which saves the registers
+  // of the caller, keeps the stack 16-byte aligned with room for three
+  // arguments of runtime calls, loads bp into esi and jumps to native code.
+  // Native code leaves through the epilogue with the next instruction to
+  // interpret in eax.
+  void emit_trampoline() {
+    trampoline = (RInsn * (*)(u8 const *, size_t *)) cursor;
+    bytes({0x55, 0x53, 0x56, 0x57}); // push ebp, ebx, esi, edi
+    bytes({0x83, 0xEC, 0x1C});       // sub esp, 28
+    bytes({0x8B, 0x44, 0x24, 0x30}); // mov eax, [esp + 48]
+    bytes({0x8B, 0x74, 0x24, 0x34}); // mov esi, [esp + 52]
+    bytes({0xFF, 0xE0});             // jmp eax
+    epilogue = cursor;
+    bytes({0x83, 0xC4, 0x1C});       // add esp, 28
+    bytes({0x5F, 0x5E, 0x5B, 0x5D}); // pop edi, esi, ebx, ebp
+    byte(0xC3);
+  }
+
+  // eax <- eax op ecx on unboxed operands
+  void binop(BinopLabel label) {
+    switch (label) {
+    case BinopLabel::ADD:
+      bytes({0x01, 0xC8});
+      break;
+    case BinopLabel::SUB:
+      bytes({0x29, 0xC8});
+      break;
+    case BinopLabel::MUL:
+      bytes({0x0F, 0xAF, 0xC1});
+      break;
+    case BinopLabel::DIV:
+      bytes({0x99, 0xF7, 0xF9}); // cdq; idiv ecx
+      break;
+    case BinopLabel::MOD:
+      bytes({0x99, 0xF7, 0xF9, 0x89, 0xD0}); // ...; mov eax, edx
+      break;
+    case BinopLabel::AND:
+    case BinopLabel::OR:
+      bytes({0x85, 0xC0, 0x0F, 0x95, 0xC0}); // test eax, eax; setne al
+      bytes({0x85, 0xC9, 0x0F, 0x95, 0xC1}); // test ecx, ecx; setne cl
+      bytes({(u8)(label == BinopLabel::AND ? 0x20 : 0x08), 0xC8});
+      bytes({0x0F, 0xB6, 0xC0}); // movzx eax, al
+      break;
+    default: {
+      static u8 const setcc[] = {0x9C, 0x9E, 0x9F, 0x9D, 0x94, 0x95};
+      i32 k = (i32)label - (i32)BinopLabel::LT;
+      if (k < 0 || k >= 6) {
+        error("unsupported op label: %d", (i32)label);
+      }
+      bytes({0x39, 0xC8, 0x0F, setcc[k], 0xC0}); // cmp eax, ecx; setcc al
+      bytes({0x0F, 0xB6, 0xC0});
+    }
+    }
+  }
+
+  static u32 patt_function(Patt patt) {
+    switch (patt) {
+    case Patt::STR_TAG:
+      return address(&Bstring_tag_patt);
+    case Patt::ARR_TAG:
+      return address(&Barray_tag_patt);
+    case Patt::SEXPR_TAG:
+      return address(&Bsexp_tag_patt);
+    case Patt::BOXED:
+      return address(&Bboxed_patt);
+    case Patt::UNBOXED:
+      return address(&Bunboxed_patt);
+    case Patt::CLOS_TAG:
+      return address(&Bclosure_tag_patt);
+    default:
+      return 0;
+    }
+  }
+
+  bool has_template(RInsn const &insn) const {
+    switch (insn.op) {
+    case ROp::MOV:
+    case ROp::LDI:
+    case ROp::LDG:
+    case ROp::STG:
+    case ROp::LDC:
+    case ROp::STC:
+    case ROp::LEA_FRAME:
+    case ROp::LEA_GLOBAL:
+    case ROp::LEA_CAPT:
+    case ROp::JMP:
+    case ROp::CJMPZ:
+    case ROp::CJMPNZ:
+    case ROp::ELEM:
+    case ROp::ELEMI:
+    case ROp::TAG:
+    case ROp::ARRAY:
+    case ROp::PATT_STR:
+    case ROp::LLENGTH:
+    case ROp::SWAP:
+      return true;
+    case ROp::PATT:
+      return patt_function((Patt)insn.c) != 0;
+    // a bad label fails in the interpreter
+    case ROp::BINOP:
+    case ROp::BINOPI:
+      return (u32)insn.d.value < (u32)BinopLabel::BINOP_LAST;
+    case ROp::BR_BINOP_Z:
+    case ROp::BR_BINOP_NZ:
+    case ROp::BR_BINOPI_Z:
+    case ROp::BR_BINOPI_NZ:
+      return (u32)insn.c < (u32)BinopLabel::BINOP_LAST;
+    default:
+      return false;
+    }
+  }
+
+  // an upper bound of the size of a template, an exit or a jump
+  static size_t constexpr MAX_TEMPLATE = 64;
+
+  void compile(size_t start, void const *jit_handler) {
+    for (size_t s : is_started) {
+      if (s == start) {
+        return;
+      }
+    }
+    is_started.push_back(start);
+    size_t end = start + 1;
+    while (end < program.code.size() && program.code[end].op != ROp::ENTER) {
+      end++;
+    }
+    if ((size_t)(code_begin + CODE_SIZE - cursor) <
+        3 * MAX_TEMPLATE * (end - start)) {
+      return; // the code region is full
+    }
+    RInsn *code = program.code.data();
+    u8 *function_begin = cursor;
+    std::vector<std::pair<u8 *, size_t>> jumps; // rel32 -> IR index
+    auto jump_to = [&](size_t target) { jumps.push_back({rel32(), target}); };
+    for (size_t i = start; i < end; i++) {
+      RInsn const &insn = code[i];
+      if (!has_template(insn)) {
+        continue;
+      }
+      native_at[i] = cursor;
+      bool falls_through = emit_template(insn, [&](RInsn const *target) {
+        jump_to(target - code);
+      });
+      if (falls_through && (i + 1 >= end || !has_template(code[i + 1]))) {
+        byte(0xE9); // jmp to the exit of the next instruction
+        jump_to(i + 1);
+      }
+    }
+    // jumps to interpreted instructions go through an exit each
+    for (auto [at, target] : jumps) {
+      if (target < program.code.size() && native_at[target] != nullptr) {
+        patch(at, native_at[target]);
+        continue;
+      }
+      patch(at, cursor);
+      move_imm(EAX, address(code + target));
+      byte(0xE9);
+      patch(rel32(), epilogue);
+    }
+    for (size_t i = start; i < end; i++) {
+      if (native_at[i] != nullptr) {
+        code[i].handler = jit_handler;
+      }
+    }
+    if (perf_map != nullptr) {
+      fprintf(perf_map, "%x %x lama_jit_%zu\n", address(function_begin),
+              (u32)(cursor - function_begin), start);
+      fflush(perf_map);
+    }
+    compiled++;
+  }
+
+  // Emits the template of an instruction, calling `jump` right after the
+  // opcode of every jump to another instruction. Returns false if the
+  // instruction does not fall through.
+  template <typename J> bool emit_template(RInsn const &insn, J &&jump) {
+    i32 a = insn.a, b = insn.b, c = insn.c;
+    switch (insn.op) {
+    case ROp::MOV:
+      load(EAX, b);
+      store(a, EAX);
+      break;
+    case ROp::LDI:
+      bytes({0xC7, 0x86}); // mov [esi + 4a], imm32
+      word(4 * a);
+      word((u32)b);
+      break;
+    case ROp::LDG:
+      byte(0xA1); // mov eax, [globals + b]
+      word(address(globals + b));
+      store(a, EAX);
+      break;
+    case ROp::STG:
+      load(EAX, b);
+      byte(0xA3); // mov [globals + a], eax
+      word(address(globals + a));
+      break;
+    case ROp::LDC:
+      load(EAX, c);
+      bytes({0x8B, 0x80}); // mov eax, [eax + 4(1 + b)]
+      word(4 * (1 + b));
+      store(a, EAX);
+      break;
+    case ROp::STC:
+      load(EAX, c);
+      load(ECX, b);
+      bytes({0x89, 0x88}); // mov [eax + 4(1 + a)], ecx
+      word(4 * (1 + a));
+      break;
+    case ROp::LEA_FRAME:
+      bytes({0x8D, 0x86}); // lea eax, [esi + 4b]
+      word(4 * b);
+      store(a, EAX);
+      break;
+    case ROp::LEA_GLOBAL:
+      move_imm(EAX, address(globals + b));
+      store(a, EAX);
+      break;
+    case ROp::LEA_CAPT:
+      load(EAX, c);
+      byte(0x05); // add eax, 4(1 + b)
+      word(4 * (1 + b));
+      store(a, EAX);
+      break;
+    case ROp::BINOP:
+    case ROp::BINOPI:
+      load(EAX, b);
+      unbox_eax();
+      if (insn.op == ROp::BINOP) {
+        load(ECX, c);
+        unbox_ecx();
+      } else {
+        move_imm(ECX, (u32)c);
+      }
+      binop((BinopLabel)insn.d.value);
+      box_eax();
+      store(a, EAX);
+      break;
+    case ROp::JMP:
+      byte(0xE9);
+      jump(insn.d.target);
+      return false;
+    case ROp::CJMPZ:
+    case ROp::CJMPNZ:
+      load(EAX, b);
+      unbox_eax(); // sets ZF
+      bytes({0x0F, (u8)(insn.op == ROp::CJMPZ ? 0x84 : 0x85)});
+      jump(insn.d.target);
+      break;
+    case ROp::BR_BINOP_Z:
+    case ROp::BR_BINOP_NZ:
+    case ROp::BR_BINOPI_Z:
+    case ROp::BR_BINOPI_NZ: {
+      bool is_imm = insn.op == ROp::BR_BINOPI_Z || insn.op == ROp::BR_BINOPI_NZ;
+      bool is_z = insn.op == ROp::BR_BINOP_Z || insn.op == ROp::BR_BINOPI_Z;
+      load(EAX, a);
+      unbox_eax();
+      if (is_imm) {
+        move_imm(ECX, (u32)b);
+      } else {
+        load(ECX, b);
+        unbox_ecx();
+      }
+      binop((BinopLabel)c);
+      bytes({0x01, 0xC0}); // add eax, eax: ZF iff UNBOX(BOX(eax)) == 0
+      bytes({0x0F, (u8)(is_z ? 0x84 : 0x85)});
+      jump(insn.d.target);
+      break;
+    }
+    case ROp::ELEM:
+    case ROp::ELEMI:
+      load(EAX, b);
+      set_arg(0);
+      if (insn.op == ROp::ELEM) {
+        load(EAX, c);
+        set_arg(1);
+      } else {
+        set_arg_imm(1, (u32)c);
+      }
+      call(address(&Belem));
+      store(a, EAX);
+      break;
+    case ROp::TAG:
+      load(EAX, b);
+      set_arg(0);
+      set_arg_imm(1, (u32)insn.d.value);
+      set_arg_imm(2, (u32)BOX(c));
+      call(address(&Btag));
+      store(a, EAX);
+      break;
+    case ROp::ARRAY:
+      load(EAX, b);
+      set_arg(0);
+      set_arg_imm(1, (u32)BOX(c));
+      call(address(&Barray_patt));
+      store(a, EAX);
+      break;
+    case ROp::PATT:
+      load(EAX, b);
+      set_arg(0);
+      call(patt_function((Patt)c));
+      store(a, EAX);
+      break;
+    case ROp::PATT_STR:
+      load(EAX, b);
+      set_arg(0);
+      load(EAX, c);
+      set_arg(1);
+      call(address(&Bstring_patt));
+      store(a, EAX);
+      break;
+    case ROp::LLENGTH:
+      load(EAX, b);
+      set_arg(0);
+      call(address(&Llength));
+      store(a, EAX);
+      break;
+    case ROp::SWAP:
+      load(EAX, a + 1);
+      load(ECX, a + 2);
+      store(a + 1, ECX);
+      store(a + 2, EAX);
+      break;
+    default:
+      error("jit: no template for instruction %d", (i32)insn.op);
+    }
+    return true;
+  }
+};
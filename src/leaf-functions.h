@@ -0,0 +1,154 @@
+#pragma once
+
+#include "control-flow.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <vector>
+
+// Leaf functions run without a frame. A function is a leaf when it has no
+// locals, calls nothing, allocates nothing and takes no references, and is
+// entered only by CALL: the main function, closure bodies (CALLC enters
+// CBEGIN directly) and memoized functions are never leaves. Its BEGIN
+// becomes LEAF_BEGIN, which only checks the stack, its arguments are read
+// and written relative to the stack pointer at the depths found by
+// check_depth, and LEAF_END pops the arguments and the return address. bp
+// and n_args keep the values of the caller.
+//
+// Tail calls and CONSCALLs of a leaf become plain CALLs, as a leaf cannot
+// reuse a frame it does not have; the END after them returns as usual.
+// Runs on the predecoded program after memoization, before fusion and
+// quickening.
+class LeafFunctions {
+public:
+  // depth_at is the stack depth before every instruction, from check_depth
+  LeafFunctions(ControlFlowGraph const &cfg, PredecodedProgram &program,
+                std::vector<i32> const &depth_at)
+      : cfg(cfg), program(program), depth_at(depth_at) {}
+
+  // Returns the number of leaf functions.
+  i32 convert() {
+    auto const n = cfg.functions.size();
+    std::vector<bool> leaf(n, false);
+    std::vector<bool> is_closure_body(n, false);
+    for (auto const &insn : program.code) {
+      i32 offset = -1;
+      if (insn.op == Op::CLOSURE || insn.op == Op::CLOSURE_FRAME) {
+        offset = insn.a;
+      } else if (insn.op == Op::CALLC_DIRECT ||
+                 insn.op == Op::TAILCALLC_DIRECT) {
+        offset = program.offsets[insn.c.target - program.code.data()];
+      } else if (insn.op == Op::OBJECT &&
+                 TAG(TO_DATA(insn.c.object)->data_header) == CLOSURE_TAG) {
+        // a capture-free closure, preallocated by ConstantObjects
+        offset = ((i32 *)insn.c.object)[0];
+      }
+      if (offset >= 0 && cfg.function_at[offset] != ControlFlowGraph::NONE) {
+        is_closure_body[cfg.function_at[offset]] = true;
+      }
+    }
+    i32 leaves = 0;
+    for (size_t f = 0; f < n; f++) {
+      i32 begin = cfg.functions[f].begin;
+      Insn const *insn = program.insn_at[begin];
+      if (begin == 0 || is_closure_body[f] || insn->op != Op::BEGIN ||
+          insn->b != 0 || !has_leaf_body(f)) {
+        continue;
+      }
+      leaf[f] = true;
+      leaves++;
+      convert_function(f);
+    }
+    for (auto &insn : program.code) {
+      if ((insn.op == Op::TAILCALL || insn.op == Op::CONSCALL) &&
+          leaf[function_of(cfg, program, insn.c.target)]) {
+        insn.op = Op::CALL;
+      }
+    }
+    return leaves;
+  }
+
+private:
+  ControlFlowGraph const &cfg;
+  PredecodedProgram &program;
+  std::vector<i32> const &depth_at;
+
+  template <typename F> void for_each_insn(size_t f, F &&visit) const {
+    for (i32 b : cfg.functions[f].order) {
+      cfg.for_each_insn(b, [&](i32 offset) {
+        if (Insn *insn = program.insn_starting_at(offset)) {
+          visit(*insn, depth_at[offset]);
+        }
+      });
+    }
+  }
+
+  static bool is_leaf_insn(Insn const &insn) {
+    switch (insn.op) {
+    case Op::BINOP:
+    case Op::CONST:
+    case Op::STI:
+    case Op::STA:
+    case Op::JMP:
+    case Op::END:
+    case Op::DROP:
+    case Op::DUP:
+    case Op::SWAP:
+    case Op::ELEM:
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+    case Op::BEGIN:
+    case Op::TAG:
+    case Op::ARRAY:
+    case Op::FAILURE:
+    case Op::LINE:
+    case Op::PATT:
+    case Op::LREAD:
+    case Op::LWRITE:
+    case Op::LLENGTH:
+    case Op::STOP:
+    case Op::OBJECT:
+    case Op::DECISION:
+      return true;
+    case Op::LD:
+    case Op::ST:
+      return insn.a == GLOBAL || insn.a == ARG;
+    default:
+      return false;
+    }
+  }
+
+  bool has_leaf_body(size_t f) const {
+    bool result = true;
+    for_each_insn(f, [&](Insn const &insn, i32) {
+      result = result && is_leaf_insn(insn);
+    });
+    return result;
+  }
+
+  void convert_function(size_t f) {
+    i32 n_args = program.insn_at[cfg.functions[f].begin]->a;
+    for_each_insn(f, [&](Insn &insn, i32 depth) {
+      switch (insn.op) {
+      case Op::BEGIN:
+        insn.op = Op::LEAF_BEGIN;
+        break;
+      // above the operands are the return address and the arguments, the
+      // last one first
+      case Op::LD:
+      case Op::ST:
+        if (insn.a == ARG) {
+          insn.b = depth + 1 + n_args - insn.b;
+          insn.op = insn.op == Op::LD ? Op::LD_ARG_SP : Op::ST_ARG_SP;
+        }
+        break;
+      case Op::END:
+        insn.op = Op::LEAF_END;
+        insn.a = n_args;
+        insn.b = depth;
+        break;
+      default:
+        break;
+      }
+    });
+  }
+};
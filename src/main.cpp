@@ -1,26 +1,46 @@
 #include "bytefile.h"
+#include "bytecode-optimizer.h"
+#include "c-translator.h"
+#include "closure-flow.h"
+#include "constant-objects.h"
+#include "control-flow.h"
+#include "decision-trees.h"
 #include "diagnostic-visitor.h"
+#include "escape-analysis.h"
 #include "executing-visitor.h"
+#include "interpreter-policy.h"
+#include "jit.h"
 #include "lama-enums.h"
+#include "leaf-functions.h"
+#include "memoization.h"
+#include "predecoding-visitor.h"
+#include "quickening.h"
+#include "register-interpreter.h"
+#include "register-ir.h"
+#include "ssa-tier.h"
+#include "superinstructions.h"
+#include "threaded-interpreter.h"
+#include "type-inference.h"
 #include "visitor.h"
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
-#include <cstdarg>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <malloc.h>
+#include <memory>
 #include <stdio.h>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 using u32 = uint32_t;
 using i32 = int32_t;
 using u8 = std::uint8_t;
 
-#define BOXED(x) (((u32)(x)) & 0x0001)
-
 /* Gets a string from a string table by an index */
 static inline char const *get_string(bytefile const *f, int pos) {
   // validate its is an ok string
@@ -33,550 +53,67 @@ static inline char const *get_string(bytefile const *f, int pos) {
   return ptr;
 }
 
-/* Gets an offset for a publie symbol */
-static inline int get_public_offset(bytefile const *f, int i) {
-  if (!(i < f->public_symbols_number)) {
-    fprintf(stderr, "Trying to read out of bounds public member at %d", i);
-    exit(-1);
-  }
-  auto offset = f->public_ptr[i * 2 + 1];
-  if (offset >= f->code_end - f->code_ptr) {
-    error("public symbol at index %d points outside code area\n", i);
-  }
-  return f->public_ptr[i * 2 + 1];
-}
-
-static inline void print_location(bytefile const *bf, u8 *next_ip) {
-  fprintf(stderr, "at 0x%.8x:\n", unsigned((next_ip - 4) - bf->code_ptr - 1));
-}
-
-static inline void located_error(bytefile const *bf, u8 *next_ip,
-                                 const char *format, ...) {
-  fprintf(stderr, "error\n");
-  print_location(bf, next_ip);
-  va_list argptr;
-  va_start(argptr, format);
-  vfprintf(stderr, format, argptr);
-  fprintf(stderr, "\n");
-  exit(-1);
-  va_end(argptr);
-}
-
-// by convention if no jump might be possible, it is in next_ip
-// if jump is possible, it is in alternative_next_ip
-struct InstructionResult {
-  u8 *next_ip; // always not null, needed for proper traversing the program
-  bool is_next_child;
-  u8 *jump_ip;
-  std::string decoded;
-  bool is_end; // END or RET
-};
-
-static inline InstructionResult run_instruction(u8 *ip, bytefile const *bf,
-                                                bool print_inst) {
-#define FAIL                                                                   \
-  {                                                                            \
-    printf("ERROR: invalid opcode %d-%d\n", h, l);                             \
-    exit(0);                                                                   \
-  }
-
-  auto read_int = [&ip, &bf]() {
-    check_address(bf, ip);
-    ip += sizeof(int);
-    return *(int *)(ip - sizeof(int));
-  };
-
-  auto read_byte = [&ip, &bf]() {
-    check_address(bf, ip);
-    return *ip++;
-  };
-
-  auto read_string = [&read_int, &ip, &bf]() {
-    check_address(bf, ip);
-    return get_string(bf, read_int());
-  };
-
-  static char const *const ops[] = {
-      "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
-  static char const *const pats[] = {"=str", "#string", "#array", "#sexp",
-                                     "#ref", "#val",    "#fun"};
-  static char const *const lds[] = {"LD", "LDA", "ST"};
-  // bool in_closure = false;
-  auto check_is_begin = [](bytefile const *bf, u8 *ip) {
-    if (!check_address(bf, ip)) {
-      return false;
-    }
-    u8 x = *ip;
-    u8 h = (x & 0xF0) >> 4, l = x & 0x0F;
-    return h == 5 && (l == 3 || l == 2);
-  };
-  char buff[100];
-  int offset = 0;
-
-  if (ip >= bf->code_end) {
-    error("execution unexpectedly got out of code section\n");
-  }
-  u8 x = read_byte(), h = (x & 0xF0) >> 4, l = x & 0x0F;
-  switch ((HCode)h) {
-  case HCode::STOP: {
-    debug(stderr, "<end>\n");
-    return InstructionResult{ip, false, nullptr, "<end>", true};
-  }
-
-  case HCode::BINOP: {
-    offset += sprintf(buff + offset, "BINOP\t%s", ops[l - 1]);
-    if (l - 1 < (i32)BinopLabel::BINOP_LAST) {
-    } else {
-      FAIL;
-    }
-    break;
-  }
-
-  case HCode::MISC1: {
-    switch ((Misc1LCode)l) {
-    case Misc1LCode::CONST: {
-      auto arg = read_int();
-      offset += sprintf(buff + offset, "CONST\t%d", arg);
-      break;
-    }
-
-    case Misc1LCode::STR: {
-      char const *string = read_string();
-      offset += sprintf(buff + offset, "STRING\t%s", string);
-      break;
-    }
-
-    case Misc1LCode::SEXP: {
-      char const *tag = read_string();
-      int n = read_int();
-      offset += sprintf(buff + offset, "SEXP\t%s ", tag);
-      offset += sprintf(buff + offset, "%d", n);
-      break;
-    }
-
-    case Misc1LCode::STI: {
-      offset += sprintf(buff + offset, "STI");
-      break;
-    }
-
-    case Misc1LCode::STA: {
-      offset += sprintf(buff + offset, "STA");
-      break;
-    }
-
-    case Misc1LCode::JMP: {
-      auto jump_location = read_int();
-      offset += sprintf(buff + offset, "JMP\t0x%.8x", jump_location);
-      u8 *jump_ip = bf->code_ptr + jump_location;
-      if (!check_address(bf, jump_ip)) {
-        print_location(bf, ip);
-        fprintf(stderr, "trying to jump out of the code area to offset %d",
-                jump_ip - bf->code_ptr);
-      }
-      return InstructionResult{ip, false, jump_ip, std::string{buff}, false};
-      break;
-    }
-
-    case Misc1LCode::END:
-    case Misc1LCode::RET: {
-      if (h == 7) {
-        offset += sprintf(buff + offset, "RET");
-      } else {
-        offset += sprintf(buff + offset, "END");
-      }
-      return InstructionResult{
-          ip, false, nullptr, std::string{buff}, true,
-      };
-      break;
-    }
-
-    case Misc1LCode::DROP: {
-      offset += sprintf(buff + offset, "DROP");
-      break;
-    }
-
-    case Misc1LCode::DUP: {
-      offset += sprintf(buff + offset, "DUP");
-      break;
-    }
-
-    case Misc1LCode::SWAP: {
-      offset += sprintf(buff + offset, "SWAP");
-      break;
-    }
-
-    case Misc1LCode::ELEM: {
-      offset += sprintf(buff + offset, "ELEM");
-      break;
-    }
-
-    default:
-      FAIL;
-    }
-    break;
-  }
-  case HCode::LD:
-  case HCode::LDA:
-  case HCode::ST: {
-    offset += sprintf(buff + offset, "%s\t", lds[h - 2]);
-    i32 const index = read_int();
-    switch (l) {
-    case 0:
-      offset += sprintf(buff + offset, "G(%d)", index);
-      break;
-    case 1:
-      offset += sprintf(buff + offset, "L(%d)", index);
-      break;
-    case 2:
-      offset += sprintf(buff + offset, "A(%d)", index);
-      break;
-    case 3:
-      offset += sprintf(buff + offset, "C(%d)", index);
-      break;
-    default:
-      FAIL;
-    }
-    break;
+// Checks the stack depth of every reachable instruction: a block is entered
+// with the same depth from all of its predecessors, and no instruction pops
+// more than its function pushed. The maximal depth of each function is
+// stored in the upper half of its BEGIN argument count. depth_at, if given,
+// receives the depth before every reachable instruction (indexed by code
+// offset, -1 for unreachable code).
+template <bool Check = true>
+void check_depth(bytefile *bf, ControlFlowGraph const &cfg,
+                 std::vector<i32> *depth_at = nullptr) {
+  if (depth_at != nullptr) {
+    depth_at->assign(bf->code_end - bf->code_ptr, -1);
   }
-
-  case HCode::MISC2: {
-    switch ((Misc2LCode)l) {
-    case Misc2LCode::CJMPZ: {
-      auto jump_location = read_int();
-      offset += sprintf(buff + offset, "CJMPz\t0x%.8x", jump_location);
-      auto possible_next = ip;
-
-      u8 *jump_ip = bf->code_ptr + jump_location;
-      if (!check_address(bf, jump_ip)) {
-        print_location(bf, ip);
-        fprintf(stderr, "trying to jump out of the code area to offset %d",
-                jump_ip - bf->code_ptr);
-      }
-      auto result = InstructionResult{possible_next, true, jump_ip,
-                                      std::string{buff}, false};
-      return result;
-      break;
-    }
-
-    case Misc2LCode::CJMPNZ: {
-      auto jump_location = read_int();
-      offset += sprintf(buff + offset, "CJMPz\t0x%.8x", jump_location);
-      u8 *jump_ip = bf->code_ptr + jump_location;
-      if (!check_address(bf, jump_ip)) {
-        print_location(bf, ip);
-        fprintf(stderr, "trying to jump out of the code area to offset %d",
-                jump_ip - bf->code_ptr);
-      }
-      auto result =
-          InstructionResult{ip, true, jump_ip, std::string{buff}, false};
-      return result;
-      break;
-    }
-
-    case Misc2LCode::BEGIN:
-    case Misc2LCode::CBEGIN: {
-      int n_args = read_int();
-      int n_locals = read_int();
-      if (l == 3) {
-        offset += sprintf(buff + offset, "C");
-      }
-      offset += sprintf(buff + offset, "BEGIN\t%d ", n_args);
-      offset += sprintf(buff + offset, "%d", n_locals);
-      break;
-    }
-
-    case Misc2LCode::CLOSURE: {
-      int addr = read_int();
-      offset += sprintf(buff + offset, "CLOSURE\t0x%.8x", addr);
-
-      if (addr < 0 || addr > (bf->code_end - bf->code_ptr)) {
-        located_error(bf, ip, "closure points outside of the code area\n");
-      }
-      if (!check_is_begin(bf, bf->code_ptr + addr)) {
-        located_error(bf, ip, "closure does not point at begin\n");
-      }
-      int n = read_int();
-      for (int i = 0; i < n; i++) {
-        switch (read_byte()) {
-        case 0: {
-          int index = read_int();
-          offset += sprintf(buff + offset, "G(%d)", index);
-          break;
-        }
-        case 1: {
-          int index = read_int();
-          offset += sprintf(buff + offset, "L(%d)", index);
-          break;
+  auto depth_visitor = DiagnosticVisitor{bf};
+  std::vector<i32> entry_depth(cfg.blocks.size(), -1);
+  for (auto const &function : cfg.functions) {
+    i32 max_depth = 0;
+    entry_depth[function.order[0]] = 0;
+    // every block but the entry has a predecessor earlier in reverse postorder
+    for (i32 b : function.order) {
+      i32 depth = entry_depth[b];
+      cfg.for_each_insn(b, [&](i32 offset) {
+        u8 *ip = bf->code_ptr + offset;
+        auto const [decode_next_ip, diagnostic_info] =
+            visit_instruction<DiagnosticInformation, Check>(bf, ip,
+                                                            depth_visitor);
+        if (diagnostic_info.required_depth > depth) {
+          error("stack underflow 0x%x", offset);
         }
-        case 2: {
-          int index = read_int();
-          offset += sprintf(buff + offset, "A(%d)", index);
-          break;
+        if (depth_at != nullptr) {
+          (*depth_at)[offset] = depth;
         }
-        case 3: {
-          int index = read_int();
-          offset += sprintf(buff + offset, "C(%d)", index);
-          break;
+        depth += diagnostic_info.depth_change;
+        max_depth = std::max(max_depth, depth);
+      });
+      for (i32 s : cfg.blocks[b].succs) {
+        if (s == ControlFlowGraph::NONE) {
+          continue;
         }
-        default:
-          FAIL;
+        if (entry_depth[s] == -1) {
+          entry_depth[s] = depth;
+        } else if (entry_depth[s] != depth) {
+          error("stack depth mismatch at %x", cfg.blocks[s].begin);
         }
       }
-      break;
-    };
-
-    case Misc2LCode::CALLC: {
-      int n_arg = read_int();
-      offset += sprintf(buff + offset, "CALLC\t%d", n_arg);
-      break;
-    }
-
-    case Misc2LCode::CALL: {
-      int loc = read_int();
-      int n = read_int();
-      offset += sprintf(buff + offset, "CALL\t0x%.8x ", loc);
-      offset += sprintf(buff + offset, "%d", n);
-      auto called_function_begin = bf->code_ptr + loc;
-      if (!check_is_begin(bf, called_function_begin)) {
-        located_error(bf, ip, "CALL does not call a function\n");
-      }
-      return InstructionResult{
-          ip, true, called_function_begin, std::string{buff}, false,
-      };
-      break;
-    }
-
-    case Misc2LCode::TAG: {
-      const char *name = read_string();
-      int n = read_int();
-      offset += sprintf(buff + offset, "TAG\t%s ", name);
-      offset += sprintf(buff + offset, "%d", n);
-      break;
-    }
-
-    case Misc2LCode::ARRAY: {
-      int size = read_int();
-      offset += sprintf(buff + offset, "ARRAY\t%d", size);
-      break;
     }
-
-    case Misc2LCode::FAILURE: {
-      offset += sprintf(buff + offset, "FAIL\t%d", read_int());
-      offset += sprintf(buff + offset, "%d", read_int());
-      return InstructionResult{ip, false, nullptr, std::string{buff}, true};
-      break;
-    }
-
-    case Misc2LCode::LINE: {
-      int line = read_int();
-      offset += sprintf(buff + offset, "LINE\t%d", line);
-      break;
-    }
-
-    default:
-      FAIL;
-    }
-    break;
-  }
-  case HCode::PATT: {
-    offset += sprintf(buff + offset, "PATT\t%s", pats[l]);
-    if (l == 0) { // =str
-    } else if (l < (i32)Patt::LAST) {
-    } else {
-      fprintf(stderr, "Unsupported patt specializer: %d", l);
-      FAIL;
-    }
-    break;
-  }
-  case HCode::CALL: {
-    switch ((Call)l) {
-    case Call::READ: {
-      offset += sprintf(buff + offset, "CALL\tLread");
-      break;
-    }
-
-    case Call::WRITE: {
-      offset += sprintf(buff + offset, "CALL\tLwrite");
-      break;
-    }
-    case Call::LLENGTH: {
-      offset += sprintf(buff + offset, "CALL\tLlength");
-      break;
-    }
-
-    case Call::LSTRING: {
-      offset += sprintf(buff + offset, "CALL\tLstring");
-      break;
-    }
-
-    case Call::BARRAY: {
-      i32 n = read_int();
-      offset += sprintf(buff + offset, "CALL\tBarray\t%d", n);
-      break;
-    }
-
-    default:
-      FAIL;
-    }
-  } break;
-
-  default:
-    FAIL;
-  }
-  std::string decoded{buff};
-  if (print_inst) {
-    fprintf(stderr, "%s; next=%x\n", decoded.c_str(), ip - bf->code_ptr);
-  }
-  return InstructionResult{ip, true, nullptr, decoded, false};
-}
-
-void gather_incoming_cf(bytefile const *bf, std::unordered_set<u8 *> &result) {
-  std::vector<u8 *> instruction_stack;
-  std::vector<bool> visited(bf->code_end - bf->code_ptr, false);
-  auto push_if_not_visited = [&visited, &instruction_stack,
-                              &bf](u8 *possible_ip) {
-    auto offset = possible_ip - bf->code_ptr;
-    if (!visited[offset]) {
-      instruction_stack.push_back(possible_ip);
-      visited[offset] = true;
-    }
-  };
-
-  for (i32 i = 0; i < bf->public_symbols_number; i++) {
-    u8 *public_symbol_entry_ip = bf->code_ptr + get_public_offset(bf, i);
-    push_if_not_visited(public_symbol_entry_ip);
-  }
-
-  while (!instruction_stack.empty()) {
-    u8 *ip = instruction_stack.back();
-    instruction_stack.pop_back();
-    auto const decoded = run_instruction(ip, bf, false);
-    if (decoded.jump_ip != nullptr) {
-      push_if_not_visited(decoded.jump_ip);
-    }
-    if (decoded.is_next_child && !decoded.is_end) {
-      push_if_not_visited(decoded.next_ip);
-    }
-    if (decoded.jump_ip != nullptr) {
-      result.insert(decoded.jump_ip);
-    }
-  }
-}
-
-struct DepthTracker {
-  u8 *ip;
-  u8 *function_begin;
-  i32 current_depth = 0;
-  i32 max_depth = 0;
-};
-
-template <bool Check = true>
-void check_depth(bytefile *bf, std::unordered_set<u8 *> const &incoming_cf) {
-  std::vector<DepthTracker> instruction_stack;
-  for (i32 i = 0; i < bf->public_symbols_number; i++) {
-    u8 *public_symbol_entry_ip = bf->code_ptr + get_public_offset(bf, i);
-    instruction_stack.push_back(
-        DepthTracker{public_symbol_entry_ip, public_symbol_entry_ip});
-  }
-
-  std::unordered_map<u8 *, i32> registered_depth;
-  auto register_depth = [&registered_depth, &bf](u8 *ip, i32 depth) {
-    if (registered_depth.count(ip) > 0) {
-      auto prev_depth = registered_depth[ip];
-      if (prev_depth != depth) {
-        error("stack depth mismatch at %x", ip - bf->code_ptr);
-      }
-    } else {
-      registered_depth[ip] = depth;
-    }
-  };
-
-  auto depth_visitor = DiagnosticVisitor{bf};
-  std::unordered_set<u8 *> visited; // for backward reaches
-  std::unordered_map<u8 *, i32> max_stack;
-  while (!instruction_stack.empty()) {
-    auto next = instruction_stack.back();
-    auto inst = run_instruction(next.ip, bf, false);
-    instruction_stack.pop_back();
-    auto const [decode_next_ip, diagnostic_info] =
-        visit_instruction<DiagnosticInformation, Check>(bf, next.ip,
-                                                        depth_visitor);
-    if (diagnostic_info.required_depth > next.current_depth) {
-      error("stack underflow 0x%x", next.ip - bf->code_ptr);
-    }
-    auto new_depth = next.current_depth + diagnostic_info.depth_change;
-    if (new_depth < 0) {
-      error("error: negative depth stack on the abstract executing at:\n%x",
-            next.ip - bf->code_ptr);
-    }
-    if (incoming_cf.count(next.ip)) {
-      register_depth(next.ip, next.current_depth);
-    }
-    switch (diagnostic_info.kind) {
-    case InstructionKind::CALL: {
-      auto jump_ip = bf->code_ptr + diagnostic_info.jump_address.value();
-      if (visited.count(jump_ip) == 0) {
-        visited.insert(jump_ip);
-        instruction_stack.push_back(DepthTracker{jump_ip, jump_ip, 0, 0});
-      }
-      instruction_stack.push_back(
-          DepthTracker{decode_next_ip, next.function_begin, new_depth,
-                       std::max(next.max_depth, new_depth)});
-      break;
-    }
-    case InstructionKind::JMP: {
-      u8 *jump_ip = bf->code_ptr + diagnostic_info.jump_address.value();
-      if (visited.count(jump_ip) == 0) {
-        visited.insert(jump_ip);
-        instruction_stack.push_back(
-            DepthTracker{jump_ip, next.function_begin, new_depth,
-                         std::max(next.max_depth, new_depth)});
-      }
-      register_depth(jump_ip, new_depth);
-      break;
-    }
-    case InstructionKind::CJMP: {
-      u8 *jump_ip = bf->code_ptr + diagnostic_info.jump_address.value();
-      if (visited.count(jump_ip) == 0) {
-        visited.insert(jump_ip);
-        instruction_stack.push_back(
-            DepthTracker{jump_ip, next.function_begin, new_depth,
-                         std::max(next.max_depth, new_depth)});
-      }
-      register_depth(jump_ip, new_depth);
-
-      instruction_stack.push_back(
-          DepthTracker{decode_next_ip, next.function_begin, new_depth,
-                       std::max(next.max_depth, new_depth)});
-      break;
-    }
-    case InstructionKind::END: {
-      max_stack[next.function_begin] =
-          std::max(max_stack[next.function_begin], next.max_depth);
-      break;
-    }
-    case InstructionKind::OTHER: {
-      instruction_stack.push_back(
-          DepthTracker{decode_next_ip, next.function_begin, new_depth,
-                       std::max(next.max_depth, new_depth)});
-      break;
-    }
-    case InstructionKind::FAIL_KIND: {
-      break; // abort the execution here
-    }
-    }
-  }
-  for (auto [instr_begin, stacksize] : max_stack) {
-    *(int *)(instr_begin + 1) = *(int *)(instr_begin + 1) + (stacksize << 16);
+    *(int *)(bf->code_ptr + function.begin + 1) += max_depth << 16;
   }
 }
 
-template <bool Checks> static inline void myInterpret(bytefile const *bf) {
-  auto interpeter = CheckingExecutingVisitor<Checks>{bf};
+// Policy is an InterpreterPolicy, see interpreter-policy.h
+template <typename Policy>
+static inline void myInterpret(bytefile const *bf) {
+  auto interpeter = CheckingExecutingVisitor<Policy>{bf};
+  Instrumentation<Policy> instrumentation{bf};
   auto ip = bf->code_ptr;
   while (true) {
+    instrumentation.before(ip);
     auto result =
-        visit_instruction<ExecResult, Checks>(bf, ip, interpeter).value;
+        visit_instruction<ExecResult, Policy::bounds_checks>(bf, ip,
+                                                             interpeter)
+            .value;
     if (result.exec_next_ip == nullptr) {
       break;
       exit(-1);
@@ -584,6 +121,7 @@ template <bool Checks> static inline void myInterpret(bytefile const *bf) {
       ip = result.exec_next_ip;
     }
   }
+  instrumentation.report();
 }
 
 void run_with_runtime_checks(bytefile *bf, bool print_perf = false) {
@@ -592,7 +130,7 @@ void run_with_runtime_checks(bytefile *bf, bool print_perf = false) {
   using std::chrono::high_resolution_clock;
   using std::chrono::milliseconds;
   auto before = high_resolution_clock::now();
-  myInterpret<true>(bf);
+  myInterpret<InterpreterPolicy<RUNTIME_CHECKS>>(bf);
   auto after = high_resolution_clock::now();
   if (print_perf) {
     auto exec_duration = duration_cast<milliseconds>(after - before);
@@ -601,6 +139,24 @@ void run_with_runtime_checks(bytefile *bf, bool print_perf = false) {
   }
 }
 
+// verifies the program and runs the visitor interpreter built with the
+// features in `list`, see interpreter-policy.h
+void run_instrumented(bytefile *bf, char const *list) {
+  using std::chrono::duration_cast;
+  using std::chrono::high_resolution_clock;
+  using std::chrono::milliseconds;
+  ControlFlowGraph cfg{bf};
+  check_depth(bf, cfg);
+  auto before = high_resolution_clock::now();
+  with_policy(parse_features(list), [bf](auto policy) {
+    myInterpret<decltype(policy)>(bf);
+  });
+  auto exec_duration =
+      duration_cast<milliseconds>(high_resolution_clock::now() - before);
+  fprintf(stderr, "instrumented execution took %fs\n",
+          exec_duration.count() * 1.0 / 1000);
+}
+
 void run_with_verifier_checks(bytefile *bf, bool print_perf = false) {
   using std::chrono::duration;
   using std::chrono::duration_cast;
@@ -608,11 +164,10 @@ void run_with_verifier_checks(bytefile *bf, bool print_perf = false) {
   using std::chrono::milliseconds;
 
   auto before = high_resolution_clock::now();
-  std::unordered_set<u8 *> bytecodes_with_incoming_cf;
-  gather_incoming_cf(bf, bytecodes_with_incoming_cf);
-  check_depth(bf, bytecodes_with_incoming_cf);
+  ControlFlowGraph cfg{bf};
+  check_depth(bf, cfg);
   auto after_verification = high_resolution_clock::now();
-  myInterpret<false>(bf);
+  myInterpret<InterpreterPolicy<0>>(bf);
   auto after_execution = high_resolution_clock::now();
   auto check_duration =
       duration_cast<milliseconds>(after_verification - before);
@@ -625,6 +180,216 @@ void run_with_verifier_checks(bytefile *bf, bool print_perf = false) {
           exec_duration.count() * 1.0 / 1000);
 }
 
+// fusion_profile selects the superinstructions, the default set is used
+// without it
+// memo_budget is the size of the memoization table in bytes, 0 disables it
+void run_threaded(bytefile *bf, bool print_perf = false,
+                  char const *fusion_profile = nullptr,
+                  size_t memo_budget = 0) {
+  using std::chrono::duration;
+  using std::chrono::duration_cast;
+  using std::chrono::high_resolution_clock;
+  using std::chrono::milliseconds;
+
+  auto before = high_resolution_clock::now();
+  ControlFlowGraph cfg{bf};
+  std::vector<i32> depth_at;
+  check_depth(bf, cfg, &depth_at);
+  auto after_verification = high_resolution_clock::now();
+  PredecodedProgram program;
+  predecode(bf, program);
+  i32 devirtualized = ClosureFlow{cfg, program}.devirtualize();
+  auto types = TypeInference{cfg, program}.infer();
+  i32 in_frame = EscapeAnalysis{cfg, program}.run();
+  i32 decisions = build_decision_trees(program);
+  i32 constants = ConstantObjects{program}.preallocate();
+  i32 memoized = 0;
+  std::unique_ptr<MemoTable> memo;
+  if (memo_budget > 0) {
+    memo = std::make_unique<MemoTable>(memo_budget);
+    program.memo = memo.get();
+    memoized = PurityAnalysis{cfg, program}.memoize();
+  }
+  i32 leaves = LeafFunctions{cfg, program, depth_at}.convert();
+  FusionSet fusion_set = default_fusion_set();
+  if (fusion_profile != nullptr) {
+    SequenceProfile profile;
+    if (!read_profile(profile, fusion_profile)) {
+      error("cannot read profile %s", fusion_profile);
+    }
+    fusion_set = fusion_set_from_profile(profile, print_perf);
+  }
+  i32 fused = fuse(program, fusion_set);
+  i32 quickened = quicken(program, &types);
+  auto after_predecoding = high_resolution_clock::now();
+  threaded_interpret<false>(program);
+  auto after_execution = high_resolution_clock::now();
+  if (print_perf) {
+    auto check_duration =
+        duration_cast<milliseconds>(after_verification - before);
+    auto predecode_duration =
+        duration_cast<milliseconds>(after_predecoding - after_verification);
+    auto exec_duration =
+        duration_cast<milliseconds>(after_execution - after_predecoding);
+    fprintf(stderr, "verification took %fs\n",
+            check_duration.count() * 1.0 / 1000);
+    fprintf(stderr,
+            "predecoding took %fs (%d superinstructions, %d quickened, %d "
+            "constant objects, %d objects in frames, %d decision nodes, %d "
+            "direct closure calls, %d leaf functions)\n",
+            predecode_duration.count() * 1.0 / 1000, fused, quickened,
+            constants, in_frame, decisions, devirtualized, leaves);
+    if (memo != nullptr) {
+      fprintf(stderr, "memoized %d functions: %d hits, %d misses\n",
+              memoized, memo->hits, memo->misses);
+    }
+    fprintf(stderr, "threaded execution took %fs\n",
+            exec_duration.count() * 1.0 / 1000);
+  }
+}
+
+// runs the unfused program and dumps executed opcode sequences for the
+// superinstruction selection, and block and branch counts for the layout of
+// the optimizer
+void run_profiling(bytefile *bf, char const *profile_path) {
+  ControlFlowGraph cfg{bf};
+  check_depth(bf, cfg);
+  PredecodedProgram program;
+  predecode(bf, program);
+  SequenceProfile profile;
+  profile.track_blocks(program);
+  threaded_interpret<false, true>(program, &profile);
+  profile.finish_blocks();
+  if (!write_profile(profile, profile_path)) {
+    error("cannot write profile %s", profile_path);
+  }
+  fusion_set_from_profile(profile, true);
+}
+
+// translates the program into the register IR and runs it, compiling hot
+// functions to native code with use_jit
+void run_register(bytefile *bf, bool print_perf = false,
+                  bool use_jit = false) {
+  using std::chrono::duration;
+  using std::chrono::duration_cast;
+  using std::chrono::high_resolution_clock;
+  using std::chrono::milliseconds;
+
+  auto before = high_resolution_clock::now();
+  ControlFlowGraph cfg{bf};
+  std::vector<i32> depth_at;
+  check_depth(bf, cfg, &depth_at);
+  auto after_verification = high_resolution_clock::now();
+  PredecodedProgram program;
+  predecode(bf, program);
+  ConstantObjects{program}.preallocate();
+  RegisterProgram register_program;
+  SsaTier tier{cfg, program, depth_at};
+  RegisterTranslator{program, depth_at, register_program, &tier}.translate();
+  auto after_translation = high_resolution_clock::now();
+  std::unique_ptr<Jit> jit;
+  if (use_jit) {
+    jit = std::make_unique<Jit>(register_program);
+    register_interpret<false, true>(register_program, jit.get());
+  } else {
+    register_interpret<false>(register_program);
+  }
+  auto after_execution = high_resolution_clock::now();
+  if (print_perf) {
+    auto check_duration =
+        duration_cast<milliseconds>(after_verification - before);
+    auto translate_duration =
+        duration_cast<milliseconds>(after_translation - after_verification);
+    auto exec_duration =
+        duration_cast<milliseconds>(after_execution - after_translation);
+    fprintf(stderr, "verification took %fs\n",
+            check_duration.count() * 1.0 / 1000);
+    fprintf(stderr, "register translation took %fs (%zu instructions)\n",
+            translate_duration.count() * 1.0 / 1000,
+            register_program.code.size());
+    fprintf(stderr,
+            "ssa tier: %d functions, %d values numbered, %d hoisted\n",
+            tier.functions, tier.numbered, tier.hoisted);
+    if (use_jit) {
+      fprintf(stderr, "jit: %d functions compiled\n", jit->compiled);
+    }
+    fprintf(stderr, "register execution took %fs\n",
+            exec_duration.count() * 1.0 / 1000);
+  }
+}
+
+// verifies the program and writes it to out_path as C, see c-translator.h
+void run_aot(bytefile *bf, char const *out_path) {
+  ControlFlowGraph cfg{bf};
+  std::vector<i32> depth_at;
+  check_depth(bf, cfg, &depth_at);
+  PredecodedProgram program;
+  predecode(bf, program);
+  FILE *out = fopen(out_path, "w");
+  if (out == nullptr) {
+    error("cannot write %s", out_path);
+  }
+  i32 functions = CTranslator{cfg, program, depth_at, out}.translate();
+  if (fclose(out) != 0) {
+    error("cannot write %s", out_path);
+  }
+  fprintf(stderr, "translated %d functions to %s\n", functions, out_path);
+}
+
+// verifies the program and writes its optimized version to out_path,
+// functions of up to inline_budget instructions are inlined and copies
+// specialized for constant arguments add up to specialize_budget instructions;
+// blocks are laid out by the counts in profile_path if there is one
+void run_optimizer(bytefile *bf, char const *out_path, i32 inline_budget,
+                   i32 specialize_budget, char const *profile_path = nullptr) {
+  ControlFlowGraph cfg{bf};
+  std::vector<i32> depth_at;
+  check_depth(bf, cfg, &depth_at);
+  std::unique_ptr<SequenceProfile> profile;
+  if (profile_path != nullptr) {
+    profile = std::make_unique<SequenceProfile>();
+    if (!read_profile(*profile, profile_path)) {
+      error("cannot read profile %s", profile_path);
+    }
+  }
+  BytecodeOptimizer optimizer{bf, cfg, depth_at, inline_budget,
+                              specialize_budget, profile.get()};
+  auto stats = optimizer.optimize();
+  if (!optimizer.write(out_path)) {
+    error("cannot write %s", out_path);
+  }
+  fprintf(stderr,
+          "code size %zu -> %zu bytes (%d constant arguments, %d "
+          "specialized, %d inlined, %d folded, %d reduced, %d threaded, %d "
+          "dropped, %d unreachable, %d dead functions, %d blocks moved, "
+          "%d cold)\n",
+          stats.old_size, stats.new_size, stats.propagated,
+          stats.specialized, stats.inlined, stats.folded,
+          stats.reduced, stats.threaded, stats.dropped, stats.dead_insns,
+          stats.dead_functions, stats.moved, stats.cold);
+}
+
+// parses a number of at least `min` from the command line, `what` names it
+// in the error
+static inline long parse_number(char const *arg, char const *what, long min) {
+  char *end = nullptr;
+  errno = 0;
+  long n = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || errno == ERANGE || n < min) {
+    error("invalid %s %s, expected a number of at least %ld", what, arg, min);
+  }
+  return n;
+}
+
+// the memoization budget of the memoize mode, a positive number of kilobytes
+static inline size_t parse_budget(char const *arg) {
+  long kb = parse_number(arg, "memoization budget", 1);
+  if ((unsigned long)kb > SIZE_MAX / 1024) {
+    error("memoization budget %s is too large", arg);
+  }
+  return (size_t)kb * 1024;
+}
+
 int main(int argc, char *argv[]) {
   bytefile *bf = read_file(argv[1]);
   if (argc >= 3) {
@@ -632,6 +397,28 @@ int main(int argc, char *argv[]) {
       run_with_verifier_checks(bf, true);
     } else if (std::string{argv[2]} == "runtime") {
       run_with_runtime_checks(bf, true);
+    } else if (std::string{argv[2]} == "instrument") {
+      run_instrumented(bf, argc >= 4 ? argv[3] : "");
+    } else if (std::string{argv[2]} == "threaded") {
+      run_threaded(bf, true, argc >= 4 ? argv[3] : nullptr);
+    } else if (std::string{argv[2]} == "memoize") {
+      size_t budget = argc >= 4 ? parse_budget(argv[3]) : 4096 * 1024;
+      run_threaded(bf, true, nullptr, budget);
+    } else if (std::string{argv[2]} == "profile" && argc >= 4) {
+      run_profiling(bf, argv[3]);
+    } else if (std::string{argv[2]} == "register") {
+      run_register(bf, true);
+    } else if (std::string{argv[2]} == "jit") {
+      run_register(bf, true, true);
+    } else if (std::string{argv[2]} == "aot" && argc >= 4) {
+      run_aot(bf, argv[3]);
+    } else if (std::string{argv[2]} == "optimize" && argc >= 4) {
+      i32 inline_budget =
+          argc >= 5 ? parse_number(argv[4], "inline budget", 0) : 16;
+      i32 specialize_budget =
+          argc >= 6 ? parse_number(argv[5], "specialization budget", 0) : 256;
+      run_optimizer(bf, argv[3], inline_budget, specialize_budget,
+                    argc >= 7 ? argv[6] : nullptr);
     }
   } else {
     run_with_runtime_checks(bf);
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "control-flow.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <vector>
+
+// Memoization of pure functions, enabled by the `memoize` mode.
+//
+// A function is pure when its result depends on its arguments only and
+// calling it has no visible effect: it does not read or write globals, write
+// its arguments or captured variables, store into objects (STA, STI), take
+// references, do I/O, or call a function that is not pure itself. Closure
+// calls are allowed only when closure flow analysis resolved the callee.
+// Stores into objects are refused altogether, as the object may be a
+// constant or reachable from a caller.
+//
+// The BEGIN of every pure function of up to MemoTable::MAX_ARGS arguments is
+// replaced with MEMO_BEGIN, and its ENDs point back at it. When all the
+// arguments are ints, MEMO_BEGIN looks the call up in the table and returns
+// the remembered result without running the function; otherwise it marks
+// the frame, and END records the result of a marked frame if that is an int
+// too. Objects are never kept as keys or results: they may move, and a
+// shared result would alias a fresh one.
+class MemoTable {
+public:
+  static u32 constexpr MAX_ARGS = 4;
+
+  i32 hits = 0;
+  i32 misses = 0;
+
+  // `budget` bytes of entries, rounded down to a power of two
+  explicit MemoTable(size_t budget) {
+    size_t n = 1;
+    while (n * 2 * sizeof(Entry) <= budget) {
+      n *= 2;
+    }
+    entries.assign(n, Entry{});
+    mask = n - 1;
+  }
+
+  // `args` point at the arguments on the stack, the last one first
+  bool lookup(Insn const *function, size_t const *args, u32 n_args,
+              u32 &result) {
+    Entry const &e = entries[hash(function, args, n_args) & mask];
+    if (e.function == function && matches(e, args, n_args)) {
+      hits++;
+      result = e.result;
+      return true;
+    }
+    misses++;
+    return false;
+  }
+
+  // a colliding entry is replaced, so the table never grows
+  void insert(Insn const *function, size_t const *args, u32 n_args,
+              u32 result) {
+    Entry &e = entries[hash(function, args, n_args) & mask];
+    e.function = function;
+    for (u32 i = 0; i < n_args; i++) {
+      e.args[i] = (u32)args[i];
+    }
+    e.result = result;
+  }
+
+private:
+  struct Entry {
+    Insn const *function = nullptr;
+    u32 args[MAX_ARGS] = {};
+    u32 result = 0;
+  };
+
+  std::vector<Entry> entries;
+  size_t mask = 0;
+
+  static bool matches(Entry const &e, size_t const *args, u32 n_args) {
+    for (u32 i = 0; i < n_args; i++) {
+      if (e.args[i] != (u32)args[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // the HASH_APPEND step of Lhash over the unboxed arguments
+  static u32 hash(Insn const *function, size_t const *args, u32 n_args) {
+    u32 acc = (u32)(size_t)function;
+    for (u32 i = 0; i < n_args; i++) {
+      u32 x = acc + (u32)UNBOX(args[i]);
+      acc = (x << 16) | (x >> 16);
+    }
+    return acc ^ (acc >> 11);
+  }
+};
+
+// Finds the pure functions and replaces their BEGIN with MEMO_BEGIN. Runs
+// after closure flow and escape analysis, before fusion and quickening.
+// Returns the number of memoized functions.
+class PurityAnalysis {
+public:
+  PurityAnalysis(ControlFlowGraph const &cfg, PredecodedProgram &program)
+      : cfg(cfg), program(program) {}
+
+  i32 memoize() {
+    auto const n = cfg.functions.size();
+    pure.assign(n, true);
+    for (size_t f = 0; f < n; f++) {
+      pure[f] = is_locally_pure(f);
+    }
+    // a function calling an impure one is impure, until nothing changes
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t f = 0; f < n; f++) {
+        if (pure[f] && !callees_are_pure(f)) {
+          pure[f] = false;
+          changed = true;
+        }
+      }
+    }
+    i32 memoized = 0;
+    for (size_t f = 0; f < n; f++) {
+      i32 begin = cfg.functions[f].begin;
+      Insn *insn = program.insn_at[begin];
+      // the main function is entered without a caller
+      if (pure[f] && begin != 0 && insn->op == Op::BEGIN &&
+          (u32)insn->a <= MemoTable::MAX_ARGS) {
+        insn->op = Op::MEMO_BEGIN;
+        // END finds the key of a marked frame through its function
+        for_each_insn(f, [&](Insn const &end) {
+          if (end.op == Op::END) {
+            program.code[&end - program.code.data()].c.target = insn;
+          }
+        });
+        memoized++;
+      }
+    }
+    return memoized;
+  }
+
+private:
+  ControlFlowGraph const &cfg;
+  PredecodedProgram &program;
+  std::vector<bool> pure; // per function
+
+  template <typename F> void for_each_insn(size_t f, F &&visit) const {
+    for (i32 b : cfg.functions[f].order) {
+      cfg.for_each_insn(b, [&](i32 offset) {
+        if (Insn const *insn = program.insn_starting_at(offset)) {
+          visit(*insn);
+        }
+      });
+    }
+  }
+
+  static bool captures_global(Insn const &insn) {
+    for (i32 i = 0; i < (insn.b & 0xFFFF); i++) {
+      if (insn.c.captures[i].kind == GLOBAL) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool is_pure(Insn const &insn) {
+    switch (insn.op) {
+    case Op::LD:
+      return insn.a != GLOBAL;
+    case Op::ST:
+      return insn.a == LOCAL;
+    case Op::CLOSURE:
+    case Op::CLOSURE_FRAME:
+      return !captures_global(insn);
+    case Op::LDA:
+    case Op::STI:
+    case Op::STA:
+    case Op::LREAD:
+    case Op::LWRITE:
+    case Op::CALLC:
+    case Op::TAILCALLC:
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  bool is_locally_pure(size_t f) const {
+    bool result = true;
+    for_each_insn(f, [&](Insn const &insn) {
+      result = result && is_pure(insn);
+    });
+    return result;
+  }
+
+  bool callees_are_pure(size_t f) const {
+    bool result = true;
+    for_each_insn(f, [&](Insn const &insn) {
+      switch (insn.op) {
+      case Op::CALL:
+      case Op::TAILCALL:
+      case Op::CONSCALL:
+      case Op::CALLC_DIRECT:
+      case Op::TAILCALLC_DIRECT: {
+        i32 offset = program.offsets[insn.c.target - program.code.data()];
+        i32 callee = cfg.function_at[offset];
+        result = result && callee != ControlFlowGraph::NONE && pure[callee];
+        break;
+      }
+      default:
+        break;
+      }
+    });
+    return result;
+  }
+};
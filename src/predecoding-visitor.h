@@ -0,0 +1,390 @@
+#pragma once
+
+#include "bytefile.h"
+#include "lama-enums.h"
+#include "runtime-decl.h"
+#include "visitor.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// opcodes of the predecoded instruction stream
+enum class Op : u8 {
+  BINOP = 0,
+  CONST,
+  STRING,
+  SEXP,
+  STI,
+  STA,
+  JMP,
+  END,
+  DROP,
+  DUP,
+  SWAP,
+  ELEM,
+  LD,
+  LDA,
+  ST,
+  CJMPZ,
+  CJMPNZ,
+  BEGIN,
+  CBEGIN,
+  CLOSURE,
+  CALLC,
+  CALL,
+  TAG,
+  ARRAY,
+  FAILURE,
+  LINE, // never emitted, jumps to it land on the next instruction
+  PATT,
+  LREAD,
+  LWRITE,
+  LLENGTH,
+  LSTRING,
+  BARRAY,
+  STOP,
+  // superinstructions, see superinstructions.h
+  LD_LD_BINOP,
+  CONST_BINOP,
+  DUP_TAG_CJMPZ,
+  LD_CALL,
+  BINOP_CJMPZ,
+  BINOP_CJMPNZ,
+  ST_DROP,
+  LD_LD,
+  // quickened forms, see quickening.h
+  LD_GLOBAL,
+  LD_FRAME,
+  LD_CAPT,
+  LDA_GLOBAL,
+  LDA_FRAME,
+  LDA_CAPT,
+  ST_GLOBAL,
+  ST_FRAME,
+  ST_CAPT,
+  ADD, // BINOP specialized by label, in BinopLabel order
+  SUB,
+  MUL,
+  DIV,
+  MOD,
+  LT,
+  LEQ,
+  GT,
+  GEQ,
+  EQ,
+  NEQ,
+  AND,
+  OR,
+  OBJECT,    // preallocated constant object, see constant-objects.h
+  TAILCALL,  // CALL followed by END
+  TAILCALLC, // CALLC followed by END
+  CONSCALL,  // CALL followed by SEXP cons 2 and END
+  // BINOP and CJMP on operands known to be ints, see type-inference.h
+  ADD_INT,
+  SUB_INT,
+  LT_INT,
+  LEQ_INT,
+  GT_INT,
+  GEQ_INT,
+  EQ_INT,
+  NEQ_INT,
+  CJMPZ_INT,
+  CJMPNZ_INT,
+  PATT_KNOWN, // PATT with an outcome known from the type, a = the result
+  BARRAY_FRAME, // BARRAY into the frame, see escape-analysis.h
+  DECISION,     // chain of DUP;TAG|ARRAY;CJMPz, see decision-trees.h
+  // CALLC and TAILCALLC of a known function, see closure-flow.h
+  CALLC_DIRECT,
+  TAILCALLC_DIRECT,
+  CLOSURE_FRAME, // CLOSURE into the frame, see escape-analysis.h
+  MEMO_BEGIN,    // BEGIN of a memoized function, see memoization.h
+  // frameless functions, see leaf-functions.h
+  LEAF_BEGIN,
+  LEAF_END,  // a = args, b = stack depth
+  LD_ARG_SP, // b = slot above sp
+  ST_ARG_SP,
+  LAST
+};
+
+static char const *const op_names[] = {
+    "BINOP", "CONST", "STRING", "SEXP", "STI", "STA", "JMP", "END", "DROP",
+    "DUP", "SWAP", "ELEM", "LD", "LDA", "ST", "CJMPz", "CJMPnz", "BEGIN",
+    "CBEGIN", "CLOSURE", "CALLC", "CALL", "TAG", "ARRAY", "FAIL", "LINE",
+    "PATT", "Lread", "Lwrite", "Llength", "Lstring", "Barray", "STOP",
+    "LD_LD_BINOP", "CONST_BINOP", "DUP_TAG_CJMPz", "LD_CALL", "BINOP_CJMPz",
+    "BINOP_CJMPnz", "ST_DROP", "LD_LD", "LD_GLOBAL", "LD_FRAME", "LD_CAPT",
+    "LDA_GLOBAL", "LDA_FRAME", "LDA_CAPT", "ST_GLOBAL", "ST_FRAME", "ST_CAPT",
+    "ADD", "SUB", "MUL", "DIV", "MOD", "LT", "LEQ", "GT", "GEQ", "EQ", "NEQ",
+    "AND", "OR", "OBJECT", "TAILCALL", "TAILCALLC", "CONSCALL", "ADD_INT",
+    "SUB_INT", "LT_INT", "LEQ_INT", "GT_INT", "GEQ_INT", "EQ_INT", "NEQ_INT",
+    "CJMPz_INT", "CJMPnz_INT", "PATT_KNOWN", "BARRAY_FRAME", "DECISION",
+    "CALLC_DIRECT", "TAILCALLC_DIRECT", "CLOSURE_FRAME", "MEMO_BEGIN",
+    "LEAF_BEGIN", "LEAF_END", "LD_ARG_SP", "ST_ARG_SP"};
+static_assert(sizeof(op_names) / sizeof(op_names[0]) == (size_t)Op::LAST,
+              "every opcode needs a name");
+
+// a captured variable of CLOSURE, decoded from the (byte kind, int index) pair
+struct Capture {
+  u32 kind; // GLOBAL, LOCAL, ARG or CAPTURED
+  i32 index;
+};
+
+struct Insn;
+
+union InsnOperand {
+  i32 value;
+  Insn *target;            // JMP, CJMPz, CJMPnz, CALL, CALLC_DIRECT
+  char const *str;         // STRING, SEXP, TAG
+  Capture const *captures; // CLOSURE
+  void *object;            // OBJECT
+};
+
+// One predecoded instruction. Every field is word-aligned, operands are
+// already unpacked, strings and jump targets are already resolved and tags of
+// SEXP and TAG are already hashed (in `b`), so the engine never touches the
+// original bytecode or the string table.
+struct Insn {
+  void const *handler; // address of the handler, baked in by the engine
+  Op op;
+  i32 a;
+  i32 b;
+  InsnOperand c;
+};
+
+// Polymorphic inline cache of a CALLC site: the code offsets of the last few
+// closures called there and the BEGIN instructions they start with.
+struct CallSiteCache {
+  static u32 constexpr SIZE = 4;
+  i32 offsets[SIZE] = {-1, -1, -1, -1};
+  Insn *entries[SIZE] = {};
+  u32 next = 0; // the entry replaced on the next miss
+};
+
+// A chain of pattern tests on the same value, dispatched in one step: the
+// value's (kind, tag, arity) key selects the code after the first test that
+// matches it, `fail` is where the last test jumps when nothing matches.
+struct DecisionNode {
+  std::unordered_map<u64, Insn *> targets;
+  Insn *fail;
+};
+
+class MemoTable;
+
+struct PredecodedProgram {
+  bytefile const *bf;
+  std::vector<Insn> code;
+  std::vector<i32> offsets; // code offset of every instruction in `code`
+  std::vector<Capture> captures;
+  std::vector<CallSiteCache> call_caches; // indexed by `b` of CALLC
+  std::vector<DecisionNode> decisions;    // indexed by `b` of DECISION
+  MemoTable *memo = nullptr;              // used by MEMO_BEGIN
+  // code offset -> instruction starting there (nullptr inside an instruction),
+  // closures keep code offsets so CALLC goes through this table
+  std::vector<Insn *> insn_at;
+
+  Insn *entry() { return insn_at[0]; }
+
+  // the instruction starting at a code offset, nullptr for LINE, which is
+  // not predecoded and whose offset maps to the next instruction
+  Insn *insn_starting_at(i32 offset) const {
+    Insn *insn = insn_at[offset];
+    if (insn == nullptr || offsets[insn - code.data()] != offset) {
+      return nullptr;
+    }
+    return insn;
+  }
+};
+
+// Translates a single instruction. Jump targets are left as code offsets in
+// `c.value` and resolved by `predecode` once the whole stream is known.
+class PredecodingVisitor final : public Visitor<Insn> {
+public:
+  ~PredecodingVisitor() = default;
+  PredecodingVisitor(bytefile const *bf, std::vector<Capture> &captures)
+      : bf(bf), captures(captures) {}
+  bytefile const *bf;
+  std::vector<Capture> &captures;
+
+  static Insn make(Op op, i32 a = 0, i32 b = 0, i32 c = 0) {
+    Insn insn{nullptr, op, a, b, {}};
+    insn.c.value = c;
+    return insn;
+  }
+
+  Insn visit_binop(u8 *decode_next_ip, u8 index) {
+    return make(Op::BINOP, index);
+  }
+  Insn visit_const(u8 *decode_next_ip, i32 constant) {
+    return make(Op::CONST, constant);
+  }
+  Insn visit_str(u8 *decode_next_ip, char const *literal) {
+    auto insn = make(Op::STRING);
+    insn.c.str = literal;
+    return insn;
+  }
+  // tags are hashed here once instead of on every execution
+  Insn visit_sexp(u8 *decode_next_ip, char const *tag, i32 args) {
+    auto insn = make(Op::SEXP, args, LtagHash((char *)tag));
+    insn.c.str = tag;
+    return insn;
+  }
+  Insn visit_sti(u8 *decode_next_ip) { return make(Op::STI); }
+  Insn visit_sta(u8 *decode_next_ip) { return make(Op::STA); }
+  Insn visit_jmp(u8 *decode_next_ip, i32 jump_location) {
+    return make(Op::JMP, 0, 0, jump_location);
+  }
+  Insn visit_end_ret(u8 *decode_next_ip) { return make(Op::END); }
+  Insn visit_drop(u8 *decode_next_ip) { return make(Op::DROP); }
+  Insn visit_dup(u8 *decode_next_ip) { return make(Op::DUP); }
+  Insn visit_swap(u8 *decode_next_ip) { return make(Op::SWAP); }
+  Insn visit_elem(u8 *decode_next_ip) { return make(Op::ELEM); }
+  Insn visit_ld(u8 *decode_next_ip, u8 arg_kind, i32 index) {
+    return make(Op::LD, arg_kind, index);
+  }
+  Insn visit_lda(u8 *decode_next_ip, u8 arg_kind, i32 index) {
+    return make(Op::LDA, arg_kind, index);
+  }
+  Insn visit_st(u8 *decode_next_ip, u8 arg_kind, i32 index) {
+    return make(Op::ST, arg_kind, index);
+  }
+  Insn visit_cjmp(u8 *decode_next_ip, u8 is_negated, i32 jump_location) {
+    return make(is_negated ? Op::CJMPNZ : Op::CJMPZ, 0, 0, jump_location);
+  }
+  Insn visit_begin(u8 *decode_next_ip, u8 is_closure_begin, i32 n_args,
+                   i32 n_locals) {
+    // the upper half of n_args holds the stack size patched by check_depth
+    return make(is_closure_begin ? Op::CBEGIN : Op::BEGIN, n_args & 0xFFFF,
+                n_locals, (i32)((((u32)n_args) & 0xFFFF0000) >> 16));
+  }
+  Insn visit_closure(u8 *decode_next_ip, i32 addr, i32 n, u8 *args_begin) {
+    if (addr < 0 || addr > (bf->code_end - bf->code_ptr) ||
+        !check_is_begin(bf, bf->code_ptr + addr)) {
+      error("closure does not point at begin");
+    }
+    i32 first = (i32)captures.size();
+    for (i32 i = 0; i < n; i++) {
+      u8 kind = *args_begin++;
+      i32 index = *(i32 *)args_begin;
+      args_begin += sizeof(i32);
+      if (kind > 3) {
+        error("unsupported argument kind in closure");
+      }
+      captures.push_back(Capture{kind + 1u, index});
+    }
+    // resolved into a pointer once all the captures are collected
+    return make(Op::CLOSURE, addr, n, first);
+  }
+  Insn visit_call_closure(u8 *decode_next_ip, i32 n_arg) {
+    return make(Op::CALLC, n_arg);
+  }
+  Insn visit_call(u8 *decode_next_ip, i32 loc, i32 n_arg) {
+    return make(Op::CALL, n_arg, 0, loc);
+  }
+  Insn visit_tag(u8 *decode_next_ip, char const *name, i32 n_arg) {
+    auto insn = make(Op::TAG, n_arg, LtagHash((char *)name));
+    insn.c.str = name;
+    return insn;
+  }
+  Insn visit_array(u8 *decode_next_ip, i32 size) {
+    return make(Op::ARRAY, size);
+  }
+  Insn visit_fail(u8 *decode_next_ip, i32 arg1, i32 arg2) {
+    return make(Op::FAILURE, arg1, arg2);
+  }
+  Insn visit_line(u8 *decode_next_ip, i32 line_number) {
+    return make(Op::LINE, line_number);
+  }
+  Insn visit_patt(u8 *decode_next_ip, u8 patt_kind) {
+    if (patt_kind >= (u8)Patt::LAST) {
+      error("Unsupported patt specializer");
+    }
+    return make(Op::PATT, patt_kind);
+  }
+  Insn visit_call_lread(u8 *decode_next_ip) { return make(Op::LREAD); }
+  Insn visit_call_lwrite(u8 *decode_next_ip) { return make(Op::LWRITE); }
+  Insn visit_call_llength(u8 *decode_next_ip) { return make(Op::LLENGTH); }
+  Insn visit_call_lstring(u8 *decode_next_ip) { return make(Op::LSTRING); }
+  Insn visit_call_barray(u8 *decode_next_ip, i32 arg) {
+    return make(Op::BARRAY, arg);
+  }
+  Insn visit_stop(u8 *decode_next_ip) { return make(Op::STOP); }
+};
+
+static inline bool has_jump_target(Op op) {
+  return op == Op::JMP || op == Op::CJMPZ || op == Op::CJMPNZ ||
+         op == Op::CALL || op == Op::TAILCALL || op == Op::CONSCALL ||
+         op == Op::CJMPZ_INT || op == Op::CJMPNZ_INT;
+}
+
+// Decodes the whole code section once. LINE is dropped, a STOP is appended so
+// that falling off the end of the code terminates the program.
+static inline void predecode(bytefile const *bf, PredecodedProgram &program) {
+  auto const code_size = bf->code_end - bf->code_ptr;
+  std::vector<i32> index_at(code_size + 1, -1);
+  program.bf = bf;
+  program.code.clear();
+  program.offsets.clear();
+  program.captures.clear();
+  program.call_caches.clear();
+  program.decisions.clear();
+
+  auto visitor = PredecodingVisitor{bf, program.captures};
+  u8 *ip = bf->code_ptr;
+  while (ip < bf->code_end) {
+    auto const [next_ip, insn] = visit_instruction<Insn, true>(bf, ip, visitor);
+    index_at[ip - bf->code_ptr] = (i32)program.code.size();
+    if (insn.op != Op::LINE) {
+      program.code.push_back(insn);
+      program.offsets.push_back((i32)(ip - bf->code_ptr));
+    }
+    ip = next_ip;
+  }
+  index_at[code_size] = (i32)program.code.size();
+  program.code.push_back(PredecodingVisitor::make(Op::STOP));
+  program.offsets.push_back((i32)code_size);
+
+  // the vectors are not resized from now on, so pointers into them are stable
+  for (auto &insn : program.code) {
+    if (has_jump_target(insn.op)) {
+      i32 offset = insn.c.value;
+      if (offset < 0 || offset >= code_size || index_at[offset] < 0) {
+        error("jump to 0x%.8x does not point at an instruction", offset);
+      }
+      insn.c.target = &program.code[index_at[offset]];
+    } else if (insn.op == Op::CLOSURE) {
+      insn.c.captures = program.captures.data() + insn.c.value;
+    } else if (insn.op == Op::CALLC) {
+      insn.b = (i32)program.call_caches.size();
+      program.call_caches.emplace_back();
+    }
+  }
+  // calls in a tail position reuse the frame of the caller, the END stays in
+  // place for jumps to it
+  i32 const cons_hash = LtagHash((char *)"cons");
+  auto returns = [&program](size_t i) {
+    auto const &insn = program.code[i];
+    return insn.op == Op::END ||
+           (insn.op == Op::JMP && insn.c.target->op == Op::END);
+  };
+  for (size_t i = 0; i + 1 < program.code.size(); i++) {
+    auto &insn = program.code[i];
+    auto const &next = program.code[i + 1];
+    if (next.op == Op::END) {
+      if (insn.op == Op::CALL) {
+        insn.op = Op::TAILCALL;
+      } else if (insn.op == Op::CALLC) {
+        insn.op = Op::TAILCALLC;
+      }
+    } else if (insn.op == Op::CALL && next.op == Op::SEXP && next.a == 2 &&
+               next.b == cons_hash && i + 2 < program.code.size() &&
+               returns(i + 2)) {
+      insn.op = Op::CONSCALL;
+    }
+  }
+  program.insn_at.assign(code_size + 1, nullptr);
+  for (i32 offset = 0; offset <= code_size; offset++) {
+    if (index_at[offset] >= 0) {
+      program.insn_at[offset] = &program.code[index_at[offset]];
+    }
+  }
+}
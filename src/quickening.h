@@ -0,0 +1,143 @@
+#pragma once
+
+#include "lama-enums.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include "superinstructions.h"
+#include "type-inference.h"
+
+// Quickening replaces the generic LD, LDA, ST and BINOP instructions with
+// handlers specialized by variable kind and by operator label. It runs once
+// at load time, after fusion, on every instruction that is not part of a
+// fused sequence (the fused handlers still read the generic operands).
+//
+// Operands of the quickened variable accesses:
+//   *_GLOBAL: a = global index
+//   *_FRAME:  a = slot relative to the base pointer (locals and arguments)
+//   *_CAPT:   a = slot of the closure, b = index of the captured value in it
+
+static inline u8 fused_length(Op op) {
+  for (auto const &rule : fusion_rules) {
+    if (rule.fused == op) {
+      return rule.length;
+    }
+  }
+  return 0;
+}
+
+// n_args is the argument count of the enclosing function
+static inline void quicken_reference(Insn &insn, i32 n_args) {
+  Op base = insn.op == Op::LD    ? Op::LD_GLOBAL
+            : insn.op == Op::LDA ? Op::LDA_GLOBAL
+                                 : Op::ST_GLOBAL;
+  i32 index = insn.b;
+  switch (insn.a) {
+  case GLOBAL:
+    if (index < 0 || index >= N_GLOBAL) {
+      error("global %d is out of bounds", index);
+    }
+    insn.op = base;
+    insn.a = index;
+    break;
+  case LOCAL:
+    insn.op = (Op)((u8)base + 1);
+    insn.a = -1 - index;
+    break;
+  case ARG:
+    insn.op = (Op)((u8)base + 1);
+    insn.a = 2 + n_args - index;
+    break;
+  case CAPTURED:
+    insn.op = (Op)((u8)base + 2);
+    insn.a = 2 + n_args + 1;
+    insn.b = 1 + index;
+    break;
+  default:
+    error("unsupported reference kind");
+  }
+}
+
+// BINOP, CJMP and PATT whose operand types are known from type inference get
+// handlers that skip the tag arithmetic, or fold to the known outcome.
+static inline bool quicken_typed(Insn &insn, OperandTypes const &types) {
+  bool ints = types.top == ValueType::INT && types.second == ValueType::INT;
+  switch (insn.op) {
+  case Op::BINOP: {
+    auto label = (BinopLabel)insn.a;
+    if (!ints) {
+      return false;
+    }
+    if (label == BinopLabel::ADD || label == BinopLabel::SUB) {
+      insn.op = (Op)((u8)Op::ADD_INT + insn.a);
+      return true;
+    }
+    if (label >= BinopLabel::LT && label <= BinopLabel::NEQ) {
+      insn.op = (Op)((u8)Op::LT_INT + (insn.a - (i32)BinopLabel::LT));
+      return true;
+    }
+    return false;
+  }
+  case Op::CJMPZ:
+  case Op::CJMPNZ:
+    if (types.top != ValueType::INT) {
+      return false;
+    }
+    insn.op = insn.op == Op::CJMPZ ? Op::CJMPZ_INT : Op::CJMPNZ_INT;
+    return true;
+  case Op::PATT:
+    if (i32 result = known_patt_result((Patt)insn.a, types.top)) {
+      insn.op = Op::PATT_KNOWN;
+      insn.a = result;
+      return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+// Returns the number of quickened instructions. `types`, if given, holds the
+// operand types of every instruction (see type-inference.h).
+static inline i32 quicken(PredecodedProgram &program,
+                          std::vector<OperandTypes> const *types = nullptr) {
+  i32 quickened = 0;
+  i32 n_args = 0;
+  auto &code = program.code;
+  for (size_t i = 0; i < code.size();) {
+    Insn &insn = code[i];
+    if (u8 length = fused_length(insn.op)) {
+      i += length;
+      continue;
+    }
+    if (types != nullptr && quicken_typed(insn, (*types)[i])) {
+      quickened++;
+      i++;
+      continue;
+    }
+    switch (insn.op) {
+    case Op::BEGIN:
+    case Op::CBEGIN:
+    case Op::MEMO_BEGIN:
+    case Op::LEAF_BEGIN:
+      n_args = insn.a;
+      break;
+    case Op::BINOP:
+      if (insn.a < 0 || insn.a >= (i32)BinopLabel::BINOP_LAST) {
+        error("unsupported op label: %d", insn.a);
+      }
+      insn.op = (Op)((u8)Op::ADD + insn.a);
+      quickened++;
+      break;
+    case Op::LD:
+    case Op::LDA:
+    case Op::ST:
+      quicken_reference(insn, n_args);
+      quickened++;
+      break;
+    default:
+      break;
+    }
+    i++;
+  }
+  return quickened;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include "executing-visitor.h"
+#include "jit.h"
+#include "register-ir.h"
+#include "runtime-decl.h"
+#include "threaded-interpreter.h"
+#include <cstdio>
+#include <cstring>
+
+// Direct-threaded interpreter of the register IR. The base pointer lives in a
+// local, operands are addressed as bp[slot]; __gc_stack_top is only updated
+// by the instructions that may reach the GC or push a frame. With UseJit,
+// entries and back edges are counted and hot functions run as native code,
+// see jit.h.
+template <bool Checks, bool UseJit = false>
+static inline void register_interpret(RegisterProgram &program,
+                                      [[maybe_unused]] Jit *jit = nullptr) {
+#define HANDLER(op) &&rop_##op
+  static void const *const handlers[] = {
+      HANDLER(MOV), HANDLER(LDI), HANDLER(LDG), HANDLER(STG), HANDLER(LDC),
+      HANDLER(STC), HANDLER(LEA_FRAME), HANDLER(LEA_GLOBAL), HANDLER(LEA_CAPT),
+      HANDLER(BINOP), HANDLER(BINOPI), HANDLER(JMP), HANDLER(CJMPZ),
+      HANDLER(CJMPNZ), HANDLER(BR_BINOP_Z), HANDLER(BR_BINOP_NZ),
+      HANDLER(BR_BINOPI_Z), HANDLER(BR_BINOPI_NZ), HANDLER(ELEM),
+      HANDLER(ELEMI), HANDLER(TAG), HANDLER(ARRAY), HANDLER(PATT),
+      HANDLER(PATT_STR), HANDLER(LLENGTH), HANDLER(ENTER), HANDLER(RET),
+      HANDLER(CALL), HANDLER(CALLC), HANDLER(STRING), HANDLER(SEXP),
+      HANDLER(STI), HANDLER(STA), HANDLER(SWAP), HANDLER(CLOSURE),
+      HANDLER(LREAD), HANDLER(LWRITE), HANDLER(LSTRING), HANDLER(BARRAY),
+      HANDLER(FAILURE), HANDLER(STOP),
+  };
+#undef HANDLER
+  [[maybe_unused]] static void const *const jit_handler = &&rop_JIT;
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == (size_t)ROp::LAST,
+                "every opcode needs a handler");
+  for (auto &insn : program.code) {
+    insn.handler = handlers[(u8)insn.op];
+  }
+
+  auto operands_stack = stack<u32, Checks>{};
+  __init();
+  RInsn *const *insn_at = program.insn_at.data();
+  size_t *const globals = operands_stack.stack_begin + 1;
+  size_t *bp = operands_stack.base_pointer;
+  RInsn *ip = program.entry();
+  bool closure_call = false;
+  if constexpr (UseJit) {
+    jit->globals = globals;
+  }
+
+#define DISPATCH() goto *ip->handler
+#define NEXT()                                                                 \
+  {                                                                            \
+    ++ip;                                                                      \
+    DISPATCH();                                                                \
+  }
+#define BACK_EDGE()                                                            \
+  if constexpr (UseJit) {                                                      \
+    if (ip->d.target <= ip) {                                                  \
+      jit->tick(ip->d.target, jit_handler);                                    \
+    }                                                                          \
+  }
+#define JUMP_IF(cond)                                                          \
+  {                                                                            \
+    if (cond) {                                                                \
+      BACK_EDGE();                                                             \
+      ip = ip->d.target;                                                       \
+      DISPATCH();                                                              \
+    }                                                                          \
+    NEXT();                                                                    \
+  }
+#define SET_TOP() __gc_stack_top = bp + ip->a
+  DISPATCH();
+
+rop_MOV: {
+  bp[ip->a] = bp[ip->b];
+  NEXT();
+}
+rop_LDI: {
+  bp[ip->a] = (size_t)ip->b;
+  NEXT();
+}
+rop_LDG: {
+  bp[ip->a] = globals[ip->b];
+  NEXT();
+}
+rop_STG: {
+  globals[ip->a] = bp[ip->b];
+  NEXT();
+}
+rop_LDC: {
+  bp[ip->a] = ((size_t *)bp[ip->c])[1 + ip->b];
+  NEXT();
+}
+rop_STC: {
+  ((size_t *)bp[ip->c])[1 + ip->a] = bp[ip->b];
+  NEXT();
+}
+rop_LEA_FRAME: {
+  bp[ip->a] = (size_t)(bp + ip->b);
+  NEXT();
+}
+rop_LEA_GLOBAL: {
+  bp[ip->a] = (size_t)(globals + ip->b);
+  NEXT();
+}
+rop_LEA_CAPT: {
+  bp[ip->a] = (size_t)(((size_t *)bp[ip->c]) + 1 + ip->b);
+  NEXT();
+}
+rop_BINOP: {
+  bp[ip->a] = BOX(arithm_op(UNBOX(bp[ip->b]), UNBOX(bp[ip->c]),
+                            (BinopLabel)ip->d.value));
+  NEXT();
+}
+rop_BINOPI: {
+  bp[ip->a] =
+      BOX(arithm_op(UNBOX(bp[ip->b]), ip->c, (BinopLabel)ip->d.value));
+  NEXT();
+}
+rop_JMP: {
+  BACK_EDGE();
+  ip = ip->d.target;
+  DISPATCH();
+}
+rop_CJMPZ: { JUMP_IF(UNBOX(bp[ip->b]) == 0); }
+rop_CJMPNZ: { JUMP_IF(UNBOX(bp[ip->b]) != 0); }
+rop_BR_BINOP_Z: {
+  JUMP_IF(UNBOX(BOX(arithm_op(UNBOX(bp[ip->a]), UNBOX(bp[ip->b]),
+                              (BinopLabel)ip->c))) == 0);
+}
+rop_BR_BINOP_NZ: {
+  JUMP_IF(UNBOX(BOX(arithm_op(UNBOX(bp[ip->a]), UNBOX(bp[ip->b]),
+                              (BinopLabel)ip->c))) != 0);
+}
+rop_BR_BINOPI_Z: {
+  JUMP_IF(UNBOX(BOX(arithm_op(UNBOX(bp[ip->a]), ip->b,
+                              (BinopLabel)ip->c))) == 0);
+}
+rop_BR_BINOPI_NZ: {
+  JUMP_IF(UNBOX(BOX(arithm_op(UNBOX(bp[ip->a]), ip->b,
+                              (BinopLabel)ip->c))) != 0);
+}
+rop_ELEM: {
+  bp[ip->a] = (size_t)Belem((void *)bp[ip->b], (int)bp[ip->c]);
+  NEXT();
+}
+rop_ELEMI: {
+  bp[ip->a] = (size_t)Belem((void *)bp[ip->b], ip->c);
+  NEXT();
+}
+rop_TAG: {
+  bp[ip->a] = Btag((void *)bp[ip->b], ip->d.value, BOX(ip->c));
+  NEXT();
+}
+rop_ARRAY: {
+  bp[ip->a] = Barray_patt((void *)bp[ip->b], BOX(ip->c));
+  NEXT();
+}
+rop_PATT: {
+  bp[ip->a] = patts_match((void *)bp[ip->b], (Patt)ip->c);
+  NEXT();
+}
+rop_PATT_STR: {
+  bp[ip->a] = Bstring_patt((void *)bp[ip->b], (void *)bp[ip->c]);
+  NEXT();
+}
+rop_LLENGTH: {
+  bp[ip->a] = Llength((void *)bp[ip->b]);
+  NEXT();
+}
+rop_ENTER: {
+  if constexpr (UseJit) {
+    jit->tick(ip, jit_handler);
+  }
+  i32 n_locals = ip->b;
+  if (!operands_stack.has_at_least(n_locals + ip->c + 4)) {
+    error("stack overflow");
+  }
+  operands_stack.push(BOX((u32)closure_call << CLOSURE_FRAME_SHIFT));
+  operands_stack.push((u32)bp);
+  bp = __gc_stack_top + 1;
+  memset((void *)(bp - n_locals), 0, n_locals * sizeof(size_t));
+  closure_call = false;
+  NEXT();
+}
+rop_RET: {
+  size_t ret_value = bp[ip->b];
+  if (bp == operands_stack.stack_begin - 1) {
+    goto done;
+  }
+  u32 saved = UNBOX(bp[1]);
+  RInsn *ret_ip = (RInsn *)bp[2];
+  size_t *result = bp + 2 + ip->a + (saved >> CLOSURE_FRAME_SHIFT);
+  *result = ret_value;
+  bp = (size_t *)bp[0];
+  __gc_stack_top = result - 1;
+  ip = ret_ip;
+  DISPATCH();
+}
+rop_CALL: {
+  SET_TOP();
+  operands_stack.push((u32)(ip + 1));
+  ip = ip->d.target;
+  DISPATCH();
+}
+rop_CALLC: {
+  SET_TOP();
+  u32 closure = *(__gc_stack_top + 1 + ip->b);
+  i32 addr = ((i32 *)closure)[0];
+  operands_stack.push((u32)(ip + 1));
+  closure_call = true;
+  ip = insn_at[addr];
+  if constexpr (Checks) {
+    if (ip == nullptr || ip->op != ROp::ENTER) {
+      error("CALLC does not call a function");
+    }
+  }
+  DISPATCH();
+}
+rop_STRING: {
+  SET_TOP();
+  operands_stack.push((u32)Bstring((void *)ip->d.str));
+  NEXT();
+}
+rop_SEXP: {
+  SET_TOP();
+  auto value = myBsexp_hashed(ip->b, operands_stack, ip->c);
+  operands_stack.push((u32)value);
+  NEXT();
+}
+rop_STI: {
+  SET_TOP();
+  u32 value = operands_stack.pop();
+  u32 reference = operands_stack.pop();
+  *(u32 *)reference = value;
+  operands_stack.push(value);
+  NEXT();
+}
+rop_STA: {
+  SET_TOP();
+  auto value = (void *)operands_stack.pop();
+  auto i = (int)operands_stack.pop();
+  auto x = (void *)operands_stack.pop();
+  operands_stack.push((u32)Bsta(value, i, x));
+  NEXT();
+}
+rop_SWAP: {
+  size_t fst = bp[ip->a + 1];
+  bp[ip->a + 1] = bp[ip->a + 2];
+  bp[ip->a + 2] = fst;
+  NEXT();
+}
+rop_CLOSURE: {
+  SET_TOP();
+  u32 v = (u32)myBclosure(ip->b, operands_stack, (void *)ip->c);
+  operands_stack.push(v);
+  NEXT();
+}
+rop_LREAD: {
+  SET_TOP();
+  operands_stack.push(Lread());
+  NEXT();
+}
+rop_LWRITE: {
+  size_t *top = bp + ip->a + 1;
+  fprintf(stdout, "%d\n", i32(UNBOX(*top)));
+  *top = BOX(0);
+  NEXT();
+}
+rop_LSTRING: {
+  SET_TOP();
+  operands_stack.push((u32)Lstring(((void *)operands_stack.pop())));
+  NEXT();
+}
+rop_BARRAY: {
+  SET_TOP();
+  auto arr = myBarray(ip->b, operands_stack);
+  operands_stack.push((u32)arr);
+  NEXT();
+}
+rop_JIT: {
+  ip = jit->run(ip, bp);
+  DISPATCH();
+}
+rop_FAILURE:
+rop_STOP:
+done:
+  return;
+#undef SET_TOP
+#undef JUMP_IF
+#undef BACK_EDGE
+#undef NEXT
+#undef DISPATCH
+}
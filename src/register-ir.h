@@ -0,0 +1,551 @@
+#pragma once
+
+#include "executing-visitor.h"
+#include "lama-enums.h"
+#include "predecoding-visitor.h"
+#include "runtime/runtime_common.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Register machine IR. Every operand is a frame slot addressed relative to the
+// base pointer: arguments are above it, locals right below it, and operand
+// stack slot k of the function is the virtual register
+// reg(k) = -(n_locals + 1 + k). Stack slots are assigned statically from the
+// depths computed by check_depth, so LD/ST of locals and arguments, DUP, DROP
+// and CONST mostly turn into nothing or into a single move.
+enum class ROp : u8 {
+  MOV = 0,    // a <- b
+  LDI,        // a <- b (an already boxed constant)
+  LDG,        // a <- G(b)
+  STG,        // G(a) <- b
+  LDC,        // a <- C(b), the closure is in slot c
+  STC,        // C(a) <- b, the closure is in slot c
+  LEA_FRAME,  // a <- address of slot b
+  LEA_GLOBAL, // a <- address of G(b)
+  LEA_CAPT,   // a <- address of C(b), the closure is in slot c
+  BINOP,      // a <- b op(d) c
+  BINOPI,     // a <- b op(d) immediate c
+  JMP,
+  CJMPZ,        // jump to d if b is zero
+  CJMPNZ,       // jump to d if b is not zero
+  BR_BINOP_Z,   // jump to d if (a op(c) b) is zero
+  BR_BINOP_NZ,  // jump to d if (a op(c) b) is not zero
+  BR_BINOPI_Z,  // jump to d if (a op(c) immediate b) is zero
+  BR_BINOPI_NZ, // jump to d if (a op(c) immediate b) is not zero
+  ELEM,         // a <- b[c]
+  ELEMI,        // a <- b[immediate boxed c]
+  TAG,          // a <- b has the tag hashed to d and c fields
+  ARRAY,        // a <- b is an array of c elements
+  PATT,         // a <- b matches pattern c
+  PATT_STR,     // a <- b equals the string c
+  LLENGTH,      // a <- length of b
+  ENTER,        // a args, b locals, c registers
+  RET,          // returns b, the function has a args
+  // The rest runs on the memory stack: __gc_stack_top is set to bp + a (the
+  // slot of the first free register), and everything below it is already
+  // stored in its register. These are the GC safepoints.
+  CALL,    // calls d
+  CALLC,   // calls the closure b slots above the top
+  STRING,  // pushes a copy of d
+  SEXP,    // pops b fields, pushes s-expression with the tag hashed to c
+  STI,     // pops value and reference, stores, pushes value
+  STA,     // pops value, index and aggregate, stores, pushes value
+  SWAP,    // swaps the two topmost slots
+  CLOSURE, // pops b captured values, pushes closure of c
+  LREAD,
+  LWRITE,
+  LSTRING,
+  BARRAY, // pops b elements, pushes array
+  FAILURE,
+  STOP,
+  LAST
+};
+
+struct RInsn;
+
+union RInsnOperand {
+  i32 value;
+  RInsn *target;
+  char const *str;
+};
+
+struct RInsn {
+  void const *handler; // address of the handler, baked in by the engine
+  ROp op;
+  i32 a;
+  i32 b;
+  i32 c;
+  RInsnOperand d;
+};
+
+struct RegisterProgram {
+  std::vector<RInsn> code;
+  // code offset -> first IR instruction of the bytecode instruction there
+  // (nullptr for unreachable code), closures keep code offsets
+  std::vector<RInsn *> insn_at;
+
+  RInsn *entry() { return insn_at[0]; }
+};
+
+class SsaTier;
+
+// Translates the predecoded stream function by function, keeping a symbolic
+// operand stack. An entry of the symbolic stack is either a slot that holds
+// its value (its own register, or a local/argument it was loaded from) or a
+// constant. Entries are stored into their own registers ("materialized")
+// before control flow merges, before anything that may run the GC or write
+// through a reference, and before their source slot is overwritten.
+// Functions the optional SSA tier accepts are translated by it instead, see
+// ssa-tier.h.
+class RegisterTranslator {
+public:
+  RegisterTranslator(PredecodedProgram const &program,
+                     std::vector<i32> const &depth_at, RegisterProgram &out,
+                     SsaTier *tier = nullptr)
+      : program(program), depth_at(depth_at), out(out), tier(tier) {}
+
+  void translate() {
+    auto const code_size = program.bf->code_end - program.bf->code_ptr;
+    is_label.assign(code_size + 1, false);
+    index_at.assign(code_size + 1, -1);
+    for (auto const &insn : program.code) {
+      if (insn.op == Op::JMP || insn.op == Op::CJMPZ ||
+          insn.op == Op::CJMPNZ) {
+        is_label[offset_of(insn.c.target)] = true;
+      }
+    }
+    out.code.clear();
+    for (size_t i = 0; i < program.code.size(); i++) {
+      i32 offset = program.offsets[i];
+      if (offset >= code_size || depth_at[offset] < 0) {
+        dead = true;
+        continue;
+      }
+      auto op = program.code[i].op;
+      if (op == Op::BEGIN || op == Op::CBEGIN) {
+        in_tier = translate_in_tier(offset);
+      }
+      if (!in_tier) {
+        i = translate_instruction(i);
+      }
+    }
+    finish_function();
+    for (auto [index, offset] : fixups) {
+      if (index_at[offset] < 0) {
+        error("jump to unreachable code at 0x%.8x", offset);
+      }
+      out.code[index].d.target = &out.code[index_at[offset]];
+    }
+    for (auto [index, target] : tier_fixups) {
+      out.code[index].d.target = &out.code[target];
+    }
+    out.insn_at.assign(code_size + 1, nullptr);
+    for (i32 offset = 0; offset <= code_size; offset++) {
+      if (index_at[offset] >= 0) {
+        out.insn_at[offset] = &out.code[index_at[offset]];
+      }
+    }
+  }
+
+private:
+  struct StackEntry {
+    bool is_imm;
+    i32 value; // a slot, or a boxed constant or a constant object
+  };
+
+  PredecodedProgram const &program;
+  std::vector<i32> const &depth_at;
+  RegisterProgram &out;
+  std::vector<bool> is_label;
+  std::vector<i32> index_at;
+  std::vector<std::pair<size_t, i32>> fixups;
+  SsaTier *tier;
+  std::vector<std::pair<size_t, size_t>> tier_fixups; // to IR indices
+  bool in_tier = false; // the function was translated by the tier
+
+  // defined in ssa-tier.h
+  bool translate_in_tier(i32 offset);
+
+  // the function being translated
+  i32 n_args = 0;
+  i32 n_locals = 0;
+  i32 n_regs = 0;
+  i32 enter_index = -1;
+  bool dead = true; // the previous instruction does not fall through
+  std::vector<StackEntry> stack;
+
+  i32 offset_of(Insn const *insn) const {
+    return program.offsets[insn - program.code.data()];
+  }
+
+  i32 reg(i32 k) {
+    n_regs = std::max(n_regs, k + 1);
+    return -(n_locals + 1 + k);
+  }
+  i32 depth() const { return (i32)stack.size(); }
+  i32 closure_slot() const { return 2 + n_args + 1; }
+  i32 frame_slot(u32 kind, i32 index) const {
+    return kind == LOCAL ? -1 - index : 2 + n_args - index;
+  }
+
+  size_t emit(ROp op, i32 a = 0, i32 b = 0, i32 c = 0, i32 d = 0) {
+    RInsn insn{nullptr, op, a, b, c, {}};
+    insn.d.value = d;
+    out.code.push_back(insn);
+    return out.code.size() - 1;
+  }
+  void emit_jump(ROp op, i32 a, i32 b, i32 c, Insn const *target) {
+    fixups.push_back({emit(op, a, b, c), offset_of(target)});
+  }
+
+  bool is_canonical(i32 k) {
+    return !stack[k].is_imm && stack[k].value == reg(k);
+  }
+  void materialize(i32 k) {
+    if (is_canonical(k)) {
+      return;
+    }
+    emit(stack[k].is_imm ? ROp::LDI : ROp::MOV, reg(k), stack[k].value);
+    stack[k] = StackEntry{false, reg(k)};
+  }
+  void flush() {
+    for (i32 k = 0; k < depth(); k++) {
+      materialize(k);
+    }
+  }
+  // called before `slot` is overwritten
+  void clobber(i32 slot) {
+    for (i32 k = 0; k < depth(); k++) {
+      if (!stack[k].is_imm && stack[k].value == slot && reg(k) != slot) {
+        materialize(k);
+      }
+    }
+  }
+  // a slot holding the k-th entry
+  i32 slot_of(i32 k) {
+    if (stack[k].is_imm) {
+      materialize(k);
+    }
+    return stack[k].value;
+  }
+  StackEntry pop() {
+    auto entry = stack.back();
+    stack.pop_back();
+    return entry;
+  }
+  void push_slot(i32 slot) { stack.push_back(StackEntry{false, slot}); }
+  void push_result() { push_slot(reg(depth())); }
+  void drop(i32 n) { stack.resize(depth() - n); }
+
+  void finish_function() {
+    if (enter_index >= 0) {
+      out.code[enter_index].c = n_regs;
+    }
+  }
+
+  // emits a load of a captured variable or global into register k
+  void load(i32 k, u32 kind, i32 index) {
+    switch (kind) {
+    case GLOBAL:
+      emit(ROp::LDG, reg(k), index);
+      break;
+    case CAPTURED:
+      emit(ROp::LDC, reg(k), index, closure_slot());
+      break;
+    default:
+      emit(ROp::MOV, reg(k), frame_slot(kind, index));
+    }
+  }
+
+  // stack ops leave their results in registers, so they are canonical
+  void stack_op(ROp op, i32 pops, i32 pushes, i32 b = 0, i32 c = 0,
+                char const *str = nullptr) {
+    flush();
+    auto index = emit(op, reg(depth()), b, c);
+    out.code[index].d.str = str;
+    drop(pops);
+    for (i32 i = 0; i < pushes; i++) {
+      push_result();
+    }
+  }
+
+  static bool foldable(i32 r, BinopLabel label) {
+    return !((label == BinopLabel::DIV || label == BinopLabel::MOD) &&
+             UNBOX(r) == 0);
+  }
+
+  void translate_binop(i32 label, Insn const *next) {
+    auto r = pop();
+    auto l = pop();
+    bool branch = next != nullptr &&
+                  (next->op == Op::CJMPZ || next->op == Op::CJMPNZ) &&
+                  !is_label[offset_of(next)];
+    if (l.is_imm && r.is_imm && foldable(r.value, (BinopLabel)label)) {
+      stack.push_back(StackEntry{
+          true, BOX(arithm_op(UNBOX(l.value), UNBOX(r.value),
+                              (BinopLabel)label))});
+      return; // a following CJMP sees a constant and is folded as well
+    }
+    i32 dst = reg(depth());
+    if (l.is_imm) {
+      emit(ROp::LDI, dst, l.value);
+      l = StackEntry{false, dst};
+    }
+    if (branch) {
+      flush();
+      bool is_z = next->op == Op::CJMPZ;
+      if (r.is_imm) {
+        emit_jump(is_z ? ROp::BR_BINOPI_Z : ROp::BR_BINOPI_NZ, l.value,
+                  UNBOX(r.value), label, next->c.target);
+      } else {
+        emit_jump(is_z ? ROp::BR_BINOP_Z : ROp::BR_BINOP_NZ, l.value, r.value,
+                  label, next->c.target);
+      }
+      skip_next = true;
+      return;
+    }
+    if (r.is_imm) {
+      emit(ROp::BINOPI, dst, l.value, UNBOX(r.value), label);
+    } else {
+      emit(ROp::BINOP, dst, l.value, r.value, label);
+    }
+    push_result();
+  }
+
+  void translate_cjmp(Insn const &insn) {
+    auto cond = pop();
+    flush();
+    if (cond.is_imm) {
+      bool taken = (UNBOX(cond.value) == 0) == (insn.op == Op::CJMPZ);
+      if (taken) {
+        emit_jump(ROp::JMP, 0, 0, 0, insn.c.target);
+        dead = true;
+      }
+      return;
+    }
+    emit_jump(insn.op == Op::CJMPZ ? ROp::CJMPZ : ROp::CJMPNZ, 0, cond.value,
+              0, insn.c.target);
+  }
+
+  bool skip_next = false;
+
+  // returns the index of the last consumed predecoded instruction
+  size_t translate_instruction(size_t i) {
+    Insn const &insn = program.code[i];
+    Insn const *next =
+        i + 1 < program.code.size() ? &program.code[i + 1] : nullptr;
+    i32 offset = program.offsets[i];
+
+    if (insn.op == Op::BEGIN || insn.op == Op::CBEGIN) {
+      finish_function();
+      n_args = insn.a;
+      n_locals = insn.b;
+      n_regs = 0;
+      stack.clear();
+      index_at[offset] = (i32)out.code.size();
+      enter_index = (i32)emit(ROp::ENTER, n_args, n_locals);
+      dead = false;
+      return i;
+    }
+    if (is_label[offset] || dead) {
+      if (!dead) {
+        flush();
+      }
+      stack.clear();
+      for (i32 k = 0; k < depth_at[offset]; k++) {
+        push_result();
+      }
+      dead = false;
+    } else if (depth() != depth_at[offset]) {
+      error("register translation: depth mismatch at 0x%.8x", offset);
+    }
+    index_at[offset] = (i32)out.code.size();
+
+    switch (insn.op) {
+    case Op::CONST:
+      stack.push_back(StackEntry{true, BOX(insn.a)});
+      break;
+    case Op::OBJECT: // constant objects never move
+      stack.push_back(StackEntry{true, (i32)insn.c.object});
+      break;
+    case Op::LD:
+      if (insn.a == LOCAL || insn.a == ARG) {
+        push_slot(frame_slot(insn.a, insn.b));
+      } else {
+        load(depth(), insn.a, insn.b);
+        push_result();
+      }
+      break;
+    case Op::ST: {
+      i32 top = depth() - 1;
+      if (insn.a == LOCAL || insn.a == ARG) {
+        i32 slot = frame_slot(insn.a, insn.b);
+        if (stack[top].is_imm || stack[top].value != slot) {
+          clobber(slot);
+          emit(stack[top].is_imm ? ROp::LDI : ROp::MOV, slot,
+               stack[top].value);
+        }
+      } else if (insn.a == GLOBAL) {
+        emit(ROp::STG, insn.b, slot_of(top));
+      } else {
+        emit(ROp::STC, insn.b, slot_of(top), closure_slot());
+      }
+      break;
+    }
+    case Op::LDA: {
+      i32 dst = reg(depth());
+      if (insn.a == LOCAL || insn.a == ARG) {
+        emit(ROp::LEA_FRAME, dst, frame_slot(insn.a, insn.b));
+      } else if (insn.a == GLOBAL) {
+        emit(ROp::LEA_GLOBAL, dst, insn.b);
+      } else {
+        emit(ROp::LEA_CAPT, dst, insn.b, closure_slot());
+      }
+      push_result();
+      push_slot(dst);
+      break;
+    }
+    case Op::DROP:
+      drop(1);
+      break;
+    case Op::DUP:
+      if (is_canonical(depth() - 1)) {
+        push_slot(reg(depth() - 1));
+      } else {
+        stack.push_back(stack.back());
+      }
+      break;
+    case Op::BINOP:
+      translate_binop(insn.a, next);
+      if (skip_next) {
+        skip_next = false;
+        return i + 1;
+      }
+      break;
+    case Op::JMP:
+      flush();
+      emit_jump(ROp::JMP, 0, 0, 0, insn.c.target);
+      dead = true;
+      break;
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+      translate_cjmp(insn);
+      break;
+    case Op::END: {
+      i32 value = slot_of(depth() - 1);
+      emit(ROp::RET, n_args, value);
+      dead = true;
+      break;
+    }
+    case Op::ELEM: {
+      auto index = pop();
+      i32 obj = slot_of(depth() - 1);
+      drop(1);
+      if (index.is_imm) {
+        emit(ROp::ELEMI, reg(depth()), obj, index.value);
+      } else {
+        emit(ROp::ELEM, reg(depth()), obj, index.value);
+      }
+      push_result();
+      break;
+    }
+    case Op::TAG: {
+      i32 value = slot_of(depth() - 1);
+      drop(1);
+      emit(ROp::TAG, reg(depth()), value, insn.a, insn.b);
+      push_result();
+      break;
+    }
+    case Op::ARRAY: {
+      i32 value = slot_of(depth() - 1);
+      drop(1);
+      emit(ROp::ARRAY, reg(depth()), value, insn.a);
+      push_result();
+      break;
+    }
+    case Op::PATT: {
+      if (insn.a == (i32)Patt::STR_EQ_TAG) {
+        i32 x = slot_of(depth() - 1), y = slot_of(depth() - 2);
+        drop(2);
+        emit(ROp::PATT_STR, reg(depth()), x, y);
+      } else {
+        i32 value = slot_of(depth() - 1);
+        drop(1);
+        emit(ROp::PATT, reg(depth()), value, insn.a);
+      }
+      push_result();
+      break;
+    }
+    case Op::LLENGTH: {
+      i32 value = slot_of(depth() - 1);
+      drop(1);
+      emit(ROp::LLENGTH, reg(depth()), value);
+      push_result();
+      break;
+    }
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+      flush();
+      emit_jump(ROp::CALL, reg(depth()), insn.a, 0, insn.c.target);
+      drop(insn.a);
+      push_result();
+      break;
+    case Op::CALLC:
+    case Op::TAILCALLC:
+      stack_op(ROp::CALLC, insn.a + 1, 1, insn.a);
+      break;
+    case Op::CLOSURE: {
+      flush();
+      i32 d = depth();
+      for (i32 k = 0; k < insn.b; k++) {
+        load(d + k, insn.c.captures[k].kind, insn.c.captures[k].index);
+        push_result();
+      }
+      stack_op(ROp::CLOSURE, insn.b, 1, insn.b, insn.a);
+      break;
+    }
+    case Op::STRING:
+      stack_op(ROp::STRING, 0, 1, 0, 0, insn.c.str);
+      break;
+    case Op::SEXP:
+      stack_op(ROp::SEXP, insn.a, 1, insn.a, insn.b);
+      break;
+    case Op::STI:
+      stack_op(ROp::STI, 2, 1);
+      break;
+    case Op::STA:
+      stack_op(ROp::STA, 3, 1);
+      break;
+    case Op::SWAP:
+      stack_op(ROp::SWAP, 2, 2);
+      break;
+    case Op::LREAD:
+      stack_op(ROp::LREAD, 0, 1);
+      break;
+    case Op::LWRITE:
+      stack_op(ROp::LWRITE, 1, 1);
+      break;
+    case Op::LSTRING:
+      stack_op(ROp::LSTRING, 1, 1);
+      break;
+    case Op::BARRAY:
+      stack_op(ROp::BARRAY, insn.a, 1, insn.a);
+      break;
+    case Op::FAILURE:
+      emit(ROp::FAILURE);
+      dead = true;
+      break;
+    case Op::STOP:
+      emit(ROp::STOP);
+      dead = true;
+      break;
+    default:
+      error("register translation: unsupported instruction %s",
+            op_names[(u8)insn.op]);
+    }
+    return i;
+  }
+};
@@ -32,6 +32,7 @@ extern "C" int Barray_patt(void *d, int n);
 
 extern "C" size_t *__gc_stack_top, *__gc_stack_bottom;
 extern "C" void __init();
+extern "C" void *gc_alloc(size_t); // runs a collection
 
 using u32 = uint32_t;
 using i32 = int32_t;
@@ -42,6 +43,16 @@ using u8 = uint8_t;
 static i32 constexpr N_GLOBAL = 1000;
 static i32 constexpr STACK_SIZE = 100000;
 
+// The saved n_args word of a frame also remembers whether the frame was
+// entered through CALLC, in which case END drops the closure as well.
+static u32 constexpr CLOSURE_FRAME_SHIFT = 16;
+// Set for frames whose result is stored into the tail of a cons cell instead
+// of being returned (tail recursion modulo cons, see threaded-interpreter.h).
+static u32 constexpr DPS_FRAME_SHIFT = 17;
+// Set for frames of a memoized function whose arguments are all ints, END
+// records their result (see memoization.h).
+static u32 constexpr MEMO_FRAME_SHIFT = 18;
+
 // stored on the stack (see std::array)
 template <typename T, bool Check> struct stack {
   std::array<T, STACK_SIZE> data; // zero-initialized on the stack
@@ -103,8 +114,10 @@ static inline void *myBarray(int n, stack<u32, Check> &ops_stack) {
 extern "C" void *alloc_sexp(int members);
 extern "C" int LtagHash(char *);
 
+// tag_hash is the result of LtagHash for the tag
 template <bool Check>
-static inline void *myBsexp(int n, stack<u32, Check> &ops_stack, char const *name) {
+static inline void *myBsexp_hashed(int n, stack<u32, Check> &ops_stack,
+                                   int tag_hash) {
   int i;
   int ai;
   data *r;
@@ -117,13 +130,25 @@ static inline void *myBsexp(int n, stack<u32, Check> &ops_stack, char const *nam
     ((int *)r->contents)[i] = ai;
   }
 
-  ((sexp *)r)->tag =
-      UNBOX(LtagHash((char *)name)); // cast for runtime compatibility
+  ((sexp *)r)->tag = UNBOX(tag_hash);
 
   return (int *)r->contents;
 }
 
+template <bool Check>
+static inline void *myBsexp(int n, stack<u32, Check> &ops_stack, char const *name) {
+  return myBsexp_hashed(n, ops_stack,
+                        LtagHash((char *)name)); // cast for runtime compatibility
+}
+
 extern "C" void *alloc_closure(int);
+extern "C" void init_constant_area(size_t words);
+extern "C" void *alloc_constant_string(int len);
+extern "C" void *alloc_constant_sexp(int members);
+extern "C" void *alloc_constant_closure(int captured);
+extern "C" size_t string_size(size_t len);
+extern "C" size_t sexp_size(size_t members);
+extern "C" size_t closure_size(size_t sz);
 
 template <bool Check>
 static inline void *myBclosure(int n, stack<u32, Check> &ops_stack, void *addr) {
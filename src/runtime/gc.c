@@ -595,6 +595,71 @@ extern void __shutdown (void) {
   __gc_stack_bottom = 0;
 }
 
+// ============================================================================
+//                          Constant area
+// ============================================================================
+// Immutable objects that live as long as the program does are allocated once
+// in a separate chunk. It is not a part of the heap, so is_valid_heap_pointer
+// is false for them: the GC never marks, moves or frees them. They must not
+// refer to heap objects.
+static memory_chunk constant_area;
+
+void init_constant_area (size_t words) {
+  if (constant_area.begin != NULL) { munmap(constant_area.begin, WORDS_TO_BYTES(constant_area.size)); }
+  constant_area.begin = constant_area.end = constant_area.current = NULL;
+  constant_area.size                                                 = 0;
+  if (words == 0) { return; }
+  constant_area.begin = mmap(NULL,
+                             WORDS_TO_BYTES(words),
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                             -1,
+                             0);
+  if (constant_area.begin == MAP_FAILED) {
+    perror("ERROR: init_constant_area: mmap failed\n");
+    exit(1);
+  }
+  constant_area.end     = constant_area.begin + words;
+  constant_area.size    = words;
+  constant_area.current = constant_area.begin;
+}
+
+bool is_constant_pointer (const size_t *p) {
+  return !UNBOXED(p) && (size_t)constant_area.begin <= (size_t)p
+         && (size_t)p < (size_t)constant_area.current;
+}
+
+static void *alloc_constant (size_t size) {
+  size = BYTES_TO_WORDS(size);
+  if (constant_area.current + size > constant_area.end) {
+    perror("ERROR: alloc_constant: constant area is exhausted\n");
+    exit(1);
+  }
+  data *obj = (data *)constant_area.current;
+  constant_area.current += size;
+  obj->forward_address = 0;
+  return obj;
+}
+
+void *alloc_constant_string (int len) {
+  data *obj        = alloc_constant(string_size(len));
+  obj->data_header = STRING_TAG | (len << 3);
+  return obj;
+}
+
+void *alloc_constant_sexp (int members) {
+  sexp *obj        = alloc_constant(sexp_size(members));
+  obj->data_header = SEXP_TAG | (members << 3);
+  obj->tag         = 0;
+  return obj;
+}
+
+void *alloc_constant_closure (int captured) {
+  data *obj        = alloc_constant(closure_size(captured));
+  obj->data_header = CLOSURE_TAG | (captured << 3);
+  return obj;
+}
+
 void clear_extra_roots (void) { extra_roots.current_free = 0; }
 
 void push_extra_root (void **p) {
@@ -248,4 +248,16 @@ void *alloc_array (int len);
 void *alloc_sexp (int members);
 void *alloc_closure (int captured);
 
+// ============================================================================
+//                          Constant area
+// ============================================================================
+// Non-moving area for immutable objects shared by the whole program (literals
+// and the like), see gc.c. The sizes below are in words; the allocation
+// functions have the same contract as their heap counterparts.
+void init_constant_area (size_t words);
+bool is_constant_pointer (const size_t *p);
+void *alloc_constant_string (int len);
+void *alloc_constant_sexp (int members);
+void *alloc_constant_closure (int captured);
+
 #endif
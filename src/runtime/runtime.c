@@ -943,6 +943,7 @@ extern int Bsexp_tag_patt (void *x) {
 extern void *Bsta (void *v, int i, void *x) {
   if (UNBOXED(i)) {
     ASSERT_BOXED(".sta:3", x);
+    if (is_constant_pointer(x)) { failure("attempt to modify a constant object\n"); }
     data *d = TO_DATA(x);
 
     switch (TAG(d->data_header)) {
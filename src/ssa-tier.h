@@ -0,0 +1,1026 @@
+#pragma once
+
+#include "control-flow.h"
+#include "executing-visitor.h"
+#include "predecoding-visitor.h"
+#include "register-ir.h"
+#include "runtime-decl.h"
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Optimizing tier of the register translation, used for functions with
+// loops. A function is lifted from the predecoded stack code into SSA form
+// over the control-flow graph: stack slots, locals and arguments become
+// values, with phis at every join that are removed again when trivial. The
+// depths verified by check_depth give the shape of every join. Then:
+//   - values are numbered over the dominator tree, so pure computations that
+//     a dominating one already did are reused, and constants are folded;
+//   - loads of globals are reused within a block until a store or a call;
+//   - loop-invariant computations, loads of globals that the loop neither
+//     stores nor may change through a call, and Llength of invariant
+//     values, are hoisted onto the edges entering the loop;
+//   - values nothing uses are dropped, so stores into locals that are never
+//     read again cost nothing.
+// The result is lowered to register IR with a register per value, zeroed by
+// ENTER together with the rest of the frame so that the GC only ever scans
+// values of this activation; phis become parallel copies on the incoming
+// edges. Instructions that run on the memory stack take their operands from a
+// scratch area below the registers. Functions with LDA or STI, whose locals
+// may be written through references, are left to the plain translation.
+class SsaTier {
+public:
+  i32 functions = 0; // translated
+  i32 numbered = 0;  // values replaced by an equal one
+  i32 hoisted = 0;
+
+  SsaTier(ControlFlowGraph const &cfg, PredecodedProgram const &program,
+          std::vector<i32> const &depth_at)
+      : cfg(cfg), program(program), depth_at(depth_at) {}
+
+  // Translates the function at code offset `begin` into `out`, starting
+  // with its ENTER, if it has a loop and no unsupported instructions. Calls
+  // are added to `call_fixups` with the code offset of the callee, jumps to
+  // `jump_fixups` with the index of the target in out.code.
+  bool translate(i32 begin, RegisterProgram &out,
+                 std::vector<std::pair<size_t, i32>> &call_fixups,
+                 std::vector<std::pair<size_t, size_t>> &jump_fixups) {
+    f = cfg.function_at[begin];
+    if (f == ControlFlowGraph::NONE || !is_supported()) {
+      return false;
+    }
+    Insn const *enter = program.insn_at[begin];
+    n_args = enter->a;
+    n_locals = enter->b;
+    values.clear();
+    blocks.assign(cfg.blocks.size(), SsaBlock{});
+    hoisted_at.clear();
+    build();
+    remove_trivial_phis();
+    number_values();
+    remove_trivial_phis();
+    hoist_invariants();
+    mark_live();
+    lower(out, call_fixups, jump_fixups);
+    functions++;
+    return true;
+  }
+
+private:
+  enum class SsaOp : u8 {
+    PARAM, // argument a on entry
+    CONST, // the word a: a boxed int, a constant object, or the raw 0 of an
+           // unassigned local
+    PHI,   // one argument per predecessor of the block, in cfg.preds order
+    BINOP, // a is the label
+    LDG,   // a is the index
+    STG,
+    LDC,
+    STC,
+    ELEM,
+    TAG,   // a fields, b is the tag hash
+    ARRAY, // a elements
+    PATT,  // a is the Patt kind, STR_EQ_TAG has the second operand first
+    LLENGTH,
+    STACK, // `insn` runs on the memory stack, see ROp::CALL
+  };
+
+  struct SsaValue {
+    SsaOp op;
+    i32 block;
+    i32 a = 0;
+    i32 b = 0;
+    Insn const *insn = nullptr;
+    std::vector<i32> args; // the deepest stack entry first
+    i32 same_as = -1;      // replaced by an equal value
+    i32 hoisted_to = -1;   // header of the loop it was hoisted out of
+    bool live = false;
+    i32 reg = -1;
+    i32 uses = 0;
+  };
+
+  struct SsaBlock {
+    std::vector<i32> values; // in execution order, phis first
+    Insn const *last = nullptr;
+    i32 operand = -1; // condition of CJMPz/CJMPnz, result of END
+    std::vector<i32> exit; // arguments, locals, then the stack
+  };
+
+  ControlFlowGraph const &cfg;
+  PredecodedProgram const &program;
+  std::vector<i32> const &depth_at;
+  i32 f = 0;
+  i32 n_args = 0;
+  i32 n_locals = 0;
+  std::vector<SsaValue> values;
+  std::vector<SsaBlock> blocks; // indexed like cfg.blocks
+  std::map<i32, std::vector<i32>> hoisted_at; // loop header -> values
+
+  static bool is_supported(Op op) {
+    switch (op) {
+    case Op::BEGIN:
+    case Op::CBEGIN:
+    case Op::CONST:
+    case Op::OBJECT:
+    case Op::LD:
+    case Op::ST:
+    case Op::DROP:
+    case Op::DUP:
+    case Op::SWAP:
+    case Op::BINOP:
+    case Op::JMP:
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+    case Op::END:
+    case Op::ELEM:
+    case Op::TAG:
+    case Op::ARRAY:
+    case Op::PATT:
+    case Op::LLENGTH:
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+    case Op::CALLC:
+    case Op::TAILCALLC:
+    case Op::CLOSURE:
+    case Op::STRING:
+    case Op::SEXP:
+    case Op::STA:
+    case Op::LREAD:
+    case Op::LWRITE:
+    case Op::LSTRING:
+    case Op::BARRAY:
+    case Op::FAILURE:
+    case Op::STOP:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  bool is_supported() const {
+    auto const &function = cfg.functions[f];
+    i32 entry = function.order[0];
+    if (cfg.pred_begin[entry] != cfg.pred_begin[entry + 1]) {
+      return false;
+    }
+    bool has_loop = false;
+    bool ok = true;
+    for (i32 b : function.order) {
+      has_loop = has_loop || cfg.blocks[b].loop_depth > 0;
+      cfg.for_each_insn(b, [&](i32 offset) {
+        Insn const *insn = program.insn_starting_at(offset);
+        ok = ok && (insn == nullptr || is_supported(insn->op));
+      });
+    }
+    return has_loop && ok;
+  }
+
+  i32 resolve(i32 v) const {
+    while (values[v].same_as >= 0) {
+      v = values[v].same_as;
+    }
+    return v;
+  }
+
+  i32 add(SsaOp op, i32 block, std::vector<i32> args = {}, i32 a = 0,
+          i32 b = 0, Insn const *insn = nullptr) {
+    values.push_back(SsaValue{op, block, a, b, insn, std::move(args)});
+    blocks[block].values.push_back((i32)values.size() - 1);
+    return (i32)values.size() - 1;
+  }
+
+  bool is_const(i32 v) const { return values[v].op == SsaOp::CONST; }
+
+  static bool may_fail(SsaValue const &v) {
+    auto label = (BinopLabel)v.a;
+    return v.op == SsaOp::ELEM || v.op == SsaOp::LLENGTH ||
+           (v.op == SsaOp::BINOP &&
+            (label == BinopLabel::DIV || label == BinopLabel::MOD));
+  }
+
+  // calls may store into any global or captured variable, and so may STA
+  // through a reference
+  static bool may_store(Insn const *insn) {
+    Op op = insn->op;
+    return op == Op::CALL || op == Op::TAILCALL || op == Op::CONSCALL ||
+           op == Op::CALLC || op == Op::TAILCALLC || op == Op::STA;
+  }
+
+  static i32 pops_of(Insn const &insn) {
+    switch (insn.op) {
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+    case Op::SEXP:
+    case Op::BARRAY:
+      return insn.a;
+    case Op::CALLC:
+    case Op::TAILCALLC:
+      return insn.a + 1;
+    case Op::STA:
+      return 3;
+    case Op::LWRITE:
+    case Op::LSTRING:
+      return 1;
+    default:
+      return 0; // STRING, LREAD
+    }
+  }
+
+  void build() {
+    auto const &function = cfg.functions[f];
+    i32 entry = function.order[0];
+    struct Phis {
+      i32 block;
+      i32 first;
+      size_t n;
+    };
+    std::vector<Phis> phi_blocks;
+    for (i32 b : function.order) {
+      std::vector<i32> state;
+      i32 n_preds = cfg.pred_begin[b + 1] - cfg.pred_begin[b];
+      if (b == entry) {
+        for (i32 i = 0; i < n_args; i++) {
+          state.push_back(add(SsaOp::PARAM, b, {}, i));
+        }
+        i32 zero = n_locals > 0 ? add(SsaOp::CONST, b, {}, 0) : -1;
+        state.insert(state.end(), n_locals, zero);
+      } else if (n_preds == 1) {
+        state = blocks[cfg.preds[cfg.pred_begin[b]]].exit;
+      } else {
+        i32 n_vars = n_args + n_locals + depth_at[cfg.blocks[b].begin];
+        phi_blocks.push_back({b, (i32)values.size(), (size_t)n_vars});
+        for (i32 i = 0; i < n_vars; i++) {
+          state.push_back(add(SsaOp::PHI, b));
+        }
+      }
+      lift_block(b, state);
+      blocks[b].exit = std::move(state);
+    }
+    for (auto [b, first, n] : phi_blocks) {
+      for (i32 p = cfg.pred_begin[b]; p < cfg.pred_begin[b + 1]; p++) {
+        auto const &exit = blocks[cfg.preds[p]].exit;
+        if (exit.size() != n) {
+          error("ssa: stack depth mismatch");
+        }
+        for (size_t i = 0; i < exit.size(); i++) {
+          values[first + i].args.push_back(exit[i]);
+        }
+      }
+    }
+  }
+
+  void lift_block(i32 b, std::vector<i32> &state) {
+    size_t const bottom = n_args + n_locals;
+    std::map<i32, i32> globals;  // known values of globals in this block
+    std::map<i32, i32> captured; // and of captured variables
+    auto pop = [&]() {
+      if (state.size() <= bottom) {
+        error("ssa: stack underflow");
+      }
+      i32 v = state.back();
+      state.pop_back();
+      return v;
+    };
+    auto pop_n = [&](i32 n) {
+      std::vector<i32> args(state.end() - n, state.end());
+      for (i32 k = 0; k < n; k++) {
+        pop();
+      }
+      return args;
+    };
+    auto push = [&](i32 v) { state.push_back(v); };
+    auto var = [&](u32 kind, i32 index) -> i32 & {
+      i32 limit = kind == LOCAL ? n_locals : n_args;
+      if (index < 0 || index >= limit) {
+        error("ssa: variable %d is out of range", index);
+      }
+      return state[kind == LOCAL ? n_args + index : index];
+    };
+    auto load = [&](u32 kind, i32 index) {
+      if (kind == LOCAL || kind == ARG) {
+        return var(kind, index);
+      }
+      auto &known = kind == GLOBAL ? globals : captured;
+      auto it = known.find(index);
+      if (it != known.end()) {
+        return it->second;
+      }
+      i32 v = add(kind == GLOBAL ? SsaOp::LDG : SsaOp::LDC, b, {}, index);
+      known[index] = v;
+      return v;
+    };
+
+    cfg.for_each_insn(b, [&](i32 offset) {
+      Insn const *insn = program.insn_starting_at(offset);
+      if (insn == nullptr) {
+        return;
+      }
+      blocks[b].last = insn;
+      switch (insn->op) {
+      case Op::BEGIN:
+      case Op::CBEGIN:
+      case Op::JMP:
+      case Op::FAILURE:
+      case Op::STOP:
+        break;
+      case Op::CONST:
+        push(add(SsaOp::CONST, b, {}, BOX(insn->a)));
+        break;
+      case Op::OBJECT: // constant objects never move
+        push(add(SsaOp::CONST, b, {}, (i32)insn->c.object));
+        break;
+      case Op::LD:
+        push(load(insn->a, insn->b));
+        break;
+      case Op::ST: {
+        i32 v = state.back();
+        if (insn->a == LOCAL || insn->a == ARG) {
+          var(insn->a, insn->b) = v;
+        } else if (insn->a == GLOBAL) {
+          add(SsaOp::STG, b, {v}, insn->b);
+          globals[insn->b] = v;
+        } else {
+          add(SsaOp::STC, b, {v}, insn->b);
+          captured[insn->b] = v;
+        }
+        break;
+      }
+      case Op::DROP:
+        pop();
+        break;
+      case Op::DUP:
+        push(state.back());
+        break;
+      case Op::SWAP: {
+        i32 top = pop();
+        i32 second = pop();
+        push(top);
+        push(second);
+        break;
+      }
+      case Op::BINOP:
+        push(binop(b, insn->a, pop_n(2)));
+        break;
+      case Op::ELEM:
+        push(add(SsaOp::ELEM, b, pop_n(2)));
+        break;
+      case Op::TAG:
+        push(add(SsaOp::TAG, b, pop_n(1), insn->a, insn->b));
+        break;
+      case Op::ARRAY:
+        push(add(SsaOp::ARRAY, b, pop_n(1), insn->a));
+        break;
+      case Op::PATT:
+        push(add(SsaOp::PATT, b,
+                 pop_n(insn->a == (i32)Patt::STR_EQ_TAG ? 2 : 1), insn->a));
+        break;
+      case Op::LLENGTH:
+        push(add(SsaOp::LLENGTH, b, pop_n(1)));
+        break;
+      case Op::CJMPZ:
+      case Op::CJMPNZ:
+      case Op::END:
+        blocks[b].operand = pop();
+        break;
+      case Op::CLOSURE: {
+        std::vector<i32> args;
+        for (i32 k = 0; k < insn->b; k++) {
+          auto const &capture = insn->c.captures[k];
+          args.push_back(load(capture.kind, capture.index));
+        }
+        push(add(SsaOp::STACK, b, std::move(args), 0, 0, insn));
+        break;
+      }
+      case Op::CALL:
+      case Op::TAILCALL:
+      case Op::CONSCALL:
+      case Op::CALLC:
+      case Op::TAILCALLC:
+      case Op::STRING:
+      case Op::SEXP:
+      case Op::STA:
+      case Op::LREAD:
+      case Op::LWRITE:
+      case Op::LSTRING:
+      case Op::BARRAY:
+        push(add(SsaOp::STACK, b, pop_n(pops_of(*insn)), 0, 0, insn));
+        if (may_store(insn)) {
+          globals.clear();
+          captured.clear();
+        }
+        break;
+      default:
+        error("ssa: unexpected %s", op_names[(u8)insn->op]);
+      }
+    });
+  }
+
+  static bool foldable(i32 r, BinopLabel label) {
+    return !((label == BinopLabel::DIV || label == BinopLabel::MOD) &&
+             UNBOX(r) == 0);
+  }
+
+  i32 binop(i32 b, i32 label, std::vector<i32> args) {
+    i32 l = args[0], r = args[1];
+    if (is_const(l) && is_const(r) &&
+        foldable(values[r].a, (BinopLabel)label)) {
+      i32 word = BOX(arithm_op(UNBOX(values[l].a), UNBOX(values[r].a),
+                               (BinopLabel)label));
+      return add(SsaOp::CONST, b, {}, word);
+    }
+    return add(SsaOp::BINOP, b, std::move(args), label);
+  }
+
+  // a phi whose arguments are all the same value or the phi itself is that
+  // value
+  void remove_trivial_phis() {
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (size_t v = 0; v < values.size(); v++) {
+        auto &value = values[v];
+        if (value.op != SsaOp::PHI || value.same_as >= 0) {
+          continue;
+        }
+        i32 same = -1;
+        bool trivial = true;
+        for (i32 arg : value.args) {
+          arg = resolve(arg);
+          if (arg == (i32)v || arg == same) {
+            continue;
+          }
+          trivial = same < 0;
+          same = arg;
+          if (!trivial) {
+            break;
+          }
+        }
+        if (trivial && same >= 0) {
+          value.same_as = same;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  static bool is_numbered(SsaValue const &v) {
+    switch (v.op) {
+    case SsaOp::CONST:
+    case SsaOp::BINOP:
+    case SsaOp::TAG:
+    case SsaOp::ARRAY:
+    case SsaOp::LLENGTH:
+      return true;
+    case SsaOp::PATT: // strings may change under STA
+      return v.a != (i32)Patt::STR_EQ_TAG;
+    default:
+      return false;
+    }
+  }
+
+  // Replaces every pure value with an equal one computed in a dominating
+  // block (or earlier in the same block). Blocks are visited in reverse
+  // postorder, so dominators come first.
+  void number_values() {
+    std::map<std::vector<i32>, std::vector<i32>> table;
+    for (i32 b : cfg.functions[f].order) {
+      for (i32 v : blocks[b].values) {
+        auto &value = values[v];
+        for (i32 &arg : value.args) {
+          arg = resolve(arg);
+        }
+        if (value.same_as >= 0 || !is_numbered(value)) {
+          continue;
+        }
+        if (value.op == SsaOp::BINOP && is_const(value.args[0]) &&
+            is_const(value.args[1]) &&
+            foldable(values[value.args[1]].a, (BinopLabel)value.a)) {
+          // folded once its arguments became constants
+          value.op = SsaOp::CONST;
+          value.a = BOX(arithm_op(UNBOX(values[value.args[0]].a),
+                                  UNBOX(values[value.args[1]].a),
+                                  (BinopLabel)value.a));
+          value.args.clear();
+        }
+        std::vector<i32> key{(i32)value.op, value.a, value.b};
+        key.insert(key.end(), value.args.begin(), value.args.end());
+        auto &candidates = table[key];
+        for (i32 w : candidates) {
+          if (cfg.dominates(values[w].block, b)) {
+            value.same_as = w;
+            numbered++;
+            break;
+          }
+        }
+        if (value.same_as < 0) {
+          candidates.push_back(v);
+        }
+      }
+    }
+  }
+
+  bool is_hoistable(SsaValue const &v) const {
+    return is_numbered(v) || v.op == SsaOp::LDG || v.op == SsaOp::ELEM;
+  }
+
+  // Hoists the invariant values of every loop, innermost loops first, onto
+  // the edges entering the loop header. Values that may fail are only
+  // hoisted from the header before any effect, so they run exactly when
+  // they would have run before, just earlier.
+  void hoist_invariants() {
+    std::vector<Loop const *> loops;
+    for (auto const &loop : cfg.loops) {
+      if (cfg.blocks[loop.header].function == f) {
+        loops.push_back(&loop);
+      }
+    }
+    std::sort(loops.begin(), loops.end(), [](Loop const *a, Loop const *b) {
+      return a->blocks.size() < b->blocks.size();
+    });
+    std::vector<bool> in_loop(cfg.blocks.size(), false);
+    for (Loop const *loop : loops) {
+      i32 header = loop->header;
+      for (i32 b : loop->blocks) {
+        in_loop[b] = true;
+      }
+      bool may_store = false;
+      std::vector<i32> stored; // globals
+      for (i32 b : loop->blocks) {
+        for (i32 v : blocks[b].values) {
+          auto const &value = values[v];
+          if (value.op == SsaOp::STACK) {
+            may_store = may_store || SsaTier::may_store(value.insn);
+          } else if (value.op == SsaOp::STG) {
+            stored.push_back(value.a);
+          }
+        }
+      }
+      auto is_outside = [&](i32 v) {
+        v = resolve(v);
+        return !in_loop[values[v].block] || values[v].hoisted_to == header;
+      };
+      for (i32 b : cfg.functions[f].order) {
+        if (!in_loop[b]) {
+          continue;
+        }
+        bool effects = false;
+        for (i32 v : blocks[b].values) {
+          auto &value = values[v];
+          bool effect = value.op == SsaOp::STACK || value.op == SsaOp::STG ||
+                        value.op == SsaOp::STC || may_fail(value);
+          if (value.same_as >= 0 || value.hoisted_to >= 0 ||
+              !is_hoistable(value) ||
+              !std::all_of(value.args.begin(), value.args.end(),
+                           is_outside) ||
+              (may_fail(value) && (b != header || effects)) ||
+              ((value.op == SsaOp::LDG || value.op == SsaOp::ELEM) &&
+               may_store) ||
+              (value.op == SsaOp::LDG &&
+               std::count(stored.begin(), stored.end(), value.a) > 0)) {
+            effects = effects || effect;
+            continue;
+          }
+          value.hoisted_to = header;
+          hoisted_at[header].push_back(v);
+          hoisted += value.op != SsaOp::CONST;
+        }
+      }
+      for (i32 b : loop->blocks) {
+        in_loop[b] = false;
+      }
+    }
+  }
+
+  // Marks the values the effects, the branches and the results depend on.
+  void mark_live() {
+    std::vector<i32> worklist;
+    auto use = [&](i32 v) {
+      v = resolve(v);
+      values[v].uses++;
+      if (!values[v].live) {
+        values[v].live = true;
+        worklist.push_back(v);
+      }
+    };
+    for (i32 b : cfg.functions[f].order) {
+      for (i32 v : blocks[b].values) {
+        auto &value = values[v];
+        if (value.same_as < 0 &&
+            (value.op == SsaOp::STACK || value.op == SsaOp::STG ||
+             value.op == SsaOp::STC || may_fail(value)) &&
+            !value.live) {
+          value.live = true;
+          worklist.push_back(v);
+        }
+      }
+      if (blocks[b].operand >= 0) {
+        use(blocks[b].operand);
+      }
+    }
+    while (!worklist.empty()) {
+      i32 v = worklist.back();
+      worklist.pop_back();
+      for (i32 arg : values[v].args) {
+        use(arg);
+      }
+    }
+  }
+
+  // lowering state
+  RegisterProgram *out = nullptr;
+  std::vector<std::pair<size_t, i32>> *call_fixups = nullptr;
+  std::vector<std::pair<size_t, i32>> jumps;  // to the start of a block
+  std::vector<std::pair<size_t, size_t>> stub_jumps; // to an edge stub
+  std::vector<i32> block_start;
+  i32 n_regs = 0;
+
+  i32 slot(i32 v) const {
+    v = resolve(v);
+    if (values[v].op == SsaOp::PARAM) {
+      return 2 + n_args - values[v].a;
+    }
+    if (values[v].reg < 0) {
+      error("ssa: value %d has no register", v);
+    }
+    return -1 - values[v].reg;
+  }
+  i32 scratch(i32 k) const { return -(n_regs + 1 + k); }
+  i32 temp() const { return -n_regs; } // the last register
+
+  size_t emit(ROp op, i32 a = 0, i32 b = 0, i32 c = 0, i32 d = 0) {
+    RInsn insn{nullptr, op, a, b, c, {}};
+    insn.d.value = d;
+    out->code.push_back(insn);
+    return out->code.size() - 1;
+  }
+
+  // Registers go to the live values that need one: constants only if they
+  // are used outside of an immediate operand.
+  void assign_registers() {
+    std::vector<bool> in_register(values.size(), false);
+    for (size_t v = 0; v < values.size(); v++) {
+      auto const &value = values[v];
+      if (!value.live || value.same_as >= 0) {
+        continue;
+      }
+      for (size_t k = 0; k < value.args.size(); k++) {
+        bool immediate =
+            (value.op == SsaOp::BINOP || value.op == SsaOp::ELEM) && k == 1;
+        if (!immediate && value.op != SsaOp::STACK &&
+            value.op != SsaOp::PHI) {
+          in_register[resolve(value.args[k])] = true;
+        }
+      }
+    }
+    for (i32 b : cfg.functions[f].order) {
+      if (blocks[b].operand >= 0) {
+        in_register[resolve(blocks[b].operand)] = true;
+      }
+    }
+    n_regs = 0;
+    for (size_t v = 0; v < values.size(); v++) {
+      auto &value = values[v];
+      if (!value.live || value.same_as >= 0) {
+        continue;
+      }
+      switch (value.op) {
+      case SsaOp::PARAM:
+      case SsaOp::STG:
+      case SsaOp::STC:
+        break;
+      case SsaOp::CONST:
+        value.reg = in_register[v] ? n_regs++ : -1;
+        break;
+      case SsaOp::STACK:
+        value.reg = value.uses > 0 ? n_regs++ : -1;
+        break;
+      default:
+        value.reg = n_regs++;
+      }
+    }
+    n_regs++; // the temporary of the parallel copies
+  }
+
+  void emit_value(i32 v) {
+    auto const &value = values[v];
+    i32 dst = value.reg >= 0 ? -1 - value.reg : 0;
+    auto arg = [&](size_t k) { return resolve(value.args[k]); };
+    switch (value.op) {
+    case SsaOp::PARAM:
+    case SsaOp::PHI:
+      break;
+    case SsaOp::CONST:
+      if (value.reg >= 0) {
+        emit(ROp::LDI, dst, value.a);
+      }
+      break;
+    case SsaOp::BINOP:
+      if (is_const(arg(1))) {
+        emit(ROp::BINOPI, dst, slot(arg(0)), UNBOX(values[arg(1)].a),
+             value.a);
+      } else {
+        emit(ROp::BINOP, dst, slot(arg(0)), slot(arg(1)), value.a);
+      }
+      break;
+    case SsaOp::LDG:
+      emit(ROp::LDG, dst, value.a);
+      break;
+    case SsaOp::STG:
+      emit(ROp::STG, value.a, slot(arg(0)));
+      break;
+    case SsaOp::LDC:
+      emit(ROp::LDC, dst, value.a, 2 + n_args + 1);
+      break;
+    case SsaOp::STC:
+      emit(ROp::STC, value.a, slot(arg(0)), 2 + n_args + 1);
+      break;
+    case SsaOp::ELEM:
+      if (is_const(arg(1))) {
+        emit(ROp::ELEMI, dst, slot(arg(0)), values[arg(1)].a);
+      } else {
+        emit(ROp::ELEM, dst, slot(arg(0)), slot(arg(1)));
+      }
+      break;
+    case SsaOp::TAG:
+      emit(ROp::TAG, dst, slot(arg(0)), value.a, value.b);
+      break;
+    case SsaOp::ARRAY:
+      emit(ROp::ARRAY, dst, slot(arg(0)), value.a);
+      break;
+    case SsaOp::PATT:
+      if (value.a == (i32)Patt::STR_EQ_TAG) {
+        emit(ROp::PATT_STR, dst, slot(arg(1)), slot(arg(0)));
+      } else {
+        emit(ROp::PATT, dst, slot(arg(0)), value.a);
+      }
+      break;
+    case SsaOp::LLENGTH:
+      emit(ROp::LLENGTH, dst, slot(arg(0)));
+      break;
+    case SsaOp::STACK:
+      emit_stack_op(v);
+      break;
+    }
+  }
+
+  // moves the operands into the scratch area, runs the instruction on the
+  // memory stack and moves the result out of the scratch area
+  void emit_stack_op(i32 v) {
+    auto const &value = values[v];
+    Insn const &insn = *value.insn;
+    i32 n = (i32)value.args.size();
+    for (i32 k = 0; k < n; k++) {
+      i32 arg = resolve(value.args[k]);
+      if (is_const(arg) && values[arg].reg < 0) {
+        emit(ROp::LDI, scratch(k), values[arg].a);
+      } else {
+        emit(ROp::MOV, scratch(k), slot(arg));
+      }
+    }
+    i32 top = scratch(n);
+    switch (insn.op) {
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+      call_fixups->push_back({emit(ROp::CALL, top, insn.a),
+                              program.offsets[insn.c.target -
+                                              program.code.data()]});
+      break;
+    case Op::CALLC:
+    case Op::TAILCALLC:
+      emit(ROp::CALLC, top, insn.a);
+      break;
+    case Op::CLOSURE:
+      emit(ROp::CLOSURE, top, insn.b, insn.a);
+      break;
+    case Op::STRING:
+      out->code[emit(ROp::STRING, top)].d.str = insn.c.str;
+      break;
+    case Op::SEXP:
+      emit(ROp::SEXP, top, insn.a, insn.b);
+      break;
+    case Op::STA:
+      emit(ROp::STA, top);
+      break;
+    case Op::LREAD:
+      emit(ROp::LREAD, top);
+      break;
+    case Op::LWRITE:
+      emit(ROp::LWRITE, top);
+      break;
+    case Op::LSTRING:
+      emit(ROp::LSTRING, top);
+      break;
+    case Op::BARRAY:
+      emit(ROp::BARRAY, top, insn.a);
+      break;
+    default:
+      error("ssa: unexpected %s", op_names[(u8)insn.op]);
+    }
+    if (value.reg >= 0) {
+      emit(ROp::MOV, -1 - value.reg, scratch(0));
+    }
+  }
+
+  bool is_back_edge(i32 p, i32 s) const { return cfg.dominates(s, p); }
+
+  bool has_edge_code(i32 p, i32 s) const {
+    auto it = hoisted_at.find(s);
+    if (it != hoisted_at.end() && !is_back_edge(p, s)) {
+      return true;
+    }
+    for (i32 v : blocks[s].values) {
+      if (values[v].op == SsaOp::PHI && values[v].live &&
+          values[v].same_as < 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // the hoisted values of a loop entered on this edge, then the phi copies
+  void emit_edge_code(i32 p, i32 s) {
+    auto it = hoisted_at.find(s);
+    if (it != hoisted_at.end() && !is_back_edge(p, s)) {
+      for (i32 v : it->second) {
+        if (values[v].live && values[v].same_as < 0) {
+          emit_value(v);
+        }
+      }
+    }
+    i32 k = cfg.pred_begin[s];
+    while (cfg.preds[k] != p) {
+      k++;
+    }
+    k -= cfg.pred_begin[s];
+    struct Copy {
+      i32 dst;
+      i32 src;
+      bool is_imm; // src is a word
+    };
+    std::vector<Copy> copies;
+    for (i32 v : blocks[s].values) {
+      auto const &phi = values[v];
+      if (phi.op != SsaOp::PHI || !phi.live || phi.same_as >= 0) {
+        continue;
+      }
+      i32 arg = resolve(phi.args[k]);
+      if (arg == v) {
+        continue;
+      }
+      if (is_const(arg) && values[arg].reg < 0) {
+        copies.push_back({slot(v), values[arg].a, true});
+      } else if (slot(arg) != slot(v)) {
+        copies.push_back({slot(v), slot(arg), false});
+      }
+    }
+    // a copy is safe once no other pending copy reads its destination, a
+    // cycle is broken through the temporary
+    while (!copies.empty()) {
+      bool progress = false;
+      for (size_t i = 0; i < copies.size(); i++) {
+        bool read = false;
+        for (size_t j = 0; j < copies.size(); j++) {
+          read = read || (j != i && !copies[j].is_imm &&
+                          copies[j].src == copies[i].dst);
+        }
+        if (!read) {
+          emit(copies[i].is_imm ? ROp::LDI : ROp::MOV, copies[i].dst,
+               copies[i].src);
+          copies.erase(copies.begin() + i);
+          progress = true;
+          break;
+        }
+      }
+      if (!progress) {
+        i32 dst = copies.front().dst;
+        emit(ROp::MOV, temp(), dst);
+        for (auto &other : copies) {
+          if (!other.is_imm && other.src == dst) {
+            other.src = temp();
+          }
+        }
+      }
+    }
+  }
+
+  void jump_to_block(i32 s, ROp op = ROp::JMP, i32 a = 0, i32 b = 0,
+                     i32 c = 0) {
+    jumps.push_back({emit(op, a, b, c), s});
+  }
+
+  void lower(RegisterProgram &program_out,
+             std::vector<std::pair<size_t, i32>> &calls,
+             std::vector<std::pair<size_t, size_t>> &jump_fixups) {
+    out = &program_out;
+    call_fixups = &calls;
+    jumps.clear();
+    stub_jumps.clear();
+    assign_registers();
+    auto const &order = cfg.functions[f].order;
+    i32 max_pops = 1;
+    for (auto const &value : values) {
+      if (value.op == SsaOp::STACK) {
+        max_pops = std::max(max_pops, (i32)value.args.size() + 1);
+      }
+    }
+    // the registers are zeroed like locals, the scratch area is not
+    emit(ROp::ENTER, n_args, n_regs, max_pops);
+    block_start.assign(cfg.blocks.size(), -1);
+    std::vector<std::pair<i32, i32>> stubs; // edges with code of their own
+    for (size_t i = 0; i < order.size(); i++) {
+      i32 b = order[i];
+      i32 next = i + 1 < order.size() ? order[i + 1] : ControlFlowGraph::NONE;
+      block_start[b] = (i32)out->code.size();
+      auto const &block = blocks[b];
+      i32 cond = block.operand >= 0 ? resolve(block.operand) : -1;
+      Op last = block.last != nullptr ? block.last->op : Op::JMP;
+      bool is_cjmp = last == Op::CJMPZ || last == Op::CJMPNZ;
+      bool fused = is_cjmp && values[cond].op == SsaOp::BINOP &&
+                   values[cond].block == b && values[cond].uses == 1 &&
+                   values[cond].hoisted_to < 0 && !may_fail(values[cond]);
+      for (i32 v : block.values) {
+        auto const &value = values[v];
+        if (value.live && value.same_as < 0 && value.hoisted_to < 0 &&
+            !(fused && v == cond)) {
+          emit_value(v);
+        }
+      }
+      auto const &succs = cfg.blocks[b].succs;
+      switch (last) {
+      case Op::END:
+        emit(ROp::RET, n_args, slot(cond));
+        break;
+      case Op::FAILURE:
+        emit(ROp::FAILURE);
+        break;
+      case Op::STOP:
+        emit(ROp::STOP);
+        break;
+      case Op::CJMPZ:
+      case Op::CJMPNZ: {
+        bool is_z = last == Op::CJMPZ;
+        i32 target = succs[1];
+        size_t branch;
+        if (fused) {
+          auto const &binop = values[cond];
+          i32 l = resolve(binop.args[0]), r = resolve(binop.args[1]);
+          if (is_const(r)) {
+            branch = emit(is_z ? ROp::BR_BINOPI_Z : ROp::BR_BINOPI_NZ,
+                          slot(l), UNBOX(values[r].a), binop.a);
+          } else {
+            branch = emit(is_z ? ROp::BR_BINOP_Z : ROp::BR_BINOP_NZ, slot(l),
+                          slot(r), binop.a);
+          }
+        } else {
+          branch = emit(is_z ? ROp::CJMPZ : ROp::CJMPNZ, 0, slot(cond));
+        }
+        if (has_edge_code(b, target)) {
+          stub_jumps.push_back({branch, stubs.size()});
+          stubs.push_back({b, target});
+        } else {
+          jumps.push_back({branch, target});
+        }
+        [[fallthrough]];
+      }
+      default:
+        if (succs[0] == ControlFlowGraph::NONE) {
+          emit(ROp::STOP); // falls off the end of the code
+          break;
+        }
+        emit_edge_code(b, succs[0]);
+        if (succs[0] != next) {
+          jump_to_block(succs[0]);
+        }
+      }
+    }
+    std::vector<size_t> stub_start;
+    for (auto [p, s] : stubs) {
+      stub_start.push_back(out->code.size());
+      emit_edge_code(p, s);
+      jump_to_block(s);
+    }
+    for (auto [index, b] : jumps) {
+      jump_fixups.push_back({index, (size_t)block_start[b]});
+    }
+    for (auto [index, stub] : stub_jumps) {
+      jump_fixups.push_back({index, stub_start[stub]});
+    }
+  }
+};
+
+inline bool RegisterTranslator::translate_in_tier(i32 offset) {
+  if (tier == nullptr) {
+    return false;
+  }
+  finish_function();
+  enter_index = -1;
+  size_t start = out.code.size();
+  if (!tier->translate(offset, out, fixups, tier_fixups)) {
+    return false;
+  }
+  index_at[offset] = (i32)start;
+  return true;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include "predecoding-visitor.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+using u64 = std::uint64_t;
+
+// Superinstructions are fused in place: the first instruction of a sequence
+// gets the fused opcode and the rest stay where they are. The fused handler
+// reads their operands from the following slots and skips over them, so jumps
+// into the middle of a fused sequence still land on valid instructions.
+struct FusionRule {
+  Op fused;
+  u8 length;
+  Op pattern[3];
+};
+
+static FusionRule const fusion_rules[] = {
+    {Op::LD_LD_BINOP, 3, {Op::LD, Op::LD, Op::BINOP}},
+    {Op::DUP_TAG_CJMPZ, 3, {Op::DUP, Op::TAG, Op::CJMPZ}},
+    {Op::CONST_BINOP, 2, {Op::CONST, Op::BINOP}},
+    {Op::LD_CALL, 2, {Op::LD, Op::CALL}},
+    {Op::BINOP_CJMPZ, 2, {Op::BINOP, Op::CJMPZ}},
+    {Op::BINOP_CJMPNZ, 2, {Op::BINOP, Op::CJMPNZ}},
+    // enabled only when a profile asks for them
+    {Op::ST_DROP, 2, {Op::ST, Op::DROP}},
+    {Op::LD_LD, 2, {Op::LD, Op::LD}},
+};
+static size_t constexpr N_DEFAULT_FUSION_RULES = 6;
+
+// a sequence has to cover this share of all dispatches to get fused
+static u64 constexpr FUSION_THRESHOLD_PERMILLE = 5;
+
+struct BranchCount {
+  u64 executed = 0;
+  u64 taken = 0;
+};
+
+// Dynamic counts of opcode pairs and triples that were executed one right
+// after another without a control transfer in between.
+//
+// After track_blocks(), the run also counts how often every block was
+// executed and how often every conditional jump was taken, for the block
+// layout of the bytecode optimizer. Blocks are the instructions entered by
+// a control transfer or right after a conditional jump; finish_blocks()
+// turns the counts into `blocks` and `branches`, keyed by code offset.
+struct SequenceProfile {
+  static size_t constexpr N = (size_t)Op::LAST + 1; // Op::LAST is "nothing"
+  std::vector<u64> counts = std::vector<u64>(N * N * N, 0);
+  u64 total = 0;
+  Insn const *last = nullptr;
+  Op prev1 = Op::LAST;
+  Op prev2 = Op::LAST;
+  std::map<i32, u64> blocks;
+  std::map<i32, BranchCount> branches;
+
+  static size_t index(Op a, Op b, Op c = Op::LAST) {
+    return ((size_t)a * N + (size_t)b) * N + (size_t)c;
+  }
+
+  void track_blocks(PredecodedProgram const &program) {
+    code = &program;
+    executed.assign(program.code.size(), 0);
+    taken.assign(program.code.size(), 0);
+    entered.assign(program.code.size(), false);
+  }
+
+  void finish_blocks() {
+    for (size_t i = 0; i < executed.size(); i++) {
+      if (executed[i] == 0) {
+        continue;
+      }
+      i32 offset = code->offsets[i];
+      if (is_branch(code->code[i].op)) {
+        branches[offset] = BranchCount{executed[i], taken[i]};
+      }
+      if (entered[i] || (i > 0 && is_branch(code->code[i - 1].op))) {
+        blocks[offset] = executed[i];
+      }
+    }
+  }
+
+  void record(Insn const *ip) {
+    if (code != nullptr) {
+      size_t i = ip - code->code.data();
+      executed[i]++;
+      if (last != nullptr && ip != last + 1) {
+        entered[i] = true;
+        taken[last - code->code.data()] += is_branch(last->op);
+      }
+    }
+    if (last == nullptr || ip != last + 1) {
+      prev1 = prev2 = Op::LAST;
+    }
+    if (prev1 != Op::LAST) {
+      counts[index(prev1, ip->op)]++;
+    }
+    if (prev2 != Op::LAST) {
+      counts[index(prev2, prev1, ip->op)]++;
+    }
+    total++;
+    prev2 = prev1;
+    prev1 = ip->op;
+    last = ip;
+  }
+
+  u64 count(FusionRule const &rule) const {
+    return counts[index(rule.pattern[0], rule.pattern[1],
+                        rule.length == 3 ? rule.pattern[2] : Op::LAST)];
+  }
+
+private:
+  PredecodedProgram const *code = nullptr;
+  std::vector<u64> executed; // per predecoded instruction
+  std::vector<u64> taken;
+  std::vector<bool> entered; // by a control transfer
+
+  static bool is_branch(Op op) { return op == Op::CJMPZ || op == Op::CJMPNZ; }
+};
+
+static inline bool write_profile(SequenceProfile const &profile,
+                                 char const *fname) {
+  FILE *f = fopen(fname, "w");
+  if (f == nullptr) {
+    return false;
+  }
+  fprintf(f, "total %llu\n", (unsigned long long)profile.total);
+  auto const n = SequenceProfile::N;
+  for (size_t i = 0; i < profile.counts.size(); i++) {
+    if (profile.counts[i] == 0) {
+      continue;
+    }
+    size_t a = i / (n * n), b = (i / n) % n, c = i % n;
+    fprintf(f, "%llu %s %s", (unsigned long long)profile.counts[i],
+            op_names[a], op_names[b]);
+    if (c != (size_t)Op::LAST) {
+      fprintf(f, " %s", op_names[c]);
+    }
+    fprintf(f, "\n");
+  }
+  for (auto [offset, count] : profile.blocks) {
+    fprintf(f, "block %d %llu\n", offset, (unsigned long long)count);
+  }
+  for (auto [offset, count] : profile.branches) {
+    fprintf(f, "branch %d %llu %llu\n", offset,
+            (unsigned long long)count.executed,
+            (unsigned long long)count.taken);
+  }
+  fclose(f);
+  return true;
+}
+
+static inline Op op_by_name(char const *name) {
+  for (size_t i = 0; i < (size_t)Op::LAST; i++) {
+    if (strcmp(op_names[i], name) == 0) {
+      return (Op)i;
+    }
+  }
+  return Op::LAST;
+}
+
+static inline bool read_profile(SequenceProfile &profile, char const *fname) {
+  FILE *f = fopen(fname, "r");
+  if (f == nullptr) {
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    unsigned long long count;
+    char a[32], b[32], c[32];
+    unsigned long long taken;
+    i32 offset;
+    if (sscanf(line, "total %llu", &count) == 1) {
+      profile.total = count;
+      continue;
+    }
+    if (sscanf(line, "block %d %llu", &offset, &count) == 2) {
+      profile.blocks[offset] = count;
+      continue;
+    }
+    if (sscanf(line, "branch %d %llu %llu", &offset, &count, &taken) == 3) {
+      profile.branches[offset] = BranchCount{count, taken};
+      continue;
+    }
+    int fields = sscanf(line, "%llu %31s %31s %31s", &count, a, b, c);
+    if (fields < 3) {
+      continue;
+    }
+    Op third = fields == 4 ? op_by_name(c) : Op::LAST;
+    profile.counts[SequenceProfile::index(op_by_name(a), op_by_name(b),
+                                          third)] = count;
+  }
+  fclose(f);
+  return true;
+}
+
+using FusionSet = std::vector<FusionRule>;
+
+static inline FusionSet default_fusion_set() {
+  return FusionSet(fusion_rules, fusion_rules + N_DEFAULT_FUSION_RULES);
+}
+
+// Picks every known superinstruction whose sequence is hot enough in the
+// profile, keeping the longest-first order of `fusion_rules`.
+static inline FusionSet fusion_set_from_profile(SequenceProfile const &profile,
+                                                bool print_set = false) {
+  FusionSet set;
+  for (auto const &rule : fusion_rules) {
+    u64 count = profile.count(rule);
+    if (count * 1000 < profile.total * FUSION_THRESHOLD_PERMILLE ||
+        count == 0) {
+      continue;
+    }
+    set.push_back(rule);
+    if (print_set) {
+      fprintf(stderr, "superinstruction %s: %.2f%% of dispatches\n",
+              op_names[(size_t)rule.fused],
+              count * 100.0 / (profile.total ? profile.total : 1));
+    }
+  }
+  return set;
+}
+
+// Greedily fuses non-overlapping sequences from left to right. Returns the
+// number of fused sequences.
+static inline i32 fuse(PredecodedProgram &program, FusionSet const &set) {
+  i32 fused = 0;
+  auto &code = program.code;
+  for (size_t i = 0; i < code.size();) {
+    FusionRule const *match = nullptr;
+    for (auto const &rule : set) {
+      if (i + rule.length > code.size()) {
+        continue;
+      }
+      bool matches = true;
+      for (u8 k = 0; k < rule.length && matches; k++) {
+        matches = code[i + k].op == rule.pattern[k];
+      }
+      if (matches) {
+        match = &rule;
+        break;
+      }
+    }
+    if (match == nullptr) {
+      i++;
+      continue;
+    }
+    code[i].op = match->fused;
+    fused++;
+    i += match->length;
+  }
+  return fused;
+}
@@ -0,0 +1,733 @@
+#pragma once
+
+#include "decision-trees.h"
+#include "executing-visitor.h"
+#include "memoization.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include "superinstructions.h"
+#include <cstdio>
+#include <cstring>
+
+// The frame registers live in locals of the engine, so references are built
+// from them instead of from the `stack` struct.
+template <bool Check>
+static inline u32 *frame_reference(size_t *globals, size_t *bp, u32 n_args,
+                                   u32 kind, i32 index) {
+  switch (kind) {
+  case GLOBAL: {
+    if constexpr (Check) {
+      if (index > N_GLOBAL) {
+        error("querying out of bounds global");
+      }
+    }
+    return (u32 *)(globals + index);
+  }
+  case LOCAL:
+    return (u32 *)(bp - 1 - index);
+  case ARG:
+    return (u32 *)(bp + 2 + n_args - index);
+  case CAPTURED: {
+    u32 *closure = (u32 *)bp[2 + n_args + 1];
+    return &closure[1 + index];
+  }
+  default:
+    error("unsupported reference kind");
+    return nullptr;
+  }
+}
+
+// Looks the closure at code offset `addr` up in the inline cache of a CALLC
+// site, on a miss the oldest entry is replaced.
+template <bool Checks>
+static inline Insn *call_site_lookup(CallSiteCache &cache, i32 addr,
+                                     PredecodedProgram const &program) {
+  for (u32 i = 0; i < CallSiteCache::SIZE; i++) {
+    if (cache.offsets[i] == addr) {
+      return cache.entries[i];
+    }
+  }
+  if constexpr (Checks) {
+    bytefile const *bf = program.bf;
+    if (addr < 0 || addr >= bf->code_end - bf->code_ptr ||
+        !check_is_begin(bf, bf->code_ptr + addr)) {
+      error("CALLC does not call a function");
+    }
+  }
+  Insn *callee = program.insn_at[addr];
+  cache.offsets[cache.next] = addr;
+  cache.entries[cache.next] = callee;
+  cache.next = (cache.next + 1) % CallSiteCache::SIZE;
+  return callee;
+}
+
+// Allocates a cons cell with the given head and an empty tail, `head` may
+// move during the allocation, so it is read from the stack afterwards.
+static inline void *alloc_cons_cell(size_t &head, i32 tag_hash) {
+  data *r = (data *)alloc_sexp(2);
+  ((sexp *)r)->tag = UNBOX(tag_hash);
+  ((size_t *)r->contents)[1] = head;
+  ((size_t *)r->contents)[2] = BOX(0);
+  return r->contents;
+}
+
+// Direct-threaded interpreter over the predecoded stream: every instruction
+// carries the address of its handler, and each handler jumps straight to the
+// next one. With Profile every dispatch is recorded into `profile`.
+//
+// The stack pointer, base pointer and argument count are kept in locals so
+// that the compiler can hold them in machine registers; __gc_stack_top is
+// only written back at GC safepoints, i.e. before the runtime calls that may
+// allocate (SYNC), and reloaded after the ones that pop through the `stack`
+// struct (RELOAD).
+template <bool Checks, bool Profile = false>
+static inline void threaded_interpret(PredecodedProgram &program,
+                                      SequenceProfile *profile = nullptr) {
+#define HANDLER(op) &&op_##op
+  static void const *const handlers[] = {
+      HANDLER(BINOP), HANDLER(CONST), HANDLER(STRING), HANDLER(SEXP),
+      HANDLER(STI), HANDLER(STA), HANDLER(JMP), HANDLER(END), HANDLER(DROP),
+      HANDLER(DUP), HANDLER(SWAP), HANDLER(ELEM), HANDLER(LD), HANDLER(LDA),
+      HANDLER(ST), HANDLER(CJMPZ), HANDLER(CJMPNZ), HANDLER(BEGIN),
+      HANDLER(CBEGIN), HANDLER(CLOSURE), HANDLER(CALLC), HANDLER(CALL),
+      HANDLER(TAG), HANDLER(ARRAY), HANDLER(FAILURE), HANDLER(LINE),
+      HANDLER(PATT), HANDLER(LREAD), HANDLER(LWRITE), HANDLER(LLENGTH),
+      HANDLER(LSTRING), HANDLER(BARRAY), HANDLER(STOP), HANDLER(LD_LD_BINOP),
+      HANDLER(CONST_BINOP), HANDLER(DUP_TAG_CJMPZ), HANDLER(LD_CALL),
+      HANDLER(BINOP_CJMPZ), HANDLER(BINOP_CJMPNZ), HANDLER(ST_DROP),
+      HANDLER(LD_LD), HANDLER(LD_GLOBAL), HANDLER(LD_FRAME),
+      HANDLER(LD_CAPT), HANDLER(LDA_GLOBAL), HANDLER(LDA_FRAME),
+      HANDLER(LDA_CAPT), HANDLER(ST_GLOBAL), HANDLER(ST_FRAME),
+      HANDLER(ST_CAPT), HANDLER(ADD), HANDLER(SUB), HANDLER(MUL), HANDLER(DIV),
+      HANDLER(MOD), HANDLER(LT), HANDLER(LEQ), HANDLER(GT), HANDLER(GEQ),
+      HANDLER(EQ), HANDLER(NEQ), HANDLER(AND), HANDLER(OR), HANDLER(OBJECT),
+      HANDLER(TAILCALL), HANDLER(TAILCALLC), HANDLER(CONSCALL),
+      HANDLER(ADD_INT), HANDLER(SUB_INT), HANDLER(LT_INT), HANDLER(LEQ_INT),
+      HANDLER(GT_INT), HANDLER(GEQ_INT), HANDLER(EQ_INT), HANDLER(NEQ_INT),
+      HANDLER(CJMPZ_INT), HANDLER(CJMPNZ_INT), HANDLER(PATT_KNOWN),
+      HANDLER(BARRAY_FRAME), HANDLER(DECISION), HANDLER(CALLC_DIRECT),
+      HANDLER(TAILCALLC_DIRECT), HANDLER(CLOSURE_FRAME),
+      HANDLER(MEMO_BEGIN), HANDLER(LEAF_BEGIN), HANDLER(LEAF_END),
+      HANDLER(LD_ARG_SP), HANDLER(ST_ARG_SP),
+  };
+#undef HANDLER
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == (size_t)Op::LAST,
+                "every opcode needs a handler");
+  for (auto &insn : program.code) {
+    insn.handler = handlers[(u8)insn.op];
+  }
+
+  auto operands_stack = stack<u32, Checks>{};
+  __init();
+  CallSiteCache *const call_caches = program.call_caches.data();
+  DecisionNode const *const decisions = program.decisions.data();
+  Insn *ip = program.entry();
+  bool closure_call = false;
+  bool dps_call = false;
+  bool memo_call = false;
+  size_t *const stack_limit = (size_t *)operands_stack.data.data();
+  size_t *const main_frame = operands_stack.stack_begin - 1;
+  size_t *const globals = operands_stack.stack_begin + 1;
+  size_t *sp = __gc_stack_top;
+  size_t *bp = operands_stack.base_pointer;
+  u32 n_args = operands_stack.n_args;
+
+#define DISPATCH()                                                             \
+  {                                                                            \
+    if constexpr (Profile) {                                                   \
+      profile->record(ip);                                                     \
+    }                                                                          \
+    goto *ip->handler;                                                         \
+  }
+#define SKIP(n)                                                                \
+  {                                                                            \
+    ip += n;                                                                   \
+    DISPATCH();                                                                \
+  }
+#define NEXT() SKIP(1)
+#define PUSH(v) (*(sp--) = (size_t)(v))
+#define POP() (*(++sp))
+#define TOP() (sp[1])
+#define SYNC() (__gc_stack_top = sp)
+#define RELOAD() (sp = __gc_stack_top)
+// The n_words topmost values are moved over the arguments of the frame,
+// below the cells of a DPS frame, which the callee inherits.
+#define TAIL_CALL(n_words)                                                     \
+  {                                                                            \
+    u32 saved = UNBOX(bp[1]);                                                  \
+    size_t ret_ip = bp[2];                                                     \
+    dps_call = (saved >> DPS_FRAME_SHIFT) & 1;                                 \
+    size_t *bottom =                                                           \
+        bp + 2 + n_args + ((saved >> CLOSURE_FRAME_SHIFT) & 1) + 2 * dps_call; \
+    size_t *top = bottom - 2 * dps_call;                                       \
+    memmove((void *)(top - (n_words) + 1), (void *)(sp + 1),                   \
+            (n_words) * sizeof(size_t));                                       \
+    sp = top - (n_words);                                                      \
+    bp = (size_t *)bp[0];                                                      \
+    n_args = saved & 0xFFFF;                                                   \
+    PUSH(ret_ip);                                                              \
+  }
+#define REF(kind, index)                                                       \
+  frame_reference<Checks>(globals, bp, n_args, (kind), (index))
+  DISPATCH();
+
+op_BINOP: {
+  u32 t2 = UNBOX(POP());
+  u32 t1 = UNBOX(POP());
+  PUSH(BOX(arithm_op((i32)t1, (i32)t2, (BinopLabel)ip->a)));
+  NEXT();
+}
+op_CONST: {
+  PUSH(BOX(ip->a));
+  NEXT();
+}
+op_STRING: {
+  SYNC();
+  PUSH(Bstring((void *)ip->c.str));
+  NEXT();
+}
+op_SEXP: {
+  SYNC();
+  auto value = myBsexp_hashed(ip->a, operands_stack, ip->b);
+  RELOAD();
+  PUSH(value);
+  NEXT();
+}
+op_STI: {
+  u32 value = POP();
+  u32 reference = POP();
+  *(u32 *)reference = value;
+  PUSH(value);
+  NEXT();
+}
+op_STA: {
+  auto value = (void *)POP();
+  auto i = (int)POP();
+  auto x = (void *)POP();
+  SYNC();
+  PUSH(Bsta(value, i, x));
+  NEXT();
+}
+op_JMP: {
+  ip = ip->c.target;
+  DISPATCH();
+}
+op_END: {
+  if (bp == main_frame) {
+    goto done;
+  }
+  u32 ret_value = POP();
+  u32 top_n_args = n_args;
+  sp = bp - 1;
+  bp = (size_t *)POP();
+  u32 saved = UNBOX(POP());
+  if ((saved & (1 << MEMO_FRAME_SHIFT)) && UNBOXED(ret_value)) {
+    program.memo->insert(ip->c.target, sp + 2, top_n_args, ret_value);
+  }
+  n_args = saved & 0xFFFF;
+  ip = (Insn *)POP();
+  sp += top_n_args + ((saved >> CLOSURE_FRAME_SHIFT) & 1);
+  if (saved & (1 << DPS_FRAME_SHIFT)) {
+    sp += 2;
+    ((size_t *)sp[-1])[2] = ret_value;
+    ret_value = sp[0];
+  }
+  PUSH(ret_value);
+  DISPATCH();
+}
+op_DROP: {
+  ++sp;
+  NEXT();
+}
+op_DUP: {
+  u32 v = TOP();
+  PUSH(v);
+  NEXT();
+}
+op_SWAP: {
+  auto fst = TOP();
+  TOP() = sp[2];
+  sp[2] = fst;
+  NEXT();
+}
+op_ELEM: {
+  auto index = (int)POP();
+  auto obj = (void *)POP();
+  SYNC();
+  PUSH(Belem(obj, index));
+  NEXT();
+}
+op_LD: {
+  PUSH(*REF(ip->a, ip->b));
+  NEXT();
+}
+op_LDA: {
+  auto ref = REF(ip->a, ip->b);
+  PUSH(ref);
+  PUSH(ref);
+  NEXT();
+}
+op_ST: {
+  *REF(ip->a, ip->b) = TOP();
+  NEXT();
+}
+op_CJMPZ: {
+  if (UNBOX(POP()) == 0) {
+    ip = ip->c.target;
+    DISPATCH();
+  }
+  NEXT();
+}
+op_CJMPNZ: {
+  if (UNBOX(POP()) != 0) {
+    ip = ip->c.target;
+    DISPATCH();
+  }
+  NEXT();
+}
+op_BEGIN:
+op_CBEGIN: {
+  i32 n_locals = ip->b;
+  if (sp - stack_limit < ip->a + n_locals + 4 + ip->c.value) {
+    error("stack overflow");
+  }
+  PUSH(BOX(n_args | ((u32)closure_call << CLOSURE_FRAME_SHIFT) |
+           ((u32)dps_call << DPS_FRAME_SHIFT) |
+           ((u32)memo_call << MEMO_FRAME_SHIFT)));
+  PUSH(bp);
+  n_args = ip->a;
+  bp = sp + 1;
+  sp -= n_locals;
+  memset((void *)(sp + 1), 0, n_locals * sizeof(size_t));
+  closure_call = false;
+  dps_call = false;
+  memo_call = false;
+  NEXT();
+}
+op_CLOSURE: {
+  Capture const *captures = ip->c.captures;
+  for (i32 i = 0; i < ip->b; i++) {
+    PUSH(*REF(captures[i].kind, captures[i].index));
+  }
+  SYNC();
+  u32 v = (u32)myBclosure(ip->b, operands_stack, (void *)ip->a);
+  RELOAD();
+  PUSH(v);
+  NEXT();
+}
+// CALLC looks the closure up in the inline cache of its site and enters the
+// cached BEGIN directly, without decoding or dispatching it.
+op_CALLC: {
+  u32 closure = sp[1 + ip->a];
+  Insn *callee = call_site_lookup<Checks>(call_caches[ip->b],
+                                          ((i32 *)closure)[0], program);
+  PUSH(ip + 1);
+  closure_call = true;
+  ip = callee;
+  if constexpr (Profile) {
+    DISPATCH();
+  }
+  goto op_CBEGIN;
+}
+op_CALL: {
+  PUSH(ip + 1);
+  ip = ip->c.target;
+  DISPATCH();
+}
+op_TAG: {
+  u32 v = Btag((void *)POP(), ip->b, BOX(ip->a));
+  PUSH(v);
+  NEXT();
+}
+op_ARRAY: {
+  u32 v = Barray_patt((void *)POP(), BOX(ip->a));
+  PUSH(v);
+  NEXT();
+}
+op_FAILURE: { goto done; }
+op_LINE: { NEXT(); }
+op_PATT: {
+  if (ip->a == (i32)Patt::STR_EQ_TAG) {
+    auto arg = (void *)POP();
+    auto eq = (void *)POP();
+    PUSH(Bstring_patt(arg, eq));
+  } else {
+    auto arg = POP();
+    PUSH(patts_match((void *)arg, (Patt)ip->a));
+  }
+  NEXT();
+}
+op_LREAD: {
+  SYNC();
+  PUSH(Lread());
+  NEXT();
+}
+op_LWRITE: {
+  u32 value = UNBOX(TOP());
+  fprintf(stdout, "%d\n", i32(value));
+  TOP() = BOX(0);
+  NEXT();
+}
+op_LLENGTH: {
+  int value = (int)POP();
+  PUSH(Llength((void *)value));
+  NEXT();
+}
+op_LSTRING: {
+  auto value = (void *)TOP();
+  SYNC();
+  TOP() = (size_t)Lstring(value);
+  NEXT();
+}
+op_BARRAY: {
+  SYNC();
+  auto arr = myBarray(ip->a, operands_stack);
+  RELOAD();
+  PUSH(arr);
+  NEXT();
+}
+op_LD_LD_BINOP: {
+  i32 l = UNBOX(*REF(ip[0].a, ip[0].b));
+  i32 r = UNBOX(*REF(ip[1].a, ip[1].b));
+  PUSH(BOX(arithm_op(l, r, (BinopLabel)ip[2].a)));
+  SKIP(3);
+}
+op_CONST_BINOP: {
+  i32 l = UNBOX(TOP());
+  TOP() = BOX(arithm_op(l, ip[0].a, (BinopLabel)ip[1].a));
+  SKIP(2);
+}
+op_DUP_TAG_CJMPZ: {
+  u32 v = Btag((void *)TOP(), ip[1].b, BOX(ip[1].a));
+  if (UNBOX(v) == 0) {
+    ip = ip[2].c.target;
+    DISPATCH();
+  }
+  SKIP(3);
+}
+op_LD_CALL: {
+  PUSH(*REF(ip[0].a, ip[0].b));
+  PUSH(ip + 2);
+  ip = ip[1].c.target;
+  DISPATCH();
+}
+op_BINOP_CJMPZ: {
+  i32 r = UNBOX(POP());
+  i32 l = UNBOX(POP());
+  if (UNBOX(BOX(arithm_op(l, r, (BinopLabel)ip[0].a))) == 0) {
+    ip = ip[1].c.target;
+    DISPATCH();
+  }
+  SKIP(2);
+}
+op_BINOP_CJMPNZ: {
+  i32 r = UNBOX(POP());
+  i32 l = UNBOX(POP());
+  if (UNBOX(BOX(arithm_op(l, r, (BinopLabel)ip[0].a))) != 0) {
+    ip = ip[1].c.target;
+    DISPATCH();
+  }
+  SKIP(2);
+}
+op_ST_DROP: {
+  *REF(ip[0].a, ip[0].b) = POP();
+  SKIP(2);
+}
+op_LD_LD: {
+  PUSH(*REF(ip[0].a, ip[0].b));
+  PUSH(*REF(ip[1].a, ip[1].b));
+  SKIP(2);
+}
+op_LD_GLOBAL: {
+  PUSH(globals[ip->a]);
+  NEXT();
+}
+op_LD_FRAME: {
+  PUSH(bp[ip->a]);
+  NEXT();
+}
+op_LD_CAPT: {
+  PUSH(((size_t *)bp[ip->a])[ip->b]);
+  NEXT();
+}
+op_LDA_GLOBAL: {
+  auto ref = globals + ip->a;
+  PUSH(ref);
+  PUSH(ref);
+  NEXT();
+}
+op_LDA_FRAME: {
+  auto ref = bp + ip->a;
+  PUSH(ref);
+  PUSH(ref);
+  NEXT();
+}
+op_LDA_CAPT: {
+  auto ref = (size_t *)bp[ip->a] + ip->b;
+  PUSH(ref);
+  PUSH(ref);
+  NEXT();
+}
+op_ST_GLOBAL: {
+  globals[ip->a] = TOP();
+  NEXT();
+}
+op_ST_FRAME: {
+  bp[ip->a] = TOP();
+  NEXT();
+}
+op_ST_CAPT: {
+  ((size_t *)bp[ip->a])[ip->b] = TOP();
+  NEXT();
+}
+#define QUICK_BINOP(label, binop)                                              \
+  op_##label : {                                                               \
+    i32 r = UNBOX(POP());                                                      \
+    i32 l = UNBOX(TOP());                                                      \
+    TOP() = BOX(l binop r);                                                    \
+    NEXT();                                                                    \
+  }
+QUICK_BINOP(ADD, +)
+QUICK_BINOP(SUB, -)
+QUICK_BINOP(MUL, *)
+QUICK_BINOP(DIV, /)
+QUICK_BINOP(MOD, %)
+QUICK_BINOP(LT, <)
+QUICK_BINOP(LEQ, <=)
+QUICK_BINOP(GT, >)
+QUICK_BINOP(GEQ, >=)
+QUICK_BINOP(EQ, ==)
+QUICK_BINOP(NEQ, !=)
+QUICK_BINOP(AND, &&)
+QUICK_BINOP(OR, ||)
+#undef QUICK_BINOP
+op_OBJECT: {
+  PUSH(ip->c.object);
+  NEXT();
+}
+// Tail calls reuse the frame of the caller: the arguments (and the closure)
+// replace its arguments, the frame is popped as by END, and the callee returns
+// straight to our caller. The main function has no caller frame to reuse.
+op_TAILCALL: {
+  if (bp == main_frame) {
+    goto op_CALL;
+  }
+  Insn *callee = ip->c.target;
+  TAIL_CALL(ip->a);
+  closure_call = false;
+  ip = callee;
+  DISPATCH();
+}
+op_TAILCALLC: {
+  if (bp == main_frame) {
+    goto op_CALLC;
+  }
+  u32 closure = sp[1 + ip->a];
+  Insn *callee = call_site_lookup<Checks>(call_caches[ip->b],
+                                          ((i32 *)closure)[0], program);
+  TAIL_CALL(ip->a + 1);
+  closure_call = true;
+  ip = callee;
+  if constexpr (Profile) {
+    DISPATCH();
+  }
+  goto op_CBEGIN;
+}
+// Tail recursion modulo cons: `x : f(args)` at the end of a function. The
+// cons cell is allocated before the call with an empty tail, and f is
+// tail-called in destination-passing style: a DPS frame keeps the last
+// allocated cell and the first one (the root) above its arguments, and its
+// END stores the result into the tail of the last cell and returns the root.
+// Further CONSCALLs in a DPS frame append to the chain, so building a list
+// runs in constant stack.
+op_CONSCALL: {
+  if (bp == main_frame) {
+    goto op_CALL;
+  }
+  i32 n = ip->a;
+  SYNC();
+  size_t cell = (size_t)alloc_cons_cell(sp[1 + n], ip[1].b);
+  u32 saved = UNBOX(bp[1]);
+  size_t ret_ip = bp[2];
+  size_t *caller_bp = (size_t *)bp[0];
+  bool in_dps = (saved >> DPS_FRAME_SHIFT) & 1;
+  size_t *bottom =
+      bp + 2 + n_args + ((saved >> CLOSURE_FRAME_SHIFT) & 1) + 2 * in_dps;
+  if (in_dps) {
+    ((size_t *)bottom[-1])[2] = cell;
+  } else {
+    bottom[0] = cell;
+  }
+  bottom[-1] = cell;
+  memmove((void *)(bottom - 2 - n + 1), (void *)(sp + 1), n * sizeof(size_t));
+  sp = bottom - 2 - n;
+  bp = caller_bp;
+  n_args = saved & 0xFFFF;
+  PUSH(ret_ip);
+  closure_call = false;
+  dps_call = true;
+  ip = ip->c.target;
+  DISPATCH();
+}
+// Both operands are known to be ints: BOX(x) = 2x + 1 is monotonic, so sums
+// and comparisons work on the boxed words directly.
+op_ADD_INT: {
+  i32 r = (i32)POP();
+  TOP() = (i32)TOP() + r - 1;
+  NEXT();
+}
+op_SUB_INT: {
+  i32 r = (i32)POP();
+  TOP() = (i32)TOP() - r + 1;
+  NEXT();
+}
+#define INT_COMPARISON(label, binop)                                           \
+  op_##label##_INT : {                                                         \
+    i32 r = (i32)POP();                                                        \
+    TOP() = BOX((i32)TOP() binop r);                                           \
+    NEXT();                                                                    \
+  }
+INT_COMPARISON(LT, <)
+INT_COMPARISON(LEQ, <=)
+INT_COMPARISON(GT, >)
+INT_COMPARISON(GEQ, >=)
+INT_COMPARISON(EQ, ==)
+INT_COMPARISON(NEQ, !=)
+#undef INT_COMPARISON
+op_CJMPZ_INT: {
+  if (POP() == BOX(0)) {
+    ip = ip->c.target;
+    DISPATCH();
+  }
+  NEXT();
+}
+op_CJMPNZ_INT: {
+  if (POP() != BOX(0)) {
+    ip = ip->c.target;
+    DISPATCH();
+  }
+  NEXT();
+}
+op_PATT_KNOWN: {
+  TOP() = ip->a;
+  NEXT();
+}
+// the array lives in the locals area, its header at bp - b, see
+// escape-analysis.h
+op_BARRAY_FRAME: {
+  i32 n = ip->a;
+  data *r = (data *)(bp - ip->b);
+  r->data_header = ARRAY_TAG | (n << 3);
+  r->forward_address = 0;
+  for (i32 i = 0; i < n; i++) {
+    ((size_t *)r->contents)[i] = sp[n - i];
+  }
+  sp += n;
+  PUSH(r->contents);
+  NEXT();
+}
+op_DECISION: {
+  ip = decide(decisions[ip->b], TOP());
+  DISPATCH();
+}
+// the closure is known to be a closure of the function at c.target
+op_CALLC_DIRECT: {
+  PUSH(ip + 1);
+  closure_call = true;
+  ip = ip->c.target;
+  if constexpr (Profile) {
+    DISPATCH();
+  }
+  goto op_CBEGIN;
+}
+op_TAILCALLC_DIRECT: {
+  if (bp == main_frame) {
+    goto op_CALLC_DIRECT;
+  }
+  Insn *callee = ip->c.target;
+  TAIL_CALL(ip->a + 1);
+  closure_call = true;
+  ip = callee;
+  if constexpr (Profile) {
+    DISPATCH();
+  }
+  goto op_CBEGIN;
+}
+// b holds the number of captured variables in the lower half and the offset
+// of the closure header below bp in the upper half
+op_CLOSURE_FRAME: {
+  i32 n = ip->b & 0xFFFF;
+  data *r = (data *)(bp - ((u32)ip->b >> 16));
+  r->data_header = CLOSURE_TAG | ((n + 1) << 3);
+  r->forward_address = 0;
+  ((i32 *)r->contents)[0] = ip->a;
+  Capture const *captures = ip->c.captures;
+  for (i32 i = 0; i < n; i++) {
+    ((u32 *)r->contents)[1 + i] = *REF(captures[i].kind, captures[i].index);
+  }
+  PUSH(r->contents);
+  NEXT();
+}
+// The arguments are above the return address. A call with int arguments
+// that is in the table returns at once, other calls with int arguments run
+// in a marked frame whose END records the result.
+op_MEMO_BEGIN: {
+  u32 n = ip->a;
+  size_t const *args = sp + 2;
+  bool ints = !closure_call && !dps_call;
+  for (u32 i = 0; ints && i < n; i++) {
+    ints = UNBOXED(args[i]);
+  }
+  if (ints) {
+    u32 result;
+    if (program.memo->lookup(ip, args, n, result)) {
+      ip = (Insn *)sp[1];
+      sp += 1 + n;
+      PUSH(result);
+      DISPATCH();
+    }
+    memo_call = true;
+  }
+  goto op_BEGIN;
+}
+// Leaf functions have no frame, see leaf-functions.h. Above the operands are
+// the return address and the arguments; the slots of the arguments relative
+// to sp are known from the stack depth.
+op_LEAF_BEGIN: {
+  if (sp - stack_limit < ip->a + 4 + ip->c.value) {
+    error("stack overflow");
+  }
+  NEXT();
+}
+op_LEAF_END: {
+  size_t result = sp[1];
+  Insn *ret_ip = (Insn *)sp[1 + ip->b];
+  sp += 1 + ip->b + ip->a;
+  ip = ret_ip;
+  PUSH(result);
+  DISPATCH();
+}
+op_LD_ARG_SP: {
+  size_t value = sp[ip->b];
+  PUSH(value);
+  NEXT();
+}
+op_ST_ARG_SP: {
+  sp[ip->b] = TOP();
+  NEXT();
+}
+op_STOP:
+done:
+  SYNC();
+  return;
+#undef REF
+#undef TAIL_CALL
+#undef RELOAD
+#undef SYNC
+#undef TOP
+#undef POP
+#undef PUSH
+#undef NEXT
+#undef SKIP
+#undef DISPATCH
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "control-flow.h"
+#include "lama-enums.h"
+#include "predecoding-visitor.h"
+#include "runtime-decl.h"
+#include <vector>
+
+// Abstract value of a stack slot or a local. The heap kinds join into REF,
+// anything joined with INT (or a raw word) is ANY; NONE is "not reached yet".
+enum class ValueType : u8 { NONE, INT, STRING, ARRAY, SEXP, CLOSURE, REF, ANY };
+
+static inline ValueType join(ValueType a, ValueType b) {
+  if (a == b || b == ValueType::NONE) {
+    return a;
+  }
+  if (a == ValueType::NONE) {
+    return b;
+  }
+  auto is_heap = [](ValueType t) {
+    return t != ValueType::INT && t != ValueType::ANY;
+  };
+  return is_heap(a) && is_heap(b) ? ValueType::REF : ValueType::ANY;
+}
+
+// types of the two topmost stack slots right before an instruction
+struct OperandTypes {
+  ValueType top = ValueType::ANY;
+  ValueType second = ValueType::ANY;
+};
+
+// Returns BOX(1) or BOX(0) if the outcome of PATT `patt` on a value of type
+// `t` is known, 0 otherwise.
+static inline i32 known_patt_result(Patt patt, ValueType t) {
+  if (t == ValueType::ANY || t == ValueType::NONE) {
+    return 0;
+  }
+  bool is_int = t == ValueType::INT;
+  auto heap_kind = [&](ValueType kind) {
+    if (t == kind) {
+      return (i32)BOX(1);
+    }
+    return is_int || t != ValueType::REF ? (i32)BOX(0) : 0;
+  };
+  switch (patt) {
+  case Patt::BOXED:
+    return BOX(is_int ? 0 : 1);
+  case Patt::UNBOXED:
+    return BOX(is_int ? 1 : 0);
+  case Patt::STR_TAG:
+    return heap_kind(ValueType::STRING);
+  case Patt::ARR_TAG:
+    return heap_kind(ValueType::ARRAY);
+  case Patt::SEXPR_TAG:
+    return heap_kind(ValueType::SEXP);
+  case Patt::CLOS_TAG:
+    return heap_kind(ValueType::CLOSURE);
+  default:
+    return 0;
+  }
+}
+
+// Forward abstract interpretation over the control-flow graph: every stack
+// slot and local gets a ValueType, joined at block entries until nothing
+// changes. Arguments, globals, captured variables, call results and loaded
+// elements are ANY; so are locals whose address is taken by LDA, since STI may
+// write them behind our back. Runs on the predecoded program before fusion,
+// quickening and constant preallocation, and requires check_depth to have
+// accepted the program.
+class TypeInference {
+public:
+  TypeInference(ControlFlowGraph const &cfg, PredecodedProgram const &program)
+      : cfg(cfg), program(program) {}
+
+  // Returns the operand types of every instruction of program.code.
+  std::vector<OperandTypes> infer() {
+    types.assign(program.code.size(), OperandTypes{});
+    states.assign(cfg.blocks.size(), State{});
+    for (auto const &function : cfg.functions) {
+      find_address_taken(cfg, program, function, escaping);
+      states[function.order[0]].reached = true;
+      for (bool changed = true; changed;) {
+        changed = false;
+        for (i32 b : function.order) {
+          if (!states[b].reached) {
+            continue;
+          }
+          State state = states[b];
+          cfg.for_each_insn(b, [&](i32 offset) {
+            if (Insn const *insn = program.insn_starting_at(offset)) {
+              types[insn - program.code.data()] = operand_types(state);
+              transfer(*insn, state);
+            }
+          });
+          for (i32 s : cfg.blocks[b].succs) {
+            if (s != ControlFlowGraph::NONE) {
+              changed = merge(states[s], state) || changed;
+            }
+          }
+        }
+      }
+    }
+    return types;
+  }
+
+private:
+  struct State {
+    bool reached = false;
+    std::vector<ValueType> stack; // the top is at the back
+    std::vector<ValueType> locals;
+  };
+
+  ControlFlowGraph const &cfg;
+  PredecodedProgram const &program;
+  std::vector<OperandTypes> types;
+  std::vector<State> states; // at block entries
+  std::vector<bool> escaping; // locals of the current function
+
+  static bool merge(State &into, State const &from) {
+    if (!into.reached) {
+      into = from;
+      return true;
+    }
+    bool changed = false;
+    auto merge_all = [&changed](std::vector<ValueType> &a,
+                                std::vector<ValueType> const &b) {
+      if (a.size() != b.size()) {
+        error("type inference: stack depth mismatch");
+      }
+      for (size_t i = 0; i < a.size(); i++) {
+        ValueType joined = join(a[i], b[i]);
+        changed = changed || joined != a[i];
+        a[i] = joined;
+      }
+    };
+    merge_all(into.stack, from.stack);
+    merge_all(into.locals, from.locals);
+    return changed;
+  }
+
+  static OperandTypes operand_types(State const &state) {
+    auto const &stack = state.stack;
+    OperandTypes result;
+    if (!stack.empty()) {
+      result.top = stack.back();
+    }
+    if (stack.size() >= 2) {
+      result.second = stack[stack.size() - 2];
+    }
+    return result;
+  }
+
+  static ValueType pop(State &state) {
+    if (state.stack.empty()) {
+      return ValueType::ANY;
+    }
+    ValueType t = state.stack.back();
+    state.stack.pop_back();
+    return t;
+  }
+  static void pop(State &state, i32 n) {
+    for (i32 i = 0; i < n; i++) {
+      pop(state);
+    }
+  }
+  static void push(State &state, ValueType t) { state.stack.push_back(t); }
+
+  ValueType local(State const &state, i32 index) const {
+    if (index < 0 || index >= (i32)state.locals.size() ||
+        (index < (i32)escaping.size() && escaping[index])) {
+      return ValueType::ANY;
+    }
+    return state.locals[index];
+  }
+
+  void transfer(Insn const &insn, State &state) const {
+    switch (insn.op) {
+    case Op::BEGIN:
+    case Op::CBEGIN:
+      // BEGIN zeroes the locals, a raw 0 is neither an int nor a reference
+      state.stack.clear();
+      state.locals.assign(insn.b, ValueType::ANY);
+      break;
+    case Op::BINOP:
+    case Op::ELEM:
+      pop(state, 2);
+      push(state, insn.op == Op::BINOP ? ValueType::INT : ValueType::ANY);
+      break;
+    case Op::CONST:
+    case Op::LREAD:
+      push(state, ValueType::INT);
+      break;
+    case Op::STRING:
+      push(state, ValueType::STRING);
+      break;
+    case Op::OBJECT:
+      push(state, ValueType::REF);
+      break;
+    case Op::SEXP:
+      pop(state, insn.a);
+      push(state, ValueType::SEXP);
+      break;
+    case Op::STI: {
+      ValueType value = pop(state);
+      pop(state);
+      push(state, value);
+      break;
+    }
+    case Op::STA:
+      pop(state, 3);
+      push(state, ValueType::ANY);
+      break;
+    case Op::DROP:
+    case Op::CJMPZ:
+    case Op::CJMPNZ:
+      pop(state);
+      break;
+    case Op::DUP: {
+      ValueType t = pop(state);
+      push(state, t);
+      push(state, t);
+      break;
+    }
+    case Op::SWAP: {
+      ValueType top = pop(state);
+      ValueType second = pop(state);
+      push(state, top);
+      push(state, second);
+      break;
+    }
+    case Op::LD:
+      push(state, insn.a == (i32)LOCAL ? local(state, insn.b) : ValueType::ANY);
+      break;
+    case Op::LDA:
+      push(state, ValueType::ANY);
+      push(state, ValueType::ANY);
+      break;
+    case Op::ST:
+      if (insn.a == (i32)LOCAL && insn.b >= 0 &&
+          insn.b < (i32)state.locals.size()) {
+        state.locals[insn.b] =
+            state.stack.empty() ? ValueType::ANY : state.stack.back();
+      }
+      break;
+    case Op::CLOSURE:
+      push(state, ValueType::CLOSURE);
+      break;
+    case Op::CALLC:
+    case Op::TAILCALLC:
+    case Op::CALLC_DIRECT:
+    case Op::TAILCALLC_DIRECT:
+      pop(state, insn.a + 1);
+      push(state, ValueType::ANY);
+      break;
+    case Op::CALL:
+    case Op::TAILCALL:
+    case Op::CONSCALL:
+      pop(state, insn.a);
+      push(state, ValueType::ANY);
+      break;
+    case Op::TAG:
+    case Op::ARRAY:
+    case Op::LWRITE:
+    case Op::LLENGTH:
+      pop(state);
+      push(state, ValueType::INT);
+      break;
+    case Op::PATT:
+      pop(state, insn.a == (i32)Patt::STR_EQ_TAG ? 2 : 1);
+      push(state, ValueType::INT);
+      break;
+    case Op::LSTRING:
+      pop(state);
+      push(state, ValueType::STRING);
+      break;
+    case Op::BARRAY:
+      pop(state, insn.a);
+      push(state, ValueType::ARRAY);
+      break;
+    case Op::JMP:
+    case Op::END:
+    case Op::FAILURE:
+    case Op::STOP:
+      break;
+    default:
+      error("type inference: unexpected %s", op_names[(u8)insn.op]);
+    }
+  }
+};
@@ -10,6 +10,7 @@
 using i32 = std::int32_t;
 using u32 = std::uint32_t;
 using u8 = std::uint8_t;
+using u64 = std::uint64_t;
 
 u32 const GLOBAL = 1;
 u32 const LOCAL = 2;